@@ -0,0 +1,153 @@
+module;
+
+#include <karm/macros>
+
+#include <new>
+
+export module Luna:arena;
+
+import :base;
+
+namespace Luna {
+
+// MARK: Arena -----------------------------------------------------------------
+
+// Bump allocator for the nodes of a parsed program. Nodes are still reference
+// counted and destroyed one by one, but their memory goes back to the arena,
+// which is freed in one go once its owner and every node allocated from it
+// are gone.
+//
+// Every allocation is prefixed with a pointer to its arena, so that a node
+// can find it back when it is deleted.
+export struct Arena {
+    static constexpr usize CHUNK = 64 * 1024;
+
+    Vec<u8*> _chunks;
+    u8* _ptr = nullptr;
+    u8* _end = nullptr;
+    usize _refs = 1; // The owner and every live node
+
+    static Arena*& current() {
+        static Arena* arena = nullptr;
+        return arena;
+    }
+
+    void ref() {
+        _refs++;
+    }
+
+    void deref() {
+        if (--_refs)
+            return;
+        for (auto* chunk : _chunks)
+            ::operator delete(chunk);
+        delete this;
+    }
+
+    void* alloc(usize size, usize align) {
+        if (align < alignof(Arena*))
+            align = alignof(Arena*);
+
+        auto addr = reinterpret_cast<usize>(_ptr) + sizeof(Arena*);
+        auto* mem = reinterpret_cast<u8*>((addr + align - 1) & ~(align - 1));
+        if (not _ptr or mem + size > _end) {
+            usize len = CHUNK;
+            if (size + align + sizeof(Arena*) > len)
+                len = size + align + sizeof(Arena*);
+            _ptr = static_cast<u8*>(::operator new(len));
+            _end = _ptr + len;
+            _chunks.pushBack(_ptr);
+
+            addr = reinterpret_cast<usize>(_ptr) + sizeof(Arena*);
+            mem = reinterpret_cast<u8*>((addr + align - 1) & ~(align - 1));
+        }
+
+        reinterpret_cast<Arena**>(mem)[-1] = this;
+        _ptr = mem + size;
+        ref();
+        return mem;
+    }
+
+    static void free(void* mem) {
+        reinterpret_cast<Arena**>(mem)[-1]->deref();
+    }
+
+    template <typename T, typename... Args>
+    Rc<T> make(Args&&... args);
+};
+
+// A reference counted cell living in an arena, deleting it only hands its
+// memory back.
+template <typename T>
+struct ArenaCell : Cell<T> {
+    using Cell<T>::Cell;
+
+    static void operator delete(void* mem) {
+        Arena::free(mem);
+    }
+};
+
+template <typename T, typename... Args>
+Rc<T> Arena::make(Args&&... args) {
+    void* mem = alloc(sizeof(ArenaCell<T>), alignof(ArenaCell<T>));
+    return {MOVE, new (mem) ArenaCell<T>(std::forward<Args>(args)...)};
+}
+
+// Makes opNew allocate from an arena for as long as the scope lives.
+export struct ArenaScope {
+    Arena* _prev;
+
+    ArenaScope(Arena& arena) : _prev(Arena::current()) {
+        Arena::current() = &arena;
+    }
+
+    ~ArenaScope() {
+        Arena::current() = _prev;
+    }
+};
+
+// MARK: Pool ------------------------------------------------------------------
+
+// Recycles the cells of objects that are created and dropped at a high rate,
+// such as the environments of calls and loop bodies, through a free-list.
+export template <typename T>
+struct Pool {
+    static constexpr usize MAX = 256; // Free cells kept around
+
+    Vec<void*> _free;
+
+    // Never destroyed, cells may still be released during static
+    // destruction.
+    static Pool& instance() {
+        static Pool* pool = new Pool();
+        return *pool;
+    }
+
+    template <typename... Args>
+    Rc<T> make(Args&&... args);
+
+    void release(void* mem) {
+        if (_free.len() < MAX)
+            _free.pushBack(mem);
+        else
+            ::operator delete(mem);
+    }
+};
+
+template <typename T>
+struct PoolCell : Cell<T> {
+    using Cell<T>::Cell;
+
+    static void operator delete(void* mem) {
+        Pool<T>::instance().release(mem);
+    }
+};
+
+template <typename T>
+template <typename... Args>
+Rc<T> Pool<T>::make(Args&&... args) {
+    void* mem = _free.len() ? _free.popBack() : ::operator new(sizeof(PoolCell<T>));
+    return {MOVE, new (mem) PoolCell<T>(std::forward<Args>(args)...)};
+}
+
+} // namespace Luna
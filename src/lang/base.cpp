@@ -2,6 +2,10 @@ module;
 
 #include <karm/macros>
 
+#include <bit>
+#include <cstring>
+#include <new>
+
 export module Luna:base;
 
 import Karm.Core;
@@ -12,6 +16,14 @@ namespace Luna {
 
 export struct Base;
 
+export struct Compiler;
+
+export struct Resolver;
+
+export struct Optimizer;
+
+export struct Heap;
+
 // MARK: Primitives ------------------------------------------------------------
 
 using Reference = Rc<Base>;
@@ -22,8 +34,324 @@ export using Integer = i64;
 
 export using Number = f64;
 
-export using Value = Union<
-    None, Boolean, Integer, Number, Symbol, String, Reference>;
+// A value fits in a single 64-bit word (NaN-boxing):
+//
+//   0000 0000 0000 0002   none
+//   0000 0000 0000 000x   false (6) and true (7)
+//   0000 pppp pppp pppt   pointer to a heap object, t tags what it boxes
+//   0002 .... .... ....   number, offset by 2^49 so that no double
+//   ...                   uses the top 16 bits of the other kinds
+//   fffc .... .... ....
+//   fffe 0000 ssss ssss   symbol, index in the symbol table
+//   ffff iiii iiii iiii   integer that fits in 48 bits
+//
+// Strings and integers too large to be inlined live on the heap, the low
+// bits of their pointer set them apart from plain objects. Strings are not
+// behind an Rc, the value counts their references itself.
+struct StringBox;
+
+export struct Value {
+    enum struct Kind : u8 {
+        NONE,
+        BOOLEAN,
+        INTEGER,
+        NUMBER,
+        SYMBOL,
+        STRING,
+        OBJECT,
+    };
+
+    using enum Kind;
+
+    static constexpr u64 _NONE = 0x2;
+    static constexpr u64 _FALSE = 0x6;
+    static constexpr u64 _TRUE = 0x7;
+
+    static constexpr u64 _NUMBER_OFFSET = 1ull << 49;
+    static constexpr u64 _CANONICAL_NAN = 0x7ff8000000000000ull;
+
+    static constexpr u64 _SYMBOL_TAG = 0xfffeull << 48;
+    static constexpr u64 _INTEGER_TAG = 0xffffull << 48;
+    static constexpr u64 _PAYLOAD = (1ull << 48) - 1;
+
+    static constexpr i64 _INTEGER_MIN = -(1ll << 47);
+    static constexpr i64 _INTEGER_MAX = (1ll << 47) - 1;
+
+    static constexpr u64 _HEAP_TAG = 0x7;
+    static constexpr u64 _STRING_TAG = 0x1;
+    static constexpr u64 _BIG_INTEGER_TAG = 0x2;
+
+    union {
+        u64 _bits;
+        Reference _ref; // Only while the value is an object
+    };
+
+    // MARK: Construction
+
+    Value() : _bits(_NONE) {}
+
+    Value(None) : _bits(_NONE) {}
+
+    // Not a plain Value(Boolean), pointers would silently convert to it
+    template <typename B>
+        requires std::is_same_v<B, Boolean>
+    Value(B b) : _bits(b ? _TRUE : _FALSE) {}
+
+    Value(Integer i) {
+        if (i >= _INTEGER_MIN and i <= _INTEGER_MAX) [[likely]]
+            _bits = _INTEGER_TAG | (static_cast<u64>(i) & _PAYLOAD);
+        else
+            _bits = _adopt(_box(i), _BIG_INTEGER_TAG);
+    }
+
+    template <typename I>
+        requires(std::is_integral_v<I> and not std::is_same_v<I, bool> and not std::is_same_v<I, Integer>)
+    Value(I i) : Value(static_cast<Integer>(i)) {}
+
+    Value(Number n) {
+        if (n != n)
+            _bits = _CANONICAL_NAN + _NUMBER_OFFSET;
+        else
+            _bits = std::bit_cast<u64>(n) + _NUMBER_OFFSET;
+    }
+
+    Value(Symbol sym) : _bits(_SYMBOL_TAG | _intern(sym)) {}
+
+    Value(String str);
+
+    Value(Reference ref) {
+        new (&_ref) Reference(std::move(ref));
+    }
+
+    Value(Value const& other) : _bits(other._bits) {
+        if (_isHeap())
+            _retain();
+    }
+
+    Value(Value&& other) : _bits(std::exchange(other._bits, _NONE)) {}
+
+    Value& operator=(Value other) {
+        std::swap(_bits, other._bits);
+        return *this;
+    }
+
+    ~Value() {
+        if (_isHeap())
+            _release();
+    }
+
+    // MARK: Heap
+
+    bool _isHeap() const {
+        return (_bits >> 48) == 0 and _bits > _TRUE;
+    }
+
+    static Reference _box(Integer i);
+
+    // Hand over the reference to the returned bits.
+    static u64 _adopt(Reference ref, u64 tag) {
+        Value v;
+        new (&v._ref) Reference(std::move(ref));
+        return std::exchange(v._bits, _NONE) | tag;
+    }
+
+    void _retain() const;
+
+    void _release();
+
+    static void _retainRef(u64 ptr) {
+        Value v, copy;
+        v._bits = ptr;
+        new (&copy._ref) Reference(v._ref);
+        v._bits = copy._bits = _NONE;
+    }
+
+    static void _releaseRef(u64 ptr) {
+        Value v;
+        v._bits = ptr;
+        v._ref.~Reference();
+        v._bits = _NONE;
+    }
+
+    Base& _heap() const {
+        Value v;
+        v._bits = _bits & ~_HEAP_TAG;
+        auto& obj = v._ref.unwrap();
+        v._bits = _NONE;
+        return obj;
+    }
+
+    StringBox* _text() const {
+        return reinterpret_cast<StringBox*>(_bits & ~_HEAP_TAG);
+    }
+
+    static Value _adoptString(StringBox* box);
+
+    Str _string() const;
+
+    Integer _integer() const;
+
+    // MARK: Symbols
+
+    struct _SymbolTable {
+        Vec<Symbol> symbols;
+        Map<Symbol, u64> ids;
+    };
+
+    static _SymbolTable& _symbolTable() {
+        static _SymbolTable table;
+        return table;
+    }
+
+    static u64 _intern(Symbol sym) {
+        auto& table = _symbolTable();
+        if (auto id = table.ids.lookup(sym))
+            return id.unwrap();
+        u64 id = table.symbols.len();
+        table.symbols.pushBack(sym);
+        table.ids.put(sym, id);
+        return id;
+    }
+
+    // MARK: Access
+
+    Kind kind() const {
+        auto tag = _bits >> 48;
+        if (tag == 0xffff)
+            return Kind::INTEGER;
+        if (tag == 0xfffe)
+            return Kind::SYMBOL;
+        if (tag)
+            return Kind::NUMBER;
+        if (_bits == _NONE)
+            return Kind::NONE;
+        if (_bits <= _TRUE)
+            return Kind::BOOLEAN;
+        if ((_bits & _HEAP_TAG) == _STRING_TAG)
+            return Kind::STRING;
+        if ((_bits & _HEAP_TAG) == _BIG_INTEGER_TAG)
+            return Kind::INTEGER;
+        return Kind::OBJECT;
+    }
+
+    // Scalars are decoded into an Opt, objects are borrowed in place and
+    // strings as a view of their bytes.
+    template <typename T>
+    auto is() const {
+        if constexpr (std::is_same_v<T, None>) {
+            return _bits == _NONE;
+        } else if constexpr (std::is_same_v<T, Reference>) {
+            return kind() == Kind::OBJECT ? &_ref : nullptr;
+        } else if constexpr (std::is_same_v<T, Str>) {
+            if (kind() != Kind::STRING)
+                return Opt<Str>{Karm::NONE};
+            return Opt<Str>{_string()};
+        } else {
+            if (kind() != _kindOf<T>())
+                return Opt<T>{Karm::NONE};
+            return Opt<T>{unwrap<T>()};
+        }
+    }
+
+    template <typename T>
+    static constexpr Kind _kindOf() {
+        if constexpr (std::is_same_v<T, Boolean>)
+            return Kind::BOOLEAN;
+        else if constexpr (std::is_same_v<T, Integer>)
+            return Kind::INTEGER;
+        else if constexpr (std::is_same_v<T, Number>)
+            return Kind::NUMBER;
+        else if constexpr (std::is_same_v<T, Symbol>)
+            return Kind::SYMBOL;
+        else
+            static_assert(sizeof(T) == 0, "not a value type");
+    }
+
+    template <typename T>
+    decltype(auto) unwrap() const {
+        if constexpr (std::is_same_v<T, None>) {
+            return None{};
+        } else if constexpr (std::is_same_v<T, Boolean>) {
+            return _bits == _TRUE;
+        } else if constexpr (std::is_same_v<T, Integer>) {
+            if ((_bits >> 48) == 0xffff) [[likely]]
+                return static_cast<Integer>(_bits << 16) >> 16;
+            return _integer();
+        } else if constexpr (std::is_same_v<T, Number>) {
+            return std::bit_cast<Number>(_bits - _NUMBER_OFFSET);
+        } else if constexpr (std::is_same_v<T, Symbol>) {
+            return Symbol{_symbolTable().symbols[_bits & _PAYLOAD]};
+        } else if constexpr (std::is_same_v<T, String>) {
+            return String{_string()};
+        } else if constexpr (std::is_same_v<T, Str>) {
+            return _string();
+        } else if constexpr (std::is_same_v<T, Reference>) {
+            return static_cast<Reference const&>(_ref);
+        } else {
+            static_assert(sizeof(T) == 0, "not a value type");
+        }
+    }
+
+    template <typename T>
+    T take() const {
+        return unwrap<T>();
+    }
+
+    template <typename V>
+    decltype(auto) visit(V&& visitor) const {
+        switch (kind()) {
+        case Kind::NONE: {
+            None v{};
+            return visitor(v);
+        }
+        case Kind::BOOLEAN: {
+            Boolean v = unwrap<Boolean>();
+            return visitor(v);
+        }
+        case Kind::INTEGER: {
+            Integer v = unwrap<Integer>();
+            return visitor(v);
+        }
+        case Kind::NUMBER: {
+            Number v = unwrap<Number>();
+            return visitor(v);
+        }
+        case Kind::SYMBOL: {
+            Symbol v = unwrap<Symbol>();
+            return visitor(v);
+        }
+        case Kind::STRING: {
+            Str v = _string();
+            return visitor(v);
+        }
+        default:
+            return visitor(_ref);
+        }
+    }
+
+    bool operator==(Value const& other) const {
+        auto k = kind();
+        if (k != other.kind())
+            return false;
+        switch (k) {
+        case Kind::NUMBER:
+            return unwrap<Number>() == other.unwrap<Number>();
+        case Kind::INTEGER:
+            return unwrap<Integer>() == other.unwrap<Integer>();
+        case Kind::STRING:
+            return _stringEq(other);
+        default:
+            return _bits == other._bits;
+        }
+    }
+
+    bool _stringEq(Value const& other) const;
+
+    void hash(Hasher& h) const;
+};
+
+static_assert(sizeof(Reference) == sizeof(u64), "a reference must fit in a value");
+static_assert(sizeof(Value) == sizeof(u64));
 
 namespace Symbols {
 
@@ -48,10 +376,8 @@ Symbol OBJECT = "Object"_sym;
 
 export struct Completion {
     enum struct Type {
-        RETURN,
-        CONTINUE,
-        BREAK,
         EXCEPTION,
+        TAIL_CALL, // The call is left to the function being returned from
 
         _LEN,
     };
@@ -61,16 +387,9 @@ export struct Completion {
     Type type;
     Value value;
 
-    static Completion return_(Value value) {
-        return Completion(Completion::RETURN, value);
-    }
-
-    static Completion continue_(Value value) {
-        return Completion(Completion::CONTINUE, value);
-    }
-
-    static Completion break_(Value value) {
-        return Completion(Completion::BREAK, value);
+    // The value is the TailCall to make.
+    static Completion tailCall(Value call) {
+        return Completion(Completion::TAIL_CALL, call);
     }
 
     static Completion exception(Str msg) {
@@ -89,6 +408,61 @@ export struct Completion {
 template <typename T = None>
 using CompletionOr = Res<T, Completion>;
 
+// MARK: Arguments -------------------------------------------------------------
+
+export struct ArgPlan;
+
+// The arguments of a call, a window over values owned by the caller. Named
+// arguments carry their key in a parallel array, which is left out when every
+// argument is positional.
+export struct Args {
+    Value const* _values = nullptr;
+    Opt<Value> const* _keys = nullptr;
+    usize _len = 0;
+    ArgPlan* _plan = nullptr; // Owned by the call site, if it has one
+
+    Args() = default;
+
+    Args(Value const* values, Opt<Value> const* keys, usize len, ArgPlan* plan = nullptr)
+        : _values(values), _keys(keys), _len(len), _plan(plan) {}
+
+    usize len() const {
+        return _len;
+    }
+
+    bool keyed() const {
+        return _keys != nullptr;
+    }
+
+    Value const& operator[](usize i) const {
+        return _values[i];
+    }
+
+    // Index of the argument named key.
+    Opt<usize> find(Value const& key) const {
+        if (not _keys)
+            return NONE;
+        for (usize i : urange::zeroTo(_len))
+            if (_keys[i] and _keys[i].unwrap() == key)
+                return i;
+        return NONE;
+    }
+
+    // Index of the nth positional argument.
+    Opt<usize> nth(usize n) const {
+        if (not _keys)
+            return n < _len ? Opt<usize>{n} : NONE;
+        for (usize i : urange::zeroTo(_len)) {
+            if (not _keys[i] and n-- == 0)
+                return i;
+        }
+        return NONE;
+    }
+
+    // The argument named key, or else the index-th positional one.
+    CompletionOr<Value> get(Value const& key, usize index) const;
+};
+
 // MARK: Prototype -------------------------------------------------------------
 
 struct Base {
@@ -122,7 +496,35 @@ struct Base {
         return Completion::exception("not evaluable");
     }
 
-    virtual CompletionOr<Value> call([[maybe_unused]] Reference params) {
+    // Decides the expression as a condition without building its value,
+    // none when it has to be evaluated and converted instead.
+    virtual CompletionOr<Opt<Boolean>> test([[maybe_unused]] Reference env) {
+        return Ok(NONE);
+    }
+
+    // Returns the expression to replace this one with, if any.
+    virtual CompletionOr<Opt<Value>> optimize([[maybe_unused]] Optimizer& o) {
+        return Ok(NONE);
+    }
+
+    virtual CompletionOr<> resolve([[maybe_unused]] Resolver& r) {
+        return Ok();
+    }
+
+    virtual CompletionOr<> compile([[maybe_unused]] Compiler& c, [[maybe_unused]] u16 dst) {
+        return Completion::exception("not compilable");
+    }
+
+    // Emits the jumps taken when the expression, as a condition, is `when`.
+    // Returns false when it has to be compiled and tested instead.
+    virtual CompletionOr<bool> branch([[maybe_unused]] Compiler& c, [[maybe_unused]] bool when, [[maybe_unused]] Vec<usize>& jumps) {
+        return Ok(false);
+    }
+
+    // Only objects tracked by the heap take part in collections.
+    virtual void mark([[maybe_unused]] Heap& heap) {}
+
+    virtual CompletionOr<Value> call([[maybe_unused]] Args args) {
         return Completion::exception("not callable");
     }
 
@@ -147,4 +549,235 @@ struct Base {
     }
 };
 
+CompletionOr<Value> Args::get(Value const& key, usize index) const {
+    if (auto i = find(key))
+        return Ok(_values[i.unwrap()]);
+    if (auto i = nth(index))
+        return Ok(_values[i.unwrap()]);
+    return Completion::exception("missing parameter");
+}
+
+// MARK: Boxed Values ----------------------------------------------------------
+
+struct IntegerBox : Base {
+    Integer value;
+
+    IntegerBox(Integer value) : value(value) {}
+};
+
+Reference Value::_box(Integer i) {
+    return makeRc<IntegerBox>(i);
+}
+
+Integer Value::_integer() const {
+    return static_cast<IntegerBox&>(_heap()).value;
+}
+
+// MARK: Strings ---------------------------------------------------------------
+
+// An immutable string shared between values, its bytes follow the header in
+// the same allocation. Concatenating two long strings only builds a rope
+// node, it is flattened the first time it is read.
+struct StringBox {
+    static constexpr usize ROPE_MIN = 64;
+
+    usize refs = 1;
+    usize len;
+    mutable u64 _hash = 0; // Computed on first use
+    mutable Value _lhs;    // Both strings while this is a rope,
+    mutable Value _rhs;    // only _lhs once it has been flattened
+
+    StringBox(usize len) : len(len) {}
+
+    StringBox(Value lhs, Value rhs, usize len)
+        : len(len), _lhs(std::move(lhs)), _rhs(std::move(rhs)) {}
+
+    static StringBox* alloc(usize len) {
+        void* mem = ::operator new(sizeof(StringBox) + len);
+        return new (mem) StringBox(len);
+    }
+
+    static StringBox* alloc(Str str) {
+        auto* box = alloc(str.len());
+        std::memcpy(box->_bytes(), str.buf(), str.len());
+        return box;
+    }
+
+    static void free(StringBox* box) {
+        box->~StringBox();
+        ::operator delete(box);
+    }
+
+    char* _bytes() const {
+        return reinterpret_cast<char*>(const_cast<StringBox*>(this) + 1);
+    }
+
+    bool rope() const {
+        return _rhs._bits != Value::_NONE;
+    }
+
+    // The box holding the bytes of a string that isn't a rope.
+    StringBox const* _leaf() const {
+        if (_lhs._bits != Value::_NONE)
+            return _lhs._text();
+        return this;
+    }
+
+    Str str() const {
+        if (rope())
+            _flatten();
+        auto* leaf = _leaf();
+        return Str{leaf->_bytes(), leaf->len};
+    }
+
+    void _flatten() const {
+        auto* flat = alloc(len);
+        usize off = 0;
+
+        Vec<StringBox const*> stack;
+        stack.pushBack(this);
+        while (stack.len()) {
+            auto* box = stack.popBack();
+            if (box->rope()) {
+                stack.pushBack(box->_rhs._text());
+                stack.pushBack(box->_lhs._text());
+                continue;
+            }
+            auto* leaf = box->_leaf();
+            std::memcpy(flat->_bytes() + off, leaf->_bytes(), leaf->len);
+            off += leaf->len;
+        }
+
+        _lhs = Value::_adoptString(flat);
+        _rhs = NONE;
+    }
+
+    u64 hash() const {
+        if (not _hash) {
+            // FNV-1a, zero is kept to mean "not computed yet"
+            u64 h = 0xcbf29ce484222325;
+            for (auto c : str()) {
+                h ^= static_cast<u8>(c);
+                h *= 0x100000001b3;
+            }
+            _hash = h ? h : 1;
+        }
+        return _hash;
+    }
+
+    static Value concat(Value const& lhs, Value const& rhs) {
+        auto* l = lhs._text();
+        auto* r = rhs._text();
+        if (l->len == 0)
+            return rhs;
+        if (r->len == 0)
+            return lhs;
+
+        if (l->len + r->len < ROPE_MIN) {
+            auto* box = alloc(l->len + r->len);
+            std::memcpy(box->_bytes(), lhs._string().buf(), l->len);
+            std::memcpy(box->_bytes() + l->len, rhs._string().buf(), r->len);
+            return Value::_adoptString(box);
+        }
+
+        void* mem = ::operator new(sizeof(StringBox));
+        return Value::_adoptString(new (mem) StringBox(lhs, rhs, l->len + r->len));
+    }
+
+    // Literals are shared by every occurrence in the program.
+    static Value intern(Str str) {
+        static Map<String, Value> literals;
+        if (auto value = literals.lookup(String{str}))
+            return value.unwrap();
+        Value value = Value::_adoptString(alloc(str));
+        literals.put(String{str}, value);
+        return value;
+    }
+};
+
+Value::Value(String str)
+    : _bits(reinterpret_cast<u64>(StringBox::alloc(str.str())) | _STRING_TAG) {}
+
+Value Value::_adoptString(StringBox* box) {
+    Value v;
+    v._bits = reinterpret_cast<u64>(box) | _STRING_TAG;
+    return v;
+}
+
+Str Value::_string() const {
+    return _text()->str();
+}
+
+bool Value::_stringEq(Value const& other) const {
+    auto* l = _text();
+    auto* r = other._text();
+    if (l == r)
+        return true;
+    if (l->len != r->len)
+        return false;
+    if (l->_hash and r->_hash and l->_hash != r->_hash)
+        return false;
+    return _string() == other._string();
+}
+
+void Value::_retain() const {
+    if ((_bits & _HEAP_TAG) == _STRING_TAG)
+        _text()->refs++;
+    else
+        _retainRef(_bits & ~_HEAP_TAG);
+}
+
+void Value::_release() {
+    if ((_bits & _HEAP_TAG) != _STRING_TAG) {
+        _releaseRef(_bits & ~_HEAP_TAG);
+        return;
+    }
+
+    auto* box = _text();
+    if (--box->refs)
+        return;
+
+    if (box->_lhs._bits == _NONE) {
+        StringBox::free(box);
+        return;
+    }
+
+    // Ropes built in a loop are deep, free them without recursing.
+    Vec<StringBox*> dead;
+    dead.pushBack(box);
+    while (dead.len()) {
+        auto* node = dead.popBack();
+        for (auto* child : {&node->_lhs, &node->_rhs}) {
+            if (child->kind() != STRING)
+                continue;
+            auto* text = child->_text();
+            child->_bits = _NONE;
+            if (--text->refs == 0)
+                dead.pushBack(text);
+        }
+        StringBox::free(node);
+    }
+}
+
+void Value::hash(Hasher& h) const {
+    switch (kind()) {
+    case Kind::INTEGER:
+        Karm::hash(h, unwrap<Integer>());
+        break;
+    case Kind::NUMBER:
+        // 0.0 and -0.0 are equal but don't share their bits
+        Karm::hash(h, unwrap<Number>() == 0 ? _NUMBER_OFFSET : _bits);
+        break;
+    case Kind::STRING:
+        Karm::hash(h, _text()->hash());
+        break;
+    case Kind::OBJECT:
+        _ref->hash(h);
+        break;
+    default:
+        Karm::hash(h, _bits);
+        break;
+    }
+}
+
 } // namespace Luna
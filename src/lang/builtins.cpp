@@ -11,25 +11,25 @@ import :objects;
 
 namespace Luna {
 
-static CompletionOr<Value> _builtinLen(Reference params) {
-    auto of = try$(opGet(params, "of"_sym));
+static CompletionOr<Value> _builtinLen(Args args) {
+    auto of = try$(args.get("of"_sym, 0));
     return opLen(of);
 }
 
-static CompletionOr<Value> _builtinPrint(Reference params) {
-    auto fmt = try$(opGet(params, "fmt"_sym));
+static CompletionOr<Value> _builtinPrint(Args args) {
+    auto fmt = try$(args.get("fmt"_sym, 0));
     Sys::println("{}", fmt);
     return Ok();
 }
 
-static CompletionOr<Value> _builtinInput(Reference params) {
-    auto prompt = try$(opGet(params, "prompt"_sym));
+static CompletionOr<Value> _builtinInput(Args args) {
+    auto prompt = try$(args.get("prompt"_sym, 0));
     Sys::print("{}", prompt);
     auto line = Io::readLineUtf8(Sys::in()).take();
     return Ok(line);
 }
 
-static CompletionOr<Value> _builtinExit(Reference) {
+static CompletionOr<Value> _builtinExit(Args) {
     Sys::exit(Ok());
     return Ok();
 }
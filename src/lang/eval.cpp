@@ -4,31 +4,54 @@ module;
 
 export module Luna:eval;
 
+import :heap;
+import :optimizer;
 import :parser;
 import :ops;
 import :builtins;
+import :resolver;
+import :vm;
 
 namespace Luna {
 
-export CompletionOr<Value> evalStr(Str code, Reference env, DiagCollector& diag) {
-    auto expr = try$(Luna::parse(code, diag));
+export enum struct Engine {
+    AST, // Reference tree-walking interpreter
+    VM,  // Bytecode compiler and register machine
+};
+
+export CompletionOr<Value> evalExpr(Value expr, Reference env, Engine engine = Engine::VM) {
+    expr = try$(Optimizer::optimizeProgram(expr));
+    expr = try$(Resolver::resolveProgram(expr, env));
+    if (engine == Engine::VM)
+        expr = Reference{try$(Compiler::compileProgram(expr))};
+
+    // A return, break or continue outside of any loop or function ends
+    // the program with its value.
     auto res = opEval(expr, env);
-    if (res)
-        return res;
+    auto* root = env.is<Environment>();
+    if (res and root->jumping() != Jump::NONE)
+        res = Ok(root->land());
+    Heap::instance().safepoint(res ? res.unwrap() : res.none().value);
+    return res;
+}
 
-    auto completion = res.none();
-    if (completion.type == Completion::EXCEPTION)
-        return completion;
-    return Ok(completion.value);
+export CompletionOr<Value> evalStr(Str code, Reference env, DiagCollector& diag, Engine engine = Engine::VM) {
+    auto program = try$(Luna::parse(code, diag));
+    return evalExpr(program.body, env, engine);
 }
 
-export CompletionOr<Value> evalStr(Str code, Reference env) {
+export CompletionOr<Value> evalStr(Str code, Reference env, Engine engine = Engine::VM) {
     DiagCollector diag{code};
-    return evalStr(code, env, diag);
+    return evalStr(code, env, diag, engine);
 }
 
-export CompletionOr<Value> evalStr(Str code) {
-    return evalStr(code, try$(builtins()));
+export CompletionOr<Value> evalStr(Str code, Engine engine = Engine::VM) {
+    auto env = try$(builtins());
+    auto res = evalStr(code, env, engine);
+
+    // Nothing outlives this call but the result
+    Heap::instance().release(*env.is<Environment>(), res ? res.unwrap() : res.none().value);
+    return res;
 }
 
 } // namespace Luna
@@ -7,24 +7,72 @@ export module Luna:expr;
 import :base;
 import :objects;
 import :ops;
+import :optimizer;
+import :vm;
+import :resolver;
 
 namespace Luna {
 
+// The value of a child, the node returns right away when a return, break or
+// continue jumped out of the child, see Jump.
+#define eval$(EXPR, ENV) ({                 \
+    auto __value = try$(opEval(EXPR, ENV)); \
+    if (_jumped(ENV)) [[unlikely]]          \
+        return Ok(NONE);                    \
+    __value;                                \
+})
+
+#define test$(EXPR, ENV) ({                 \
+    auto __holds = try$(opTest(EXPR, ENV)); \
+    if (_jumped(ENV)) [[unlikely]]          \
+        return Ok(NONE);                    \
+    __holds;                                \
+})
+
+static bool _jumped(Reference& env) {
+    return static_cast<Environment&>(env.unwrap()).jumping() != Jump::NONE;
+}
+
 export struct AssertExpr : Base {
     // assert <expr>;
     Value _expr;
+    Value _message = NONE;
 
     AssertExpr(Value expr)
         : _expr(expr) {
     }
 
+    Value message() {
+        if (not isNone(_message))
+            return _message;
+        return Value{Io::format("assertion failed {}"s, _expr)};
+    }
+
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        // Failures still report the expression as it was written
+        _message = message();
+        try$(o.optimize(_expr));
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        return r.resolve(_expr);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto res = try$(opEval(_expr, env));
+        auto res = eval$(_expr, env);
         if (not try$(asBoolean(res)))
-            return Completion::exception(Value{Io::format("assertion failed {}"s, _expr)});
+            return Completion::exception(message());
         return Ok(res);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        try$(c.expr(_expr, dst));
+        auto msg = try$(c.constant(message()));
+        c.emit(Op::ASSERT, dst, msg);
+        return Ok();
+    }
+
     CompletionOr<Value> string() override {
         return Ok(Io::format("assert {}", _expr));
     }
@@ -39,12 +87,30 @@ export struct EqExpr : Base {
     EqExpr(Value lhs, Value rhs)
         : _lhs(lhs), _rhs(rhs) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        return o.fold(*this, _lhs, _rhs);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_lhs));
+        return r.resolve(_rhs);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto lhs = try$(opEval(_lhs, env));
-        auto rhs = try$(opEval(_rhs, env));
+        auto lhs = eval$(_lhs, env);
+        auto rhs = eval$(_rhs, env);
         return opEq(lhs, rhs);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.binary(Op::EQ, _lhs, _rhs, dst);
+    }
+
+    CompletionOr<bool> branch(Compiler& c, bool when, Vec<usize>& jumps) override {
+        try$(c.compare(Op::IF_EQ, _lhs, _rhs, when, jumps));
+        return Ok(true);
+    }
+
     CompletionOr<Value> string() override {
         return Ok(Io::format("{} == {}", _lhs, _rhs));
     }
@@ -59,12 +125,30 @@ export struct NEqExpr : Base {
     NEqExpr(Value lhs, Value rhs)
         : _lhs(lhs), _rhs(rhs) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        return o.fold(*this, _lhs, _rhs);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_lhs));
+        return r.resolve(_rhs);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto lhs = try$(opEval(_lhs, env));
-        auto rhs = try$(opEval(_rhs, env));
+        auto lhs = eval$(_lhs, env);
+        auto rhs = eval$(_rhs, env);
         return opNot(try$(opEq(lhs, rhs)));
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.binary(Op::NEQ, _lhs, _rhs, dst);
+    }
+
+    CompletionOr<bool> branch(Compiler& c, bool when, Vec<usize>& jumps) override {
+        try$(c.compare(Op::IF_EQ, _lhs, _rhs, not when, jumps));
+        return Ok(true);
+    }
+
     CompletionOr<Value> string() override {
         return Ok(Io::format("{} != {}", _lhs, _rhs));
     }
@@ -79,11 +163,28 @@ export struct LtExpr : Base {
     LtExpr(Value lhs, Value rhs)
         : _lhs(lhs), _rhs(rhs) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        return o.fold(*this, _lhs, _rhs);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_lhs));
+        return r.resolve(_rhs);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto lhs = try$(opEval(_lhs, env));
-        auto rhs = try$(opEval(_rhs, env));
-        auto order = try$(opCmp(lhs, rhs));
-        return Ok(order == Symbols::LESS);
+        auto lhs = eval$(_lhs, env);
+        auto rhs = eval$(_rhs, env);
+        return opLt(lhs, rhs);
+    }
+
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.binary(Op::LT, _lhs, _rhs, dst);
+    }
+
+    CompletionOr<bool> branch(Compiler& c, bool when, Vec<usize>& jumps) override {
+        try$(c.compare(Op::IF_LT, _lhs, _rhs, when, jumps));
+        return Ok(true);
     }
 
     CompletionOr<Value> string() override {
@@ -100,11 +201,28 @@ export struct LtEqExpr : Base {
     LtEqExpr(Value lhs, Value rhs)
         : _lhs(lhs), _rhs(rhs) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        return o.fold(*this, _lhs, _rhs);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_lhs));
+        return r.resolve(_rhs);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto lhs = try$(opEval(_lhs, env));
-        auto rhs = try$(opEval(_rhs, env));
-        auto order = try$(opCmp(lhs, rhs));
-        return Ok(order == Symbols::LESS or order == Symbols::EQUIVALENT);
+        auto lhs = eval$(_lhs, env);
+        auto rhs = eval$(_rhs, env);
+        return opLtEq(lhs, rhs);
+    }
+
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.binary(Op::LTEQ, _lhs, _rhs, dst);
+    }
+
+    CompletionOr<bool> branch(Compiler& c, bool when, Vec<usize>& jumps) override {
+        try$(c.compare(Op::IF_LTEQ, _lhs, _rhs, when, jumps));
+        return Ok(true);
     }
 
     CompletionOr<Value> string() override {
@@ -121,11 +239,28 @@ export struct GtExpr : Base {
     GtExpr(Value lhs, Value rhs)
         : _lhs(lhs), _rhs(rhs) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        return o.fold(*this, _lhs, _rhs);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_lhs));
+        return r.resolve(_rhs);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto lhs = try$(opEval(_lhs, env));
-        auto rhs = try$(opEval(_rhs, env));
-        auto order = try$(opCmp(lhs, rhs));
-        return Ok(order == Symbols::GREATER);
+        auto lhs = eval$(_lhs, env);
+        auto rhs = eval$(_rhs, env);
+        return opGt(lhs, rhs);
+    }
+
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.binary(Op::GT, _lhs, _rhs, dst);
+    }
+
+    CompletionOr<bool> branch(Compiler& c, bool when, Vec<usize>& jumps) override {
+        try$(c.compare(Op::IF_GT, _lhs, _rhs, when, jumps));
+        return Ok(true);
     }
 
     CompletionOr<Value> string() override {
@@ -142,11 +277,28 @@ export struct GtEqExpr : Base {
     GtEqExpr(Value lhs, Value rhs)
         : _lhs(lhs), _rhs(rhs) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        return o.fold(*this, _lhs, _rhs);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_lhs));
+        return r.resolve(_rhs);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto lhs = try$(opEval(_lhs, env));
-        auto rhs = try$(opEval(_rhs, env));
-        auto order = try$(opCmp(lhs, rhs));
-        return Ok(order == Symbols::GREATER or order == Symbols::EQUIVALENT);
+        auto lhs = eval$(_lhs, env);
+        auto rhs = eval$(_rhs, env);
+        return opGtEq(lhs, rhs);
+    }
+
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.binary(Op::GTEQ, _lhs, _rhs, dst);
+    }
+
+    CompletionOr<bool> branch(Compiler& c, bool when, Vec<usize>& jumps) override {
+        try$(c.compare(Op::IF_GTEQ, _lhs, _rhs, when, jumps));
+        return Ok(true);
     }
 
     CompletionOr<Value> string() override {
@@ -162,10 +314,52 @@ export struct AndExpr : Base {
     AndExpr(Value lhs, Value rhs)
         : _lhs(lhs), _rhs(rhs) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        // The right operand is never evaluated past a constant that decides
+        try$(o.optimize(_lhs));
+        if (Optimizer::constant(_lhs)) {
+            auto holds = asBoolean(_lhs);
+            if (holds and not holds.unwrap())
+                return Ok(Value{false});
+        }
+        return o.fold(*this, _lhs, _rhs);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_lhs));
+        return r.resolve(_rhs);
+    }
+
+    // The right operand is only evaluated when the left one holds.
+    CompletionOr<Opt<Boolean>> test(Reference env) override {
+        if (not try$(opTest(_lhs, env)) or _jumped(env))
+            return Ok(false);
+        return Ok(try$(opTest(_rhs, env)));
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto lhs = try$(opEval(_lhs, env));
-        auto rhs = try$(opEval(_rhs, env));
-        return opAnd(lhs, rhs);
+        return Ok(try$(test(env)).unwrap());
+    }
+
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        Vec<usize> toFalse;
+        try$(branch(c, false, toFalse));
+        return c.boolean(toFalse, dst);
+    }
+
+    CompletionOr<bool> branch(Compiler& c, bool when, Vec<usize>& jumps) override {
+        if (not when) {
+            try$(c.branch(_lhs, false, jumps));
+            try$(c.branch(_rhs, false, jumps));
+            return Ok(true);
+        }
+
+        Vec<usize> toEnd;
+        try$(c.branch(_lhs, false, toEnd));
+        try$(c.branch(_rhs, true, jumps));
+        for (auto at : toEnd)
+            c.patch(at);
+        return Ok(true);
     }
 
     CompletionOr<Value> string() override {
@@ -182,10 +376,52 @@ export struct OrExpr : Base {
     OrExpr(Value lhs, Value rhs)
         : _lhs(lhs), _rhs(rhs) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        // The right operand is never evaluated past a constant that decides
+        try$(o.optimize(_lhs));
+        if (Optimizer::constant(_lhs)) {
+            auto holds = asBoolean(_lhs);
+            if (holds and holds.unwrap())
+                return Ok(Value{true});
+        }
+        return o.fold(*this, _lhs, _rhs);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_lhs));
+        return r.resolve(_rhs);
+    }
+
+    // The right operand is only evaluated when the left one doesn't hold.
+    CompletionOr<Opt<Boolean>> test(Reference env) override {
+        if (try$(opTest(_lhs, env)) or _jumped(env))
+            return Ok(true);
+        return Ok(try$(opTest(_rhs, env)));
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto lhs = try$(opEval(_lhs, env));
-        auto rhs = try$(opEval(_rhs, env));
-        return opOr(lhs, rhs);
+        return Ok(try$(test(env)).unwrap());
+    }
+
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        Vec<usize> toFalse;
+        try$(branch(c, false, toFalse));
+        return c.boolean(toFalse, dst);
+    }
+
+    CompletionOr<bool> branch(Compiler& c, bool when, Vec<usize>& jumps) override {
+        if (when) {
+            try$(c.branch(_lhs, true, jumps));
+            try$(c.branch(_rhs, true, jumps));
+            return Ok(true);
+        }
+
+        Vec<usize> toEnd;
+        try$(c.branch(_lhs, true, toEnd));
+        try$(c.branch(_rhs, false, jumps));
+        for (auto at : toEnd)
+            c.patch(at);
+        return Ok(true);
     }
 
     CompletionOr<Value> string() override {
@@ -193,6 +429,17 @@ export struct OrExpr : Base {
     }
 };
 
+// Expressions that always evaluate to a boolean.
+static bool _boolean(Value const& expr) {
+    auto obj = expr.is<Reference>();
+    if (not obj)
+        return expr.kind() == Value::BOOLEAN;
+    return (*obj).is<EqExpr>() or (*obj).is<NEqExpr>() or
+           (*obj).is<LtExpr>() or (*obj).is<LtEqExpr>() or
+           (*obj).is<GtExpr>() or (*obj).is<GtEqExpr>() or
+           (*obj).is<AndExpr>() or (*obj).is<OrExpr>();
+}
+
 export struct NotExpr : Base {
     // not <expr>
 
@@ -201,9 +448,36 @@ export struct NotExpr : Base {
     NotExpr(Value expr)
         : _expr(expr) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        // not not <comparison> is the comparison itself
+        if (auto inner = _expr.is<Reference>()) {
+            if (auto* nested = (*inner).is<NotExpr>(); nested and _boolean(nested->_expr)) {
+                try$(o.optimize(nested->_expr));
+                return Ok(nested->_expr);
+            }
+        }
+        return o.fold(*this, _expr);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        return r.resolve(_expr);
+    }
+
+    CompletionOr<Opt<Boolean>> test(Reference env) override {
+        return Ok(not try$(opTest(_expr, env)));
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto expr = try$(opEval(_expr, env));
-        return opNot(expr);
+        return Ok(try$(test(env)).unwrap());
+    }
+
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.unary(Op::NOT, _expr, dst);
+    }
+
+    CompletionOr<bool> branch(Compiler& c, bool when, Vec<usize>& jumps) override {
+        try$(c.branch(_expr, not when, jumps));
+        return Ok(true);
     }
 
     CompletionOr<Value> string() override {
@@ -219,11 +493,23 @@ export struct NegExpr : Base {
     NegExpr(Value expr)
         : _expr(expr) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        return o.fold(*this, _expr);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        return r.resolve(_expr);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto expr = try$(opEval(_expr, env));
+        auto expr = eval$(_expr, env);
         return opNeg(expr);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.unary(Op::NEG, _expr, dst);
+    }
+
     CompletionOr<Value> string() override {
         return Ok(Io::format("-{}", _expr));
     }
@@ -238,12 +524,25 @@ export struct AddExpr : Base {
     AddExpr(Value lhs, Value rhs)
         : _lhs(lhs), _rhs(rhs) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        return o.fold(*this, _lhs, _rhs);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_lhs));
+        return r.resolve(_rhs);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto lhs = try$(opEval(_lhs, env));
-        auto rhs = try$(opEval(_rhs, env));
+        auto lhs = eval$(_lhs, env);
+        auto rhs = eval$(_rhs, env);
         return opAdd(lhs, rhs);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.binary(Op::ADD, _lhs, _rhs, dst);
+    }
+
     CompletionOr<Value> string() override {
         return Ok(Io::format("{} + {}", _lhs, _rhs));
     }
@@ -258,12 +557,25 @@ export struct SubExpr : Base {
     SubExpr(Value lhs, Value rhs)
         : _lhs(lhs), _rhs(rhs) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        return o.fold(*this, _lhs, _rhs);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_lhs));
+        return r.resolve(_rhs);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto lhs = try$(opEval(_lhs, env));
-        auto rhs = try$(opEval(_rhs, env));
+        auto lhs = eval$(_lhs, env);
+        auto rhs = eval$(_rhs, env);
         return opSub(lhs, rhs);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.binary(Op::SUB, _lhs, _rhs, dst);
+    }
+
     CompletionOr<Value> string() override {
         return Ok(Io::format("{} - {}", _lhs, _rhs));
     }
@@ -278,17 +590,38 @@ export struct MulExpr : Base {
     MulExpr(Value lhs, Value rhs)
         : _lhs(lhs), _rhs(rhs) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        return o.fold(*this, _lhs, _rhs);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_lhs));
+        return r.resolve(_rhs);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto lhs = try$(opEval(_lhs, env));
-        auto rhs = try$(opEval(_rhs, env));
+        auto lhs = eval$(_lhs, env);
+        auto rhs = eval$(_rhs, env);
         return opMul(lhs, rhs);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.binary(Op::MUL, _lhs, _rhs, dst);
+    }
+
     CompletionOr<Value> string() override {
         return Ok(Io::format("{} * {}", _lhs, _rhs));
     }
 };
 
+// Integer division traps on these, leave it to runtime.
+static bool _divisor(Value const& rhs) {
+    if (rhs.is<Number>())
+        return true;
+    auto i = rhs.is<Integer>();
+    return i and *i != 0 and *i != -1;
+}
+
 export struct DivExpr : Base {
     // <expr> / <expr>
 
@@ -298,12 +631,29 @@ export struct DivExpr : Base {
     DivExpr(Value lhs, Value rhs)
         : _lhs(lhs), _rhs(rhs) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_lhs));
+        try$(o.optimize(_rhs));
+        if (not _divisor(_rhs))
+            return Ok(NONE);
+        return o.evaluate(*this, _lhs, _rhs);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_lhs));
+        return r.resolve(_rhs);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto lhs = try$(opEval(_lhs, env));
-        auto rhs = try$(opEval(_rhs, env));
+        auto lhs = eval$(_lhs, env);
+        auto rhs = eval$(_rhs, env);
         return opDiv(lhs, rhs);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.binary(Op::DIV, _lhs, _rhs, dst);
+    }
+
     CompletionOr<Value> string() override {
         return Ok(Io::format("{} / {}", _lhs, _rhs));
     }
@@ -318,12 +668,29 @@ export struct ModExpr : Base {
     ModExpr(Value lhs, Value rhs)
         : _lhs(lhs), _rhs(rhs) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_lhs));
+        try$(o.optimize(_rhs));
+        if (not _divisor(_rhs))
+            return Ok(NONE);
+        return o.evaluate(*this, _lhs, _rhs);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_lhs));
+        return r.resolve(_rhs);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto lhs = try$(opEval(_lhs, env));
-        auto rhs = try$(opEval(_rhs, env));
+        auto lhs = eval$(_lhs, env);
+        auto rhs = eval$(_rhs, env);
         return opMod(lhs, rhs);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.binary(Op::MOD, _lhs, _rhs, dst);
+    }
+
     CompletionOr<Value> string() override {
         return Ok(Io::format("{} % {}", _lhs, _rhs));
     }
@@ -337,11 +704,23 @@ export struct BinNotExpr : Base {
     BinNotExpr(Value expr)
         : _expr(expr) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        return o.fold(*this, _expr);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        return r.resolve(_expr);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto expr = try$(opEval(_expr, env));
+        auto expr = eval$(_expr, env);
         return opBinNot(expr);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.unary(Op::BIN_NOT, _expr, dst);
+    }
+
     CompletionOr<Value> string() override {
         return Ok(Io::format("~{}", _expr));
     }
@@ -356,12 +735,25 @@ export struct BinAndExpr : Base {
     BinAndExpr(Value lhs, Value rhs)
         : _lhs(lhs), _rhs(rhs) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        return o.fold(*this, _lhs, _rhs);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_lhs));
+        return r.resolve(_rhs);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto lhs = try$(opEval(_lhs, env));
-        auto rhs = try$(opEval(_rhs, env));
+        auto lhs = eval$(_lhs, env);
+        auto rhs = eval$(_rhs, env);
         return opBinAnd(lhs, rhs);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.binary(Op::BIN_AND, _lhs, _rhs, dst);
+    }
+
     CompletionOr<Value> string() override {
         return Ok(Io::format("{} & {}", _lhs, _rhs));
     }
@@ -376,10 +768,23 @@ export struct BinOrExpr : Base {
     BinOrExpr(Value lhs, Value rhs)
         : _lhs(lhs), _rhs(rhs) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        return o.fold(*this, _lhs, _rhs);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_lhs));
+        return r.resolve(_rhs);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto lhs = try$(opEval(_lhs, env));
-        auto rhs = try$(opEval(_rhs, env));
-        return opBinAnd(lhs, rhs);
+        auto lhs = eval$(_lhs, env);
+        auto rhs = eval$(_rhs, env);
+        return opBinOr(lhs, rhs);
+    }
+
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.binary(Op::BIN_OR, _lhs, _rhs, dst);
     }
 
     CompletionOr<Value> string() override {
@@ -394,11 +799,66 @@ export struct EnvExpr : Base {
         return Ok(env);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        c.emit(Op::LOAD_ENV, dst);
+        return Ok();
+    }
+
     CompletionOr<Value> string() override {
         return Ok<String>("<env>"s);
     }
 };
 
+export struct QuoteExpr : Base {
+    // #<value>
+
+    Value _value;
+
+    QuoteExpr(Value value)
+        : _value(value) {}
+
+    CompletionOr<Value> eval(Reference) override {
+        return Ok(_value);
+    }
+
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        c.emit(Op::LOAD_CONST, dst, try$(c.constant(_value)));
+        return Ok();
+    }
+
+    CompletionOr<Value> string() override {
+        return Ok(Io::format("#{}", _value));
+    }
+};
+
+// The symbol of a constant key such as the one in <expr>.<ident>
+static Opt<Symbol> _constSymbol(Value const& key) {
+    auto obj = key.is<Reference>();
+    if (not obj)
+        return NONE;
+    auto* quote = (*obj).is<QuoteExpr>();
+    if (not quote)
+        return NONE;
+    if (auto sym = quote->_value.is<Symbol>())
+        return *sym;
+    return NONE;
+}
+
+// A key the resolver can tell apart at compile time: a quoted symbol or an
+// integer literal.
+static Opt<Value> _constKey(Value const& key) {
+    if (auto sym = _constSymbol(key))
+        return Value{sym.unwrap()};
+    if (key.is<Integer>())
+        return key;
+    return NONE;
+}
+
+// The binding of a target resolved to a local.
+static Binding _binding(Value const& target) {
+    return (*target.is<Reference>()).is<LocalExpr>()->_binding;
+}
+
 export struct SetExpr : Base {
     // <expr>[<expr>] = <expr>
     // <expr>.<expr> = <expr>
@@ -406,35 +866,136 @@ export struct SetExpr : Base {
     Value _target;
     Value _key;
     Value _value;
+    Opt<Rc<PropertyCache>> _cache = NONE;
+    Opt<Rc<Aggregate>> _aggregate = NONE;
 
     SetExpr(Value target, Value key, Value value)
         : _target(target), _key(key), _value(value) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_target));
+        try$(o.optimize(_key));
+        try$(o.optimize(_value));
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        _aggregate = try$(r.field(_target, _constKey(_key)));
+        try$(r.resolve(_key));
+        try$(r.resolve(_value));
+        if (auto sym = _constSymbol(_key)) {
+            _cache = makeRc<PropertyCache>(sym.unwrap());
+            CacheStats::track(_cache.unwrap(), try$(string()));
+        }
+        return Ok();
+    }
+
+    Opt<Binding> _field() const {
+        if (not _aggregate or not _aggregate.unwrap()->replaced)
+            return NONE;
+        return _aggregate.unwrap()->field(_binding(_target), _constKey(_key).unwrap());
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto target = try$(opEval(_target, env));
-        auto key = try$(opEval(_key, env));
-        auto value = try$(opEval(_value, env));
+        if (auto field = _field()) {
+            auto value = eval$(_value, env);
+            env.is<Environment>()->up(field->depth)->store(field->slot, value);
+            return Ok(NONE);
+        }
+        auto target = eval$(_target, env);
+        if (_cache) {
+            auto value = eval$(_value, env);
+            return _cache.unwrap()->set(target, value);
+        }
+        auto key = eval$(_key, env);
+        auto value = eval$(_value, env);
         return opSet(target, key, value);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        auto m = c.mark();
+        if (auto field = _field()) {
+            auto value = try$(c.alloc());
+            try$(c.expr(_value, value));
+            try$(c.store(field.unwrap(), value));
+            c.reset(m);
+            return c.none(dst);
+        }
+        auto target = try$(c.alloc());
+        try$(c.expr(_target, target));
+        if (_cache) {
+            auto value = try$(c.alloc());
+            try$(c.expr(_value, value));
+            c.emit(Op::SET_FIELD, target, value, try$(c.property(_cache.unwrap())));
+            c.reset(m);
+            return c.none(dst);
+        }
+        auto key = try$(c.alloc());
+        try$(c.expr(_key, key));
+        auto value = try$(c.alloc());
+        try$(c.expr(_value, value));
+        c.emit(Op::SET, target, key, value);
+        c.reset(m);
+        return c.none(dst);
+    }
+
     CompletionOr<Value> string() override {
         return Ok(Io::format("{}[{}] = {}", _target, _key, _value));
     }
 };
 
 export struct SetEnvExpr : Base {
-    // <expr> = <expr>
+    // <ident> = <expr>
 
     Value _key;
     Value _value;
+    Opt<Binding> _local = NONE;
+    Opt<usize> _depth = NONE;
+    GlobalCache _global;
 
     SetEnvExpr(Value key, Value value)
-        : _key(key), _value(value) {}
+        : _key(key), _value(value), _global{key} {}
+
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_value));
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_value));
+        try$(r.assign(_key));
+        _local = r.lookup(_key);
+        if (not _local)
+            _depth = r.globalDepth();
+        return Ok();
+    }
 
     CompletionOr<Value> eval(Reference env) override {
-        auto key = try$(opEval(_key, env));
-        auto value = try$(opEval(_value, env));
-        return opSet(env, key, value);
+        auto value = eval$(_value, env);
+        if (_local) {
+            env.is<Environment>()->up(_local->depth)->store(_local->slot, value);
+            return Ok(NONE);
+        }
+        if (_depth)
+            return _global.store(*env.is<Environment>(), _depth.unwrap(), value);
+        return opSet(env, _key, value);
+    }
+
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        auto m = c.mark();
+        auto value = try$(c.alloc());
+        try$(c.expr(_value, value));
+        if (_local) {
+            try$(c.store(_local.unwrap(), value));
+        } else if (_depth) {
+            c.emit(Op::STORE_GLOBAL, value, try$(c.operand(_depth.unwrap())), try$(c.global(_key)));
+        } else {
+            auto key = try$(c.alloc());
+            c.emit(Op::LOAD_CONST, key, try$(c.constant(_key)));
+            c.emit(Op::SET_VAR, 0, key, value);
+        }
+        c.reset(m);
+        return c.none(dst);
     }
 
     CompletionOr<Value> string() override {
@@ -442,22 +1003,90 @@ export struct SetEnvExpr : Base {
     }
 };
 
+// The keys and the value of each element of a table literal with symbol
+// keys, or of a list literal with its indices as keys.
+static Opt<Vec<Tuple<Value, Value>>> _elements(Value const& literal);
+
 export struct DeclExpr : Base {
     // var <expr> = <expr>
+    // const <expr> = <expr>
 
     Value _key;
     Value _value;
+    bool _constant = false;
+    Opt<Binding> _local = NONE;
+    Opt<Rc<Aggregate>> _aggregate = NONE;
 
-    DeclExpr(Value key, Value value)
-        : _key(key), _value(value) {}
+    DeclExpr(Value key, Value value, bool constant = false)
+        : _key(key), _value(value), _constant(constant) {}
+
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_value));
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        auto pending = r._pending.len();
+        try$(r.resolve(_value));
+        try$(r.redeclare(_key, _constant));
+        auto fresh = not r.declared(_key);
+        _local = r.declare(_key);
+        if (_local)
+            _aggregate = r.aggregate(_local.unwrap(), _keys(), fresh);
+        if (_constant)
+            try$(r.constant(_key, _local, _value, pending));
+        return Ok();
+    }
+
+    Opt<Vec<Value>> _keys() {
+        auto elements = _elements(_value);
+        if (not elements)
+            return NONE;
+        Vec<Value> keys;
+        for (auto& [key, vexpr] : elements.unwrap())
+            keys.pushBack(key);
+        return keys;
+    }
 
     CompletionOr<Value> eval(Reference env) override {
-        auto value = try$(opEval(_value, env));
+        if (_aggregate and _aggregate.unwrap()->replaced) {
+            auto& slots = _aggregate.unwrap()->slots;
+            auto elements = _elements(_value).take();
+            for (usize i : urange::zeroTo(elements.len())) {
+                auto& [key, vexpr] = elements[i];
+                env.is<Environment>()->store(slots[i], eval$(vexpr, env));
+            }
+            return Ok(NONE);
+        }
+        auto value = eval$(_value, env);
+        if (_local) {
+            env.is<Environment>()->store(_local->slot, value);
+            return Ok(NONE);
+        }
         return opDecl(env, _key, value);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        if (_aggregate and _aggregate.unwrap()->replaced) {
+            auto& slots = _aggregate.unwrap()->slots;
+            auto elements = _elements(_value).take();
+            for (usize i : urange::zeroTo(elements.len())) {
+                auto& [key, vexpr] = elements[i];
+                try$(c.expr(vexpr, dst));
+                try$(c.store({0, slots[i], _local->layout}, dst));
+            }
+            return c.none(dst);
+        }
+        try$(c.expr(_value, dst));
+        if (_local)
+            try$(c.store(_local.unwrap(), dst));
+        else
+            c.emit(Op::DECL_VAR, dst, try$(c.constant(_key)));
+        return c.none(dst);
+    }
+
     CompletionOr<Value> string() override {
-        return Ok(Io::format("var {} = {}", _key, _value));
+        return Ok(Io::format("{} {} = {}", _constant ? "const"s : "var"s, _key, _value));
     }
 };
 
@@ -467,16 +1096,59 @@ export struct GetExpr : Base {
 
     Value _target;
     Value _key;
+    Opt<Rc<PropertyCache>> _cache = NONE;
+    Opt<Rc<Aggregate>> _aggregate = NONE;
 
     GetExpr(Value target, Value key)
         : _target(target), _key(key) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_target));
+        try$(o.optimize(_key));
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        _aggregate = try$(r.field(_target, _constKey(_key)));
+        try$(r.resolve(_key));
+        if (auto sym = _constSymbol(_key)) {
+            _cache = makeRc<PropertyCache>(sym.unwrap());
+            CacheStats::track(_cache.unwrap(), try$(string()));
+        }
+        return Ok();
+    }
+
+    // The slot standing for the field once its literal is replaced.
+    Opt<Binding> _field() const {
+        if (not _aggregate or not _aggregate.unwrap()->replaced)
+            return NONE;
+        return _aggregate.unwrap()->field(_binding(_target), _constKey(_key).unwrap());
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto target = try$(opEval(_target, env));
-        auto key = try$(opEval(_key, env));
+        if (auto field = _field())
+            return Ok(env.is<Environment>()->up(field->depth)->load(field->slot));
+        auto target = eval$(_target, env);
+        if (_cache)
+            return _cache.unwrap()->get(target);
+        auto key = eval$(_key, env);
         return opGet(target, key);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        if (auto field = _field())
+            return c.load(field.unwrap(), dst);
+        if (_cache) {
+            auto m = c.mark();
+            auto target = try$(c.alloc());
+            try$(c.expr(_target, target));
+            c.emit(Op::GET_FIELD, dst, target, try$(c.property(_cache.unwrap())));
+            c.reset(m);
+            return Ok();
+        }
+        return c.binary(Op::GET, _target, _key, dst);
+    }
+
     CompletionOr<Value> string() override {
         return Ok(Io::format("{}[{}]", _target, _key));
     }
@@ -490,11 +1162,24 @@ export struct IsExpr : Base {
     IsExpr(Value expr, Value type)
         : _expr(expr), _type(type) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_expr));
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_expr));
+        return r.resolve(_type);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto type = try$(opEval(_type, env));
-        auto expr = try$(opEval(_expr, env));
+        auto expr = eval$(_expr, env);
+        auto type = eval$(_type, env);
+        return Ok(is(expr, try$(asSymbol(type))));
+    }
 
-        return Ok(is(_expr, try$(asSymbol(type))));
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.binary(Op::IS, _expr, _type, dst);
     }
 
     CompletionOr<Value> string() override {
@@ -510,9 +1195,24 @@ export struct AsExpr : Base {
     AsExpr(Value expr, Value type)
         : _expr(expr), _type(type) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_expr));
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_expr));
+        return r.resolve(_type);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto expr = try$(opEval(_expr, env));
-        return as(_expr, try$(asSymbol(_type)));
+        auto expr = eval$(_expr, env);
+        auto type = eval$(_type, env);
+        return as(expr, try$(asSymbol(type)));
+    }
+
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.binary(Op::AS, _expr, _type, dst);
     }
 
     CompletionOr<Value> string() override {
@@ -527,29 +1227,24 @@ export struct TypeOfExpr : Base {
     TypeOfExpr(Value expr)
         : _expr(expr) {}
 
-    CompletionOr<Value> eval(Reference env) override {
-        return Ok(typeOf(try$(opEval(_expr, env))));
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        return o.fold(*this, _expr);
     }
 
-    CompletionOr<Value> string() override {
-        return Ok(Io::format("typeof({})", _expr));
+    CompletionOr<> resolve(Resolver& r) override {
+        return r.resolve(_expr);
     }
-};
-
-export struct QuoteExpr : Base {
-    // #<value>
-
-    Value _value;
 
-    QuoteExpr(Value value)
-        : _value(value) {}
+    CompletionOr<Value> eval(Reference env) override {
+        return Ok(typeOf(eval$(_expr, env)));
+    }
 
-    CompletionOr<Value> eval(Reference) override {
-        return Ok(_value);
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.unary(Op::TYPEOF, _expr, dst);
     }
 
     CompletionOr<Value> string() override {
-        return Ok(Io::format("#{}", _value));
+        return Ok(Io::format("typeof({})", _expr));
     }
 };
 
@@ -560,6 +1255,10 @@ export struct NopExpr : Base {
         return Ok(NONE);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.none(dst);
+    }
+
     CompletionOr<Value> string() override {
         return Ok<String>("<nop>"s);
     }
@@ -573,9 +1272,23 @@ export struct ReturnExpr : Base {
     ReturnExpr(Value expr)
         : _expr(expr) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_expr));
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        return r.resolve(_expr, true);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto value = try$(opEval(_expr, env));
-        return Completion::return_(value);
+        auto value = eval$(_expr, env);
+        env.is<Environment>()->jump(Jump::RETURN, value);
+        return Ok(NONE);
+    }
+
+    CompletionOr<> compile(Compiler& c, u16) override {
+        return c.return_(_expr);
     }
 
     CompletionOr<Value> string() override {
@@ -591,9 +1304,23 @@ export struct ContinueExpr : Base {
     ContinueExpr(Value expr)
         : _expr(expr) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_expr));
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        return r.resolve(_expr);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto value = try$(opEval(_expr, env));
-        return Completion::continue_(value);
+        auto value = eval$(_expr, env);
+        env.is<Environment>()->jump(Jump::CONTINUE, value);
+        return Ok(NONE);
+    }
+
+    CompletionOr<> compile(Compiler& c, u16) override {
+        return c.continue_(_expr);
     }
 
     CompletionOr<Value> string() override {
@@ -609,9 +1336,23 @@ export struct BreakExpr : Base {
     BreakExpr(Value expr)
         : _expr(expr) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_expr));
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        return r.resolve(_expr);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto value = try$(opEval(_expr, env));
-        return Completion::break_(value);
+        auto value = eval$(_expr, env);
+        env.is<Environment>()->jump(Jump::BREAK, value);
+        return Ok(NONE);
+    }
+
+    CompletionOr<> compile(Compiler& c, u16) override {
+        return c.break_(_expr);
     }
 
     CompletionOr<Value> string() override {
@@ -627,35 +1368,104 @@ export struct ThrowExpr : Base {
     ThrowExpr(Value expr)
         : _expr(expr) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_expr));
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        return r.resolve(_expr);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto value = try$(opEval(_expr, env));
+        auto value = eval$(_expr, env);
         return Completion::exception(value);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        try$(c.expr(_expr, dst));
+        c.emit(Op::THROW, dst);
+        return Ok();
+    }
+
     CompletionOr<Value> string() override {
         return Ok(Io::format("throw {}", _expr));
     }
 };
 
+// Expressions that have no effect when their value is not used.
+static bool _pure(Value const& expr) {
+    if (Optimizer::constant(expr))
+        return true;
+    auto obj = expr.is<Reference>();
+    return obj and ((*obj).is<NopExpr>() or (*obj).is<QuoteExpr>());
+}
+
 export struct BlockExpr : Base {
     // { <exprs>;... }
 
     Vec<Value> _exprs;
     bool _scoped = true;
+    Rc<Layout> _layout = Layout::shared();
 
     BlockExpr(Vec<Value> exprs = {}, bool scoped = true)
         : _exprs(exprs), _scoped(scoped) {}
 
+    // Statements whose value is discarded and that have no effect are
+    // dropped, a block left with a single expression and no scope is that
+    // expression.
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        Vec<Value> exprs;
+        for (usize i : urange::zeroTo(_exprs.len())) {
+            try$(o.optimize(_exprs[i]));
+            bool last = i == _exprs.len() - 1;
+            if (not last and _pure(_exprs[i]))
+                continue;
+            exprs.pushBack(_exprs[i]);
+        }
+        _exprs = std::move(exprs);
+
+        if (_scoped)
+            return Ok(NONE);
+        if (_exprs.len() == 0)
+            return Ok(Value{NONE});
+        if (_exprs.len() == 1)
+            return Ok(_exprs[0]);
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        if (_scoped)
+            r.push(_layout);
+        for (usize i : urange::zeroTo(_exprs.len()))
+            try$(r.resolve(_exprs[i], r._tail and i == _exprs.len() - 1));
+        if (_scoped)
+            r.pop();
+        return Ok();
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto inner = _scoped ? try$(Environment::create(env)) : env;
+        auto inner = _scoped ? try$(Environment::create(env, _layout)) : env;
         for (usize i : urange::zeroTo(_exprs.len())) {
-            auto value = try$(opEval(_exprs[i], inner));
+            auto value = eval$(_exprs[i], inner);
             if (i == _exprs.len() - 1)
                 return Ok(value);
         }
         return Ok(NONE);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        if (_scoped)
+            try$(c.enter(_layout));
+        if (_exprs.len() == 0)
+            try$(c.none(dst));
+        for (auto& expr : _exprs)
+            try$(c.expr(expr, dst));
+        if (_scoped)
+            c.leave();
+        return Ok();
+    }
+
     CompletionOr<Value> string() override {
         StringBuilder sb;
         sb.append("{"s);
@@ -670,16 +1480,40 @@ export struct BlockExpr : Base {
 };
 
 export struct ScopeExpr : Base {
+    // scope <expr>
+    // Never built by the parser. It exists to give an expression an
+    // environment of its own, so unlike a block it always creates one.
+
     Value _expr;
+    Rc<Layout> _layout = Layout::shared();
 
     ScopeExpr(Value expr)
         : _expr(expr) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_expr));
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        r.push(_layout);
+        try$(r.resolve(_expr, r._tail));
+        r.pop();
+        return Ok();
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto inner = try$(Environment::create(env));
+        auto inner = try$(Environment::create(env, _layout));
         return opEval(_expr, inner);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        try$(c.enter(_layout));
+        try$(c.expr(_expr, dst));
+        c.leave();
+        return Ok();
+    }
+
     CompletionOr<Value> string() override {
         return Ok(Io::format("scope {}", _expr));
     }
@@ -688,21 +1522,69 @@ export struct ScopeExpr : Base {
 export struct TableExpr : Base {
     // { <value> : <expr> , ...}
     Vec<Tuple<Value, Value>> _exprs;
+    Vec<Opt<Rc<PropertyCache>>> _caches; // One per symbol key once resolved
 
     TableExpr(Vec<Tuple<Value, Value>> exprs = {})
         : _exprs(exprs) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        for (auto& [key, vexpr] : _exprs)
+            try$(o.optimize(vexpr));
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        _caches.clear();
+        for (auto& [key, vexpr] : _exprs) {
+            try$(r.resolve(vexpr));
+            if (auto sym = key.is<Symbol>()) {
+                auto cache = makeRc<PropertyCache>(*sym);
+                CacheStats::track(cache, Io::format("{}: {}", key, vexpr));
+                _caches.pushBack(cache);
+            } else {
+                _caches.pushBack(NONE);
+            }
+        }
+        return Ok();
+    }
+
     CompletionOr<Value> eval(Reference env) override {
         auto table = try$(Table::create());
 
-        for (auto& [key, vexpr] : _exprs) {
-            auto value = try$(opEval(vexpr, env));
-            try$(opSet(table, key, value));
+        for (usize i : urange::zeroTo(_exprs.len())) {
+            auto& [key, vexpr] = _exprs[i];
+            auto value = eval$(vexpr, env);
+            if (i < _caches.len() and _caches[i])
+                try$(_caches[i].unwrap()->set(table, value));
+            else
+                try$(opSet(table, key, value));
         }
 
         return Ok(table);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        c.emit(Op::TABLE, dst);
+        for (usize i : urange::zeroTo(_exprs.len())) {
+            auto& [key, vexpr] = _exprs[i];
+            auto m = c.mark();
+            if (i < _caches.len() and _caches[i]) {
+                auto v = try$(c.alloc());
+                try$(c.expr(vexpr, v));
+                c.emit(Op::SET_FIELD, dst, v, try$(c.property(_caches[i].unwrap())));
+                c.reset(m);
+                continue;
+            }
+            auto k = try$(c.alloc());
+            c.emit(Op::LOAD_CONST, k, try$(c.constant(key)));
+            auto v = try$(c.alloc());
+            try$(c.expr(vexpr, v));
+            c.emit(Op::SET, dst, k, v);
+            c.reset(m);
+        }
+        return Ok();
+    }
+
     CompletionOr<Value> string() override {
         StringBuilder sb;
         sb.append("{"s);
@@ -725,14 +1607,35 @@ export struct ListExpr : Base {
 
     ListExpr(Vec<Value> exprs = {}) : _exprs(exprs) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        for (auto& expr : _exprs)
+            try$(o.optimize(expr));
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        for (auto& expr : _exprs)
+            try$(r.resolve(expr));
+        return Ok();
+    }
+
     CompletionOr<Value> eval(Reference env) override {
         Vec<Value> result = {};
         for (auto& expr : _exprs) {
-            result.pushBack(try$(opEval(expr, env)));
+            result.pushBack(eval$(expr, env));
         }
         return List::create(result);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        auto m = c.mark();
+        for (auto& expr : _exprs)
+            try$(c.expr(expr, try$(c.alloc())));
+        c.emit(Op::LIST, dst, m, _exprs.len());
+        c.reset(m);
+        return Ok();
+    }
+
     CompletionOr<Value> string() override {
         StringBuilder sb;
         sb.append("["s);
@@ -748,6 +1651,28 @@ export struct ListExpr : Base {
     }
 };
 
+static Opt<Vec<Tuple<Value, Value>>> _elements(Value const& literal) {
+    auto obj = literal.is<Reference>();
+    if (not obj)
+        return NONE;
+
+    Vec<Tuple<Value, Value>> elements;
+    if (auto* table = (*obj).is<TableExpr>()) {
+        for (auto& [key, vexpr] : table->_exprs) {
+            if (not key.is<Symbol>())
+                return NONE;
+            elements.pushBack({key, vexpr});
+        }
+        return elements;
+    }
+    if (auto* list = (*obj).is<ListExpr>()) {
+        for (usize i : urange::zeroTo(list->_exprs.len()))
+            elements.pushBack({(Integer)i, list->_exprs[i]});
+        return elements;
+    }
+    return NONE;
+}
+
 export struct IfExpr : Base {
     // if (<expr>) <expr>
     // if (<expr>) <expr> else <expr>
@@ -760,12 +1685,51 @@ export struct IfExpr : Base {
           _then(then),
           _else(else_) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_cond));
+        try$(o.optimize(_then));
+        try$(o.optimize(_else));
+
+        if (Optimizer::constant(_cond)) {
+            auto taken = asBoolean(_cond);
+            if (taken)
+                return Ok(taken.unwrap() ? _then : _else);
+        }
+
+        // if (not <cond>) a else b is if (<cond>) b else a
+        if (auto cond = _cond.is<Reference>()) {
+            if (auto* negated = (*cond).is<NotExpr>()) {
+                _cond = negated->_expr;
+                std::swap(_then, _else);
+            }
+        }
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_cond));
+        try$(r.resolve(_then, r._tail));
+        return r.resolve(_else, r._tail);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
-        auto cond = try$(opEval(_cond, env));
-        auto branch = (try$(asBoolean(cond)) ? _then : _else);
+        auto branch = (test$(_cond, env) ? _then : _else);
         return opEval(branch, env);
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        Vec<usize> toElse;
+        try$(c.branch(_cond, false, toElse));
+
+        try$(c.expr(_then, dst));
+        auto toEnd = c.emit(Op::JMP);
+        for (auto at : toElse)
+            c.patch(at);
+        try$(c.expr(_else, dst));
+        c.patch(toEnd);
+        return Ok();
+    }
+
     CompletionOr<Value> string() override {
         if (isNone(_else))
             return Ok(Io::format("if ({}) {}", _cond, _then));
@@ -774,6 +1738,222 @@ export struct IfExpr : Base {
     }
 };
 
+export struct MatchExpr : Base {
+    // match (<expr>) { <pattern> | <pattern>: <expr>, ... }
+    //
+    // A pattern is a literal, is <type> or else. The first arm with a
+    // pattern the value matches is evaluated, none if there is no such arm.
+
+    struct Pattern {
+        enum struct Kind {
+            LITERAL, // Of the same type and equal, see opMatch()
+            TYPE,    // is #<type>
+            ANY,     // else
+        };
+        using enum Kind;
+
+        Kind kind;
+        Value value = NONE; // The literal, or the symbol of the type
+    };
+
+    struct Arm {
+        Vec<Pattern> patterns;
+        Value body;
+    };
+
+    Value _value;
+    Vec<Arm> _arms;
+
+    MatchExpr(Value value, Vec<Arm> arms)
+        : _value(value), _arms(std::move(arms)) {}
+
+    // The arm that is evaluated for value.
+    CompletionOr<Opt<usize>> _select(Value value) {
+        for (usize i : urange::zeroTo(_arms.len())) {
+            for (auto& p : _arms[i].patterns) {
+                if (p.kind == Pattern::ANY or
+                    (p.kind == Pattern::TYPE and is(value, p.value.unwrap<Symbol>())) or
+                    (p.kind == Pattern::LITERAL and try$(opMatch(value, p.value))))
+                    return Ok(i);
+            }
+        }
+        return Ok(NONE);
+    }
+
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_value));
+        for (auto& arm : _arms)
+            try$(o.optimize(arm.body));
+
+        Opt<Value> value = NONE;
+        if (Optimizer::constant(_value))
+            value = _value;
+        else if (auto sym = _constSymbol(_value))
+            value = Value{*sym};
+        if (not value)
+            return Ok(NONE);
+
+        auto arm = try$(_select(value.unwrap()));
+        return Ok(arm ? _arms[arm.unwrap()].body : Value{NONE});
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_value));
+        for (auto& arm : _arms)
+            try$(r.resolve(arm.body, r._tail));
+        return Ok();
+    }
+
+    CompletionOr<Value> eval(Reference env) override {
+        auto value = eval$(_value, env);
+        auto arm = try$(_select(value));
+        if (not arm)
+            return Ok(NONE);
+        return opEval(_arms[arm.unwrap()].body, env);
+    }
+
+    // Integers and symbols go straight to their arm through a switch, the
+    // other patterns are tested one after the other:
+    //
+    //              MATCH value, switch
+    //              <tests of the other patterns, jumping to their arm>
+    //     none:    dst = none, JMP end
+    //     arm 0:   dst = <expr>, JMP end
+    //              ...
+    //     end:
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        auto m = c.mark();
+        auto value = try$(c.alloc());
+        auto type = try$(c.alloc());
+        try$(c.expr(_value, value));
+
+        // Integers too large to be inline are left to the tests
+        Vec<Value> cases;
+        bool large = false;
+        for (auto& arm : _arms) {
+            for (auto& p : arm.patterns) {
+                if (p.kind != Pattern::LITERAL)
+                    continue;
+                if (not Switch::fits(p.value)) {
+                    large = large or p.value.kind() == Value::INTEGER;
+                    continue;
+                }
+                bool seen = false;
+                for (auto& key : cases)
+                    seen = seen or key == p.value;
+                if (not seen)
+                    cases.pushBack(p.value);
+            }
+        }
+
+        Opt<u16> sw = NONE;
+        if (cases.len()) {
+            sw = try$(c.switch_());
+            c.emit(Op::MATCH, value, sw.unwrap());
+        }
+        auto tests = c.here();
+
+        Vec<Tuple<usize, usize>> toArm;
+        for (usize i : urange::zeroTo(_arms.len())) {
+            for (auto& p : _arms[i].patterns) {
+                switch (p.kind) {
+                case Pattern::LITERAL:
+                    if (sw and Switch::fits(p.value))
+                        continue;
+                    c.emit(Op::IF_MATCH, value, try$(c.constant(p.value)), 1);
+                    toArm.pushBack({c.emit(Op::JMP), i});
+                    break;
+
+                case Pattern::TYPE:
+                    c.emit(Op::LOAD_CONST, type, try$(c.constant(p.value)));
+                    c.emit(Op::IS, type, value, type);
+                    toArm.pushBack({c.emit(Op::JMP_IF, type), i});
+                    break;
+
+                case Pattern::ANY:
+                    toArm.pushBack({c.emit(Op::JMP), i});
+                    break;
+                }
+            }
+        }
+
+        auto none = c.here();
+        try$(c.none(dst));
+        Vec<usize> toEnd;
+        toEnd.pushBack(c.emit(Op::JMP));
+
+        Vec<usize> arms;
+        for (auto& arm : _arms) {
+            arms.pushBack(c.here());
+            try$(c.expr(arm.body, dst));
+            toEnd.pushBack(c.emit(Op::JMP));
+        }
+
+        for (auto& [at, i] : toArm)
+            c.patch(at, arms[i]);
+        for (auto at : toEnd)
+            c.patch(at);
+        c.reset(m);
+
+        if (not sw)
+            return Ok();
+
+        // Every case goes to the arm it selects, other integers and symbols
+        // to the first arm of a type they are, or of else
+        auto target = [&](Opt<usize> arm) {
+            return static_cast<u32>(arm ? arms[arm.unwrap()] : none);
+        };
+        Vec<Tuple<Value, u32>> targets;
+        for (auto& key : cases)
+            targets.pushBack({key, target(try$(_select(key)))});
+        auto integers = large ? static_cast<u32>(tests) : target(try$(_fallback(Value{Integer{0}})));
+        auto symbols = target(try$(_fallback(Value{Symbols::SYMBOL})));
+        c._proto._switches[sw.unwrap()] = Switch::build(targets, integers, symbols);
+        return Ok();
+    }
+
+    // The arm of a value that is none of the literals.
+    CompletionOr<Opt<usize>> _fallback(Value sample) {
+        for (usize i : urange::zeroTo(_arms.len())) {
+            for (auto& p : _arms[i].patterns) {
+                if (p.kind == Pattern::ANY or
+                    (p.kind == Pattern::TYPE and is(sample, p.value.unwrap<Symbol>())))
+                    return Ok(i);
+            }
+        }
+        return Ok(NONE);
+    }
+
+    CompletionOr<Value> string() override {
+        StringBuilder sb;
+        sb.append(Io::format("match ({}) ", _value));
+        sb.append("{"s);
+        for (usize i : urange::zeroTo(_arms.len())) {
+            auto& arm = _arms[i];
+            for (usize j : urange::zeroTo(arm.patterns.len())) {
+                auto& p = arm.patterns[j];
+                if (j)
+                    sb.append(" | "s);
+                if (p.kind == Pattern::ANY)
+                    sb.append("else"s);
+                else if (p.kind == Pattern::TYPE)
+                    sb.append(Io::format("is #{}", p.value));
+                else if (isSymbol(p.value))
+                    sb.append(Io::format("#{}", p.value));
+                else if (isString(p.value))
+                    sb.append(Io::format("\"{}\"", p.value));
+                else
+                    sb.append(Io::format("{}", p.value));
+            }
+            sb.append(Io::format(": {}", arm.body));
+            if (i != _arms.len() - 1)
+                sb.append(", "s);
+        }
+        sb.append("}"s);
+        return Ok(sb.take());
+    }
+};
+
 export struct WhileExpr : Base {
     // while (<expr>) <expr>
 
@@ -784,43 +1964,235 @@ export struct WhileExpr : Base {
         : _cond(cond),
           _body(body) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_cond));
+        try$(o.optimize(_body));
+
+        if (Optimizer::constant(_cond)) {
+            auto taken = asBoolean(_cond);
+            if (taken and not taken.unwrap())
+                return Ok(Value{NONE});
+        }
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_cond));
+        return r.resolve(_body);
+    }
+
     CompletionOr<Value> eval(Reference env) override {
         Value res = NONE;
         while (true) {
-            auto cond = try$(opEval(_cond, env));
-            auto thruth = try$(asBoolean(cond));
-            if (not thruth)
+            if (not test$(_cond, env))
                 return Ok(res);
 
-            auto evalResult = opEval(_body, env);
-            if (evalResult) {
-                res = try$(evalResult);
-                continue;
-            }
-            auto completion = evalResult.none();
-            if (completion.type == Completion::EXCEPTION)
-                return completion;
-            if (completion.type == Completion::CONTINUE)
-                continue;
-            return Ok(completion.value);
+            auto value = try$(opEval(_body, env));
+            auto* scope = env.is<Environment>();
+            auto jump = scope->jumping();
+            if (jump == Jump::NONE)
+                res = value;
+            else if (jump == Jump::CONTINUE)
+                scope->land();
+            else if (jump == Jump::BREAK)
+                return Ok(scope->land());
+            else
+                return Ok(NONE);
         }
     }
 
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        try$(c.none(dst));
+        c.beginLoop(dst);
+
+        Vec<usize> toEnd;
+        try$(c.branch(_cond, false, toEnd));
+
+        auto m = c.mark();
+        auto tmp = try$(c.alloc());
+        try$(c.expr(_body, tmp));
+        c.emit(Op::MOVE, dst, tmp);
+        c.repeat();
+        c.reset(m);
+
+        for (auto at : toEnd)
+            c.patch(at);
+        c.endLoop();
+        return Ok();
+    }
+
     CompletionOr<Value> string() override {
         return Ok(Io::format("while ({}) {}", _cond, _body));
     }
 };
 
+export struct ForExpr : Base {
+    // for (<ident> in <expr>..<expr>) <expr>
+    // for (<ident> in <expr>) <expr>
+
+    Value _ident;
+    Value _start; // Of the range, or the list
+    Opt<Value> _end;
+    Value _body;
+    Rc<Layout> _layout = Layout::shared();
+    Opt<Binding> _local = NONE;
+
+    ForExpr(Value ident, Value start, Opt<Value> end, Value body)
+        : _ident(ident), _start(start), _end(end), _body(body) {}
+
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_start));
+        if (_end)
+            try$(o.optimize(_end.unwrap()));
+        try$(o.optimize(_body));
+        return Ok(NONE);
+    }
+
+    // The bounds and the list are evaluated once, outside of the scope of
+    // the variable.
+    CompletionOr<> resolve(Resolver& r) override {
+        try$(r.resolve(_start));
+        if (_end)
+            try$(r.resolve(_end.unwrap()));
+        r.push(_layout);
+        _local = r.declare(_ident);
+        try$(r.resolve(_body));
+        r.pop();
+        return Ok();
+    }
+
+    CompletionOr<> _bind(Reference env, Value value) {
+        if (_local)
+            env.is<Environment>()->store(_local->slot, value);
+        else
+            try$(opDecl(env, _ident, value));
+        return Ok();
+    }
+
+    // Runs the body once, false when a jump leaves the loop.
+    CompletionOr<bool> _iterate(Reference env, Value& res) {
+        auto value = try$(opEval(_body, env));
+        auto* scope = env.is<Environment>();
+        auto jump = scope->jumping();
+        if (jump == Jump::NONE)
+            res = value;
+        else if (jump == Jump::CONTINUE)
+            scope->land();
+        else if (jump == Jump::BREAK)
+            res = scope->land();
+        return Ok(jump == Jump::NONE or jump == Jump::CONTINUE);
+    }
+
+    CompletionOr<Value> eval(Reference env) override {
+        auto start = eval$(_start, env);
+        Value res = NONE;
+
+        if (_end) {
+            auto end = eval$(_end.unwrap(), env);
+            if (start.kind() != Value::INTEGER or end.kind() != Value::INTEGER)
+                return Completion::exception("range bounds must be integers");
+
+            auto inner = try$(Environment::create(env, _layout));
+            for (auto i = start.unwrap<Integer>(); i < end.unwrap<Integer>(); i++) {
+                try$(_bind(inner, i));
+                if (not try$(_iterate(inner, res)))
+                    break;
+            }
+            return Ok(res);
+        }
+
+        auto* list = isObject(start) ? start.unwrap<Reference>().is<List>() : nullptr;
+        if (not list)
+            return Completion::exception("expected a list to iterate over");
+
+        auto inner = try$(Environment::create(env, _layout));
+        for (usize i = 0; i < list->_items.len(); i++) {
+            try$(_bind(inner, list->_items[i]));
+            if (not try$(_iterate(inner, res)))
+                break;
+        }
+        return Ok(res);
+    }
+
+    // The counter or the index lives in a register, followed by the end of
+    // the range or the list and the current item.
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        try$(c.none(dst));
+        auto m = c.mark();
+        auto iter = try$(c.alloc());
+        auto state = try$(c.alloc());
+        auto item = try$(c.alloc());
+        if (_end) {
+            try$(c.expr(_start, iter));
+            try$(c.expr(_end.unwrap(), state));
+        } else {
+            c.emit(Op::LOAD_CONST, iter, try$(c.constant(0)));
+            try$(c.expr(_start, state));
+        }
+
+        try$(c.enter(_layout));
+        c.beginLoop(dst);
+        auto toEnd = c.emit(_end ? Op::FOR_RANGE : Op::FOR_EACH, iter);
+        if (_local)
+            try$(c.store(_local.unwrap(), item));
+        else
+            c.emit(Op::DECL_VAR, item, try$(c.constant(_ident)));
+
+        auto tmp = try$(c.alloc());
+        try$(c.expr(_body, tmp));
+        c.emit(Op::MOVE, dst, tmp);
+        c.repeat();
+
+        c.patch(toEnd);
+        c.endLoop();
+        c.leave();
+        c.reset(m);
+        return Ok();
+    }
+
+    CompletionOr<Value> string() override {
+        if (_end)
+            return Ok(Io::format("for ({} in {}..{}) {}", _ident, _start, _end.unwrap(), _body));
+        return Ok(Io::format("for ({} in {}) {}", _ident, _start, _body));
+    }
+};
+
 export struct TryExpr : Base {
     // try <expr> catch (<ident>) <expr>
 
     Value _try;
     Value _errIdent;
     Value _catch;
+    Rc<Layout> _layout = Layout::shared();
+    Opt<Binding> _errLocal = NONE;
 
     TryExpr(Value try_, Value errIdent, Value catch_)
         : _try(try_), _errIdent(errIdent), _catch(catch_) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_try));
+        try$(o.optimize(_catch));
+
+        // Constants can't throw
+        if (Optimizer::constant(_try))
+            return Ok(_try);
+        return Ok(NONE);
+    }
+
+    // The handler binds the error to its name, so it always has an
+    // environment. A block used as the handler only gets another one if it
+    // binds names of its own.
+    CompletionOr<> resolve(Resolver& r) override {
+        r._trys++;
+        try$(r.resolve(_try));
+        r._trys--;
+        r.push(_layout);
+        _errLocal = r.declare(_errIdent);
+        try$(r.resolve(_catch, r._tail));
+        r.pop();
+        return Ok();
+    }
+
     CompletionOr<Value> eval(Reference env) override {
         auto result = opEval(_try, env);
         if (result) {
@@ -828,11 +2200,35 @@ export struct TryExpr : Base {
         }
         auto completion = result.none();
         if (completion.type == Completion::EXCEPTION) {
-            auto catchEnv = try$(Environment::create(env));
-            try$(opDecl(catchEnv, _errIdent, completion.value));
+            auto catchEnv = try$(Environment::create(env, _layout));
+            if (_errLocal)
+                catchEnv.is<Environment>()->store(_errLocal->slot, completion.value);
+            else
+                try$(opDecl(catchEnv, _errIdent, completion.value));
             return opEval(_catch, catchEnv);
         }
-        return Ok(completion.value);
+        return completion;
+    }
+
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        auto m = c.mark();
+        auto err = try$(c.alloc());
+        auto handler = c.beginTry(err);
+        try$(c.expr(_try, dst));
+        c.endTry();
+        auto toEnd = c.emit(Op::JMP);
+
+        c.patch(handler);
+        try$(c.enter(_layout));
+        if (_errLocal)
+            try$(c.store(_errLocal.unwrap(), err));
+        else
+            c.emit(Op::DECL_VAR, err, try$(c.constant(_errIdent)));
+        try$(c.expr(_catch, dst));
+        c.leave();
+        c.patch(toEnd);
+        c.reset(m);
+        return Ok();
     }
 
     CompletionOr<Value> string() override {
@@ -853,22 +2249,64 @@ export struct FuncExpr : Base {
 
     Vec<ParamExpr> _sig;
     Value _code;
+    Rc<Layout> _layout = Layout::shared();
+    Vec<Capture> _captures;
+    Opt<usize> _rootDepth = NONE;
 
     FuncExpr(Vec<ParamExpr> sig, Value code)
         : _sig(sig), _code(code) {}
 
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        for (auto& s : _sig) {
+            if (s.value)
+                try$(o.optimize(s.value.unwrap()));
+        }
+        try$(o.optimize(_code));
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        Vec<Value> params;
+        for (auto& s : _sig) {
+            if (s.value)
+                try$(r.resolve(s.value.unwrap()));
+            params.pushBack(s.key);
+        }
+        _rootDepth = r.globalDepth();
+        r.function(_layout, params, _code, _captures);
+        return Ok();
+    }
+
     CompletionOr<Value> eval(Reference env) override {
         Vec<Param> sig;
         for (auto& s : _sig) {
             Param p{s.key};
             p.required = true;
             if (s.value) {
-                p.value = try$(opEval(s.value.unwrap(), env));
+                p.value = eval$(s.value.unwrap(), env);
                 p.required = false;
             }
             sig.pushBack(p);
         }
-        return Func::create(env, sig, _code);
+        if (_rootDepth)
+            return Func::close(env, sig, _code, _layout, _captures, _rootDepth.unwrap());
+        return Func::create(env, sig, _code, _layout);
+    }
+
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        Vec<ProtoParam> sig;
+        for (auto& s : _sig)
+            sig.pushBack({s.key, static_cast<bool>(s.value)});
+        auto proto = try$(c.function(sig, _code, _layout, _captures, _rootDepth));
+
+        auto m = c.mark();
+        for (auto& s : _sig) {
+            if (s.value)
+                try$(c.expr(s.value.unwrap(), try$(c.alloc())));
+        }
+        c.emit(Op::FUNC, dst, proto, m);
+        c.reset(m);
+        return Ok();
     }
 
     CompletionOr<Value> string() override {
@@ -902,26 +2340,81 @@ export struct CallExpr : Base {
 
     Value _func;
     Vec<ArgExpr> _args;
+    Vec<Opt<Value>> _keys; // Only when some arguments are named
+    Rc<CallCache> _cache = makeRc<CallCache>();
+    bool _tail = false;
 
     CallExpr(Value func, Vec<ArgExpr> args)
-        : _func(func), _args(args) {}
-
-    CompletionOr<Value> eval(Reference env) override {
-        auto func = try$(opEval(_func, env));
-        auto params = try$(Table::create());
-
-        Integer index = 0;
+        : _func(func), _args(args) {
         for (auto& arg : _args) {
-            auto value = try$(opEval(arg.expr, env));
             if (arg.key) {
-                try$(opSet(params, arg.key.unwrap(), value));
-            } else {
-                try$(opSet(params, index, value));
-                index++;
+                for (auto& a : _args)
+                    _keys.pushBack(a.key);
+                break;
             }
         }
+    }
 
-        return opCall(func, params);
+    CompletionOr<Opt<Value>> optimize(Optimizer& o) override {
+        try$(o.optimize(_func));
+        for (auto& arg : _args)
+            try$(o.optimize(arg.expr));
+        return Ok(NONE);
+    }
+
+    CompletionOr<> resolve(Resolver& r) override {
+        _tail = r._tail;
+        try$(r.resolve(_func));
+        for (auto& arg : _args)
+            try$(r.resolve(arg.expr));
+        CacheStats::track(_cache, try$(string()));
+        return Ok();
+    }
+
+    CompletionOr<Value> eval(Reference env) override {
+        auto func = eval$(_func, env);
+
+        Vec<Value> values;
+        values.ensure(_args.len());
+        for (auto& arg : _args)
+            values.pushBack(eval$(arg.expr, env));
+
+        if (not _cache->hit(func))
+            _cache->remember(func);
+
+        if (_tail)
+            return TailCall::create(func, std::move(values), _keys, _cache, &_cache->_plan);
+        return opCall(func, {values.buf(), _keys.len() ? _keys.buf() : nullptr, values.len(), &_cache->_plan});
+    }
+
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        auto m = c.mark();
+        auto func = try$(c.alloc());
+
+        // The field a call is made on can be looked up by the call
+        Opt<usize> field = NONE;
+        GetExpr* get = nullptr;
+        if (auto obj = _func.is<Reference>())
+            get = (*obj).is<GetExpr>();
+        if (get and get->_cache and not get->_field() and not _tail) {
+            try$(c.expr(get->_target, func));
+            field = c.emit(Op::GET_FIELD, func, func, try$(c.property(get->_cache.unwrap())));
+        } else {
+            try$(c.expr(_func, func));
+        }
+
+        Vec<Opt<Value>> shape;
+        for (auto& arg : _args) {
+            try$(c.expr(arg.expr, try$(c.alloc())));
+            shape.pushBack(arg.key);
+        }
+        auto site = try$(c.callSite(shape, _cache));
+        if (field and c.fuseField(field.unwrap(), site))
+            c.emit(Op::CALL_FIELD, dst, func, site);
+        else
+            c.emit(_tail ? Op::TAILCALL : Op::CALL, dst, func, site);
+        c.reset(m);
+        return Ok();
     }
 
     CompletionOr<Value> string() override {
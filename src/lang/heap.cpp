@@ -0,0 +1,351 @@
+module;
+
+#include <karm/macros>
+
+#include <chrono>
+
+export module Luna:heap;
+
+import :base;
+
+namespace Luna {
+
+export struct Object;
+
+// Lets the collector find the values an evaluator holds outside of any
+// object, such as the registers of the virtual machine.
+export struct Roots {
+    virtual ~Roots() = default;
+
+    virtual void trace(Heap& heap) = 0;
+};
+
+// MARK: Heap ------------------------------------------------------------------
+
+// A tracing collector for the objects that can form reference cycles.
+// Reference counting still frees everything as soon as it is unreachable,
+// the collector only has to break the cycles it can't: the fields of the
+// objects it finds unreachable are cleared and their counts drop to zero.
+//
+// Objects are born young and tenured once they survive a collection. Minor
+// collections only trace young objects, tenured objects that had an object
+// stored into them since the last collection are remembered by the write
+// barrier and their fields are treated as roots. A major collection traces
+// everything once the tenured generation has doubled.
+//
+// Roots are the root environments, the evaluators registered as Roots and
+// the value passed to the collection. Collections only happen at safe
+// points, where nothing else holds on to an object.
+export struct Heap {
+    // Young objects allocated before a minor collection is due.
+    static constexpr usize NURSERY = 4096;
+
+    struct Stats {
+        usize minor = 0;
+        usize major = 0;
+        usize collected = 0;
+        usize promoted = 0;
+        f64 totalPause = 0; // milliseconds
+        f64 maxPause = 0;   // milliseconds
+    };
+
+    Object* _young = nullptr;
+    Object* _tenured = nullptr;
+    usize _youngLen = 0;
+    usize _tenuredLen = 0;
+    usize _majorAt = NURSERY;
+
+    Vec<Object*> _globals;
+    Vec<Roots*> _roots;
+    usize _foreign = 0; // Native or tree-walking calls in progress
+
+    Vec<Object*> _remembered;
+    Vec<Object*> _grey;
+    bool _major = false;
+
+    Stats _stats;
+
+    // Never destroyed, objects may still be released during static
+    // destruction.
+    static Heap& instance() {
+        static Heap* heap = new Heap();
+        return *heap;
+    }
+
+    Stats const& stats() const {
+        return _stats;
+    }
+
+    usize youngLen() const {
+        return _youngLen;
+    }
+
+    usize tenuredLen() const {
+        return _tenuredLen;
+    }
+
+    // MARK: Bookkeeping
+
+    void _link(Object& obj);
+
+    void _unlink(Object& obj);
+
+    void root(Object& env);
+
+    void unroot(Object& env);
+
+    void remember(Object& obj);
+
+    void forget(Object& obj);
+
+    // MARK: Marking
+
+    void mark(Object& obj);
+
+    void mark(Value const& value) {
+        if (auto obj = value.is<Reference>())
+            (*obj)->mark(*this);
+    }
+
+    void _drain();
+
+    // MARK: Collection
+
+    bool due() const {
+        return _youngLen >= NURSERY;
+    }
+
+    // Called by an evaluator that registered itself as the only roots.
+    void poll() {
+        if (due() and _foreign == 0 and _roots.len() == 1)
+            collect(_tenuredLen >= _majorAt);
+    }
+
+    // Called once an evaluation is over, value is its result.
+    void safepoint(Value const& value) {
+        if (due() and _foreign == 0 and _roots.len() == 0)
+            collect(_tenuredLen >= _majorAt, value);
+    }
+
+    // The host let go of a root environment, collect everything that only
+    // it kept alive.
+    void release(Object& env, Value const& value) {
+        unroot(env);
+        if (_foreign == 0 and _roots.len() == 0)
+            collect(true, value);
+    }
+
+    void collect(bool major, Value const& value = NONE);
+
+    usize _sweep(Object* list, Vec<Value>& graveyard);
+
+    void _promote();
+};
+
+// MARK: Object ----------------------------------------------------------------
+
+// A runtime object tracked by the heap.
+export struct Object : Base {
+    Object* _prev = nullptr;
+    Object* _next = nullptr;
+    bool _tenured = false;
+    bool _marked = false;
+    bool _remembered = false;
+    bool _rooted = false;
+    usize _rememberedAt = 0; // Index in Heap::_remembered, while remembered
+    usize _rootAt = 0;       // Index in Heap::_globals, while rooted
+
+    Object() {
+        Heap::instance()._link(*this);
+    }
+
+    Object(Object const&) : Object() {}
+
+    ~Object() override {
+        auto& heap = Heap::instance();
+        if (_remembered)
+            heap.forget(*this);
+        heap._unlink(*this);
+    }
+
+    void mark(Heap& heap) override {
+        heap.mark(*this);
+    }
+
+    // Mark every value this object holds.
+    virtual void trace([[maybe_unused]] Heap& heap) {}
+
+    // Move every value this object holds to the graveyard, they are released
+    // once the whole sweep is done.
+    virtual void clear([[maybe_unused]] Vec<Value>& graveyard) {}
+
+    // Write barrier, to be called after storing value into this object.
+    void write(Value const& value) {
+        if (_tenured and not _remembered and value.kind() == Value::OBJECT) [[unlikely]]
+            Heap::instance().remember(*this);
+    }
+};
+
+void Heap::_link(Object& obj) {
+    obj._next = _young;
+    if (_young)
+        _young->_prev = &obj;
+    _young = &obj;
+    _youngLen++;
+}
+
+void Heap::_unlink(Object& obj) {
+    auto& head = obj._tenured ? _tenured : _young;
+    if (obj._prev)
+        obj._prev->_next = obj._next;
+    else
+        head = obj._next;
+    if (obj._next)
+        obj._next->_prev = obj._prev;
+    obj._prev = obj._next = nullptr;
+    (obj._tenured ? _tenuredLen : _youngLen)--;
+}
+
+// Objects know their index in the lists of the heap, the last object of the
+// list takes the place of the one removed.
+
+void Heap::root(Object& env) {
+    env._rooted = true;
+    env._rootAt = _globals.len();
+    _globals.pushBack(&env);
+}
+
+void Heap::unroot(Object& env) {
+    if (not env._rooted)
+        return;
+    auto* last = _globals.popBack();
+    if (last != &env) {
+        _globals[env._rootAt] = last;
+        last->_rootAt = env._rootAt;
+    }
+    env._rooted = false;
+}
+
+void Heap::remember(Object& obj) {
+    obj._remembered = true;
+    obj._rememberedAt = _remembered.len();
+    _remembered.pushBack(&obj);
+}
+
+void Heap::forget(Object& obj) {
+    auto* last = _remembered.popBack();
+    if (last != &obj) {
+        _remembered[obj._rememberedAt] = last;
+        last->_rememberedAt = obj._rememberedAt;
+    }
+    obj._remembered = false;
+}
+
+void Heap::mark(Object& obj) {
+    if (obj._marked)
+        return;
+    if (obj._tenured and not _major)
+        return;
+    obj._marked = true;
+    _grey.pushBack(&obj);
+}
+
+void Heap::_drain() {
+    while (_grey.len())
+        _grey.popBack()->trace(*this);
+}
+
+usize Heap::_sweep(Object* list, Vec<Value>& graveyard) {
+    usize collected = 0;
+    for (auto* obj = list; obj; obj = obj->_next) {
+        if (obj->_marked) {
+            obj->_marked = false;
+            continue;
+        }
+        obj->clear(graveyard);
+        collected++;
+    }
+    return collected;
+}
+
+// Everything left in the young generation survived, the objects that were
+// cleared but are still referenced from a cache are promoted along.
+void Heap::_promote() {
+    while (_young) {
+        auto* obj = _young;
+        _unlink(*obj);
+        obj->_tenured = true;
+        obj->_next = _tenured;
+        if (_tenured)
+            _tenured->_prev = obj;
+        _tenured = obj;
+        _tenuredLen++;
+        _stats.promoted++;
+    }
+}
+
+void Heap::collect(bool major, Value const& value) {
+    auto start = std::chrono::steady_clock::now();
+    _major = major;
+
+    for (auto* env : _globals)
+        mark(*env);
+    for (auto* roots : _roots)
+        roots->trace(*this);
+    mark(value);
+    if (not major) {
+        for (auto* obj : _remembered)
+            obj->trace(*this);
+    }
+    _drain();
+
+    for (auto* obj : _remembered)
+        obj->_remembered = false;
+    _remembered.clear();
+
+    {
+        Vec<Value> graveyard;
+        _stats.collected += _sweep(_young, graveyard);
+        if (major)
+            _stats.collected += _sweep(_tenured, graveyard);
+    }
+    _promote();
+
+    if (major) {
+        _majorAt = max(NURSERY, _tenuredLen * 2);
+        _stats.major++;
+    } else {
+        _stats.minor++;
+    }
+
+    f64 pause = std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - start).count();
+    _stats.totalPause += pause;
+    _stats.maxPause = max(_stats.maxPause, pause);
+}
+
+// Marks the evaluation of a native or tree-walking function, the values it
+// holds are out of reach of the collector.
+export struct ForeignScope {
+    ForeignScope() {
+        Heap::instance()._foreign++;
+    }
+
+    ~ForeignScope() {
+        Heap::instance()._foreign--;
+    }
+};
+
+// Registers roots for as long as the scope lives.
+export struct RootScope {
+    Roots& _roots;
+
+    RootScope(Roots& roots) : _roots(roots) {
+        Heap::instance()._roots.pushBack(&roots);
+    }
+
+    ~RootScope() {
+        Heap::instance()._roots.popBack();
+    }
+};
+
+} // namespace Luna
@@ -0,0 +1,1068 @@
+module;
+
+#include <karm/macros>
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__x86_64__) and defined(__linux__)
+#    include <sys/mman.h>
+#    include <unistd.h>
+#endif
+
+export module Luna:jit;
+
+import :base;
+import :heap;
+import :objects;
+import :ops;
+import :vm;
+
+namespace Luna {
+
+// MARK: Helpers ---------------------------------------------------------------
+
+// Native code calls back into these for everything but the integer fast
+// paths. They carry out a single instruction the way the interpreter does,
+// and tell the code where to go next.
+enum Status : u32 {
+    NEXT,  // Carry on, or hand over to the interpreter when leaving
+    TAKEN, // The branch is taken
+    THROW, // The error of the frame is set
+};
+
+using Helper = u32 (*)(NativeFrame* frame, Instr const* ins);
+
+template <Op OP>
+static CompletionOr<Status> _step(NativeFrame& f, Instr const& ins) {
+    auto* regs = f.regs;
+    auto* proto = f.proto;
+
+    switch (OP) {
+    case Op::LOAD_CONST:
+        regs[ins.a] = proto->_consts[ins.b];
+        break;
+
+    case Op::LOAD_LOCAL:
+        regs[ins.a] = f.scope->up(ins.b)->_slots[ins.c];
+        break;
+
+    case Op::STORE_LOCAL: {
+        auto* scope = f.scope->up(ins.b);
+        scope->_slots[ins.c] = regs[ins.a];
+        scope->write(regs[ins.a]);
+        break;
+    }
+
+    case Op::LOAD_CELL:
+        regs[ins.a] = f.scope->up(ins.b)->cell(ins.c).value;
+        break;
+
+    case Op::STORE_CELL:
+        f.scope->up(ins.b)->cell(ins.c).store(regs[ins.a]);
+        break;
+
+    case Op::LOAD_GLOBAL:
+        regs[ins.a] = try$(proto->_globals[ins.c].load(*f.scope, ins.b));
+        break;
+
+    case Op::STORE_GLOBAL:
+        try$(proto->_globals[ins.c].store(*f.scope, ins.b, regs[ins.a]));
+        break;
+
+    case Op::MOVE:
+        regs[ins.a] = regs[ins.b];
+        break;
+
+    case Op::EQ:
+        regs[ins.a] = try$(opEq(regs[ins.b], regs[ins.c]));
+        break;
+
+    case Op::NEQ:
+        regs[ins.a] = try$(opNot(try$(opEq(regs[ins.b], regs[ins.c]))));
+        break;
+
+    case Op::LT:
+        regs[ins.a] = try$(opLt(regs[ins.b], regs[ins.c]));
+        break;
+
+    case Op::LTEQ:
+        regs[ins.a] = try$(opLtEq(regs[ins.b], regs[ins.c]));
+        break;
+
+    case Op::GT:
+        regs[ins.a] = try$(opGt(regs[ins.b], regs[ins.c]));
+        break;
+
+    case Op::GTEQ:
+        regs[ins.a] = try$(opGtEq(regs[ins.b], regs[ins.c]));
+        break;
+
+    case Op::ADD:
+        regs[ins.a] = try$(opAdd(regs[ins.b], regs[ins.c]));
+        break;
+
+    case Op::SUB:
+        regs[ins.a] = try$(opSub(regs[ins.b], regs[ins.c]));
+        break;
+
+    case Op::MUL:
+        regs[ins.a] = try$(opMul(regs[ins.b], regs[ins.c]));
+        break;
+
+    case Op::DIV:
+        regs[ins.a] = try$(opDiv(regs[ins.b], regs[ins.c]));
+        break;
+
+    case Op::MOD:
+        regs[ins.a] = try$(opMod(regs[ins.b], regs[ins.c]));
+        break;
+
+    case Op::BIN_AND:
+        regs[ins.a] = try$(opBinAnd(regs[ins.b], regs[ins.c]));
+        break;
+
+    case Op::BIN_OR:
+        regs[ins.a] = try$(opBinOr(regs[ins.b], regs[ins.c]));
+        break;
+
+    case Op::NOT:
+        regs[ins.a] = try$(opNot(regs[ins.b]));
+        break;
+
+    case Op::NEG:
+        regs[ins.a] = try$(opNeg(regs[ins.b]));
+        break;
+
+    case Op::BIN_NOT:
+        regs[ins.a] = try$(opBinNot(regs[ins.b]));
+        break;
+
+    case Op::TYPEOF:
+        regs[ins.a] = typeOf(regs[ins.b]);
+        break;
+
+    case Op::IS:
+        regs[ins.a] = is(regs[ins.b], try$(asSymbol(regs[ins.c])));
+        break;
+
+    case Op::AS:
+        regs[ins.a] = try$(as(regs[ins.b], try$(asSymbol(regs[ins.c]))));
+        break;
+
+    case Op::GET:
+        regs[ins.a] = try$(opGet(regs[ins.b], regs[ins.c]));
+        break;
+
+    case Op::SET:
+        try$(opSet(regs[ins.a], regs[ins.b], regs[ins.c]));
+        break;
+
+    case Op::GET_FIELD:
+        regs[ins.a] = try$(proto->_properties[ins.c]->get(regs[ins.b]));
+        break;
+
+    case Op::SET_FIELD:
+        try$(proto->_properties[ins.c]->set(regs[ins.a], regs[ins.b]));
+        break;
+
+    case Op::TABLE:
+        regs[ins.a] = try$(Table::create());
+        break;
+
+    case Op::LIST: {
+        Vec<Value> items;
+        for (u16 i = 0; i < ins.c; i++)
+            items.pushBack(regs[ins.b + i]);
+        regs[ins.a] = try$(List::create(items));
+        break;
+    }
+
+    case Op::JMP_IF:
+        return Ok(try$(asBoolean(regs[ins.a])) ? TAKEN : NEXT);
+
+    case Op::JMP_IF_NOT:
+        return Ok(try$(asBoolean(regs[ins.a])) ? NEXT : TAKEN);
+
+    case Op::FOR_RANGE: {
+        auto& next = regs[ins.a];
+        auto& end = regs[ins.a + 1];
+        if (next.kind() != Value::INTEGER or end.kind() != Value::INTEGER)
+            return Completion::exception("range bounds must be integers");
+        if (next.unwrap<Integer>() >= end.unwrap<Integer>())
+            return Ok(TAKEN);
+        regs[ins.a + 2] = next;
+        next = next.unwrap<Integer>() + 1;
+        break;
+    }
+
+    case Op::FOR_EACH: {
+        auto& list = regs[ins.a + 1];
+        auto* items = isObject(list) ? list.unwrap<Reference>().is<List>() : nullptr;
+        if (not items)
+            return Completion::exception("expected a list to iterate over");
+        auto index = regs[ins.a].unwrap<Integer>();
+        if (index >= static_cast<Integer>(items->_items.len()))
+            return Ok(TAKEN);
+        regs[ins.a + 2] = items->_items[index];
+        regs[ins.a] = index + 1;
+        break;
+    }
+
+    // Taken means the jump that follows is skipped
+    case Op::IF_EQ:
+        return Ok(try$(opEq(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c) ? TAKEN : NEXT);
+
+    case Op::IF_LT:
+        return Ok(try$(opLt(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c) ? TAKEN : NEXT);
+
+    case Op::IF_LTEQ:
+        return Ok(try$(opLtEq(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c) ? TAKEN : NEXT);
+
+    case Op::IF_GT:
+        return Ok(try$(opGt(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c) ? TAKEN : NEXT);
+
+    case Op::IF_GTEQ:
+        return Ok(try$(opGtEq(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c) ? TAKEN : NEXT);
+
+    case Op::IF_SAME:
+        return Ok(Inliner::same(regs[ins.a], proto->_consts[ins.b]) != static_cast<bool>(ins.c) ? TAKEN : NEXT);
+
+    case Op::IF_MATCH:
+        return Ok(try$(opMatch(regs[ins.a], proto->_consts[ins.b])) != static_cast<bool>(ins.c) ? TAKEN : NEXT);
+
+    case Op::THROW:
+        return Completion::exception(regs[ins.a]);
+
+    case Op::ASSERT:
+        if (not try$(asBoolean(regs[ins.a])))
+            return Completion::exception(proto->_consts[ins.b]);
+        break;
+
+    case Op::ADD_CONST:
+        regs[ins.a] = try$(opAdd(regs[ins.b], proto->_consts[ins.c]));
+        break;
+
+    case Op::SUB_CONST:
+        regs[ins.a] = try$(opSub(regs[ins.b], proto->_consts[ins.c]));
+        break;
+
+    default:
+        unreachable();
+    }
+
+    return Ok(NEXT);
+}
+
+template <Op OP>
+static u32 _helper(NativeFrame* f, Instr const* ins) {
+    auto res = _step<OP>(*f, *ins);
+    if (res)
+        return res.unwrap();
+    f->error = res.none();
+    return THROW;
+}
+
+static u32 _poll(NativeFrame*, Instr const*) {
+    Heap::instance().poll();
+    return NEXT;
+}
+
+// The code a MATCH goes on with, native code jumps there right away.
+static void const* _dispatch(NativeFrame* f, Instr const* ins) {
+    auto pc = static_cast<usize>(ins - f->code);
+    auto target = f->proto->_switches[ins->b].target(f->regs[ins->a], pc + 1);
+    return f->proto->_native.unwrap()->entry(target);
+}
+
+// The instruction a quickened variant stands for.
+static Op _generic(Op op) {
+    switch (op) {
+    case Op::ADD_INT:
+    case Op::ADD_NUM:
+    case Op::ADD_STR:
+        return Op::ADD;
+    case Op::SUB_INT:
+    case Op::SUB_NUM:
+        return Op::SUB;
+    case Op::MUL_INT:
+    case Op::MUL_NUM:
+        return Op::MUL;
+    case Op::IF_EQ_INT:
+        return Op::IF_EQ;
+    case Op::IF_LT_INT:
+    case Op::IF_LT_NUM:
+        return Op::IF_LT;
+    case Op::IF_LTEQ_INT:
+    case Op::IF_LTEQ_NUM:
+        return Op::IF_LTEQ;
+    case Op::IF_GT_INT:
+    case Op::IF_GT_NUM:
+        return Op::IF_GT;
+    case Op::IF_GTEQ_INT:
+    case Op::IF_GTEQ_NUM:
+        return Op::IF_GTEQ;
+    case Op::ADD_CONST_INT:
+        return Op::ADD_CONST;
+    case Op::SUB_CONST_INT:
+        return Op::SUB_CONST;
+    default:
+        return op;
+    }
+}
+
+// Instructions that touch the environment chain, the frames or the
+// handlers are left to the interpreter.
+static Helper _helperFor(Op op) {
+    switch (op) {
+    case Op::LOAD_CONST:
+        return _helper<Op::LOAD_CONST>;
+    case Op::LOAD_LOCAL:
+        return _helper<Op::LOAD_LOCAL>;
+    case Op::STORE_LOCAL:
+        return _helper<Op::STORE_LOCAL>;
+    case Op::LOAD_CELL:
+        return _helper<Op::LOAD_CELL>;
+    case Op::STORE_CELL:
+        return _helper<Op::STORE_CELL>;
+    case Op::LOAD_GLOBAL:
+        return _helper<Op::LOAD_GLOBAL>;
+    case Op::STORE_GLOBAL:
+        return _helper<Op::STORE_GLOBAL>;
+    case Op::MOVE:
+        return _helper<Op::MOVE>;
+    case Op::EQ:
+        return _helper<Op::EQ>;
+    case Op::NEQ:
+        return _helper<Op::NEQ>;
+    case Op::LT:
+        return _helper<Op::LT>;
+    case Op::LTEQ:
+        return _helper<Op::LTEQ>;
+    case Op::GT:
+        return _helper<Op::GT>;
+    case Op::GTEQ:
+        return _helper<Op::GTEQ>;
+    case Op::ADD:
+        return _helper<Op::ADD>;
+    case Op::SUB:
+        return _helper<Op::SUB>;
+    case Op::MUL:
+        return _helper<Op::MUL>;
+    case Op::DIV:
+        return _helper<Op::DIV>;
+    case Op::MOD:
+        return _helper<Op::MOD>;
+    case Op::BIN_AND:
+        return _helper<Op::BIN_AND>;
+    case Op::BIN_OR:
+        return _helper<Op::BIN_OR>;
+    case Op::NOT:
+        return _helper<Op::NOT>;
+    case Op::NEG:
+        return _helper<Op::NEG>;
+    case Op::BIN_NOT:
+        return _helper<Op::BIN_NOT>;
+    case Op::TYPEOF:
+        return _helper<Op::TYPEOF>;
+    case Op::IS:
+        return _helper<Op::IS>;
+    case Op::AS:
+        return _helper<Op::AS>;
+    case Op::GET:
+        return _helper<Op::GET>;
+    case Op::SET:
+        return _helper<Op::SET>;
+    case Op::GET_FIELD:
+        return _helper<Op::GET_FIELD>;
+    case Op::SET_FIELD:
+        return _helper<Op::SET_FIELD>;
+    case Op::TABLE:
+        return _helper<Op::TABLE>;
+    case Op::LIST:
+        return _helper<Op::LIST>;
+    case Op::JMP_IF:
+        return _helper<Op::JMP_IF>;
+    case Op::JMP_IF_NOT:
+        return _helper<Op::JMP_IF_NOT>;
+    case Op::FOR_RANGE:
+        return _helper<Op::FOR_RANGE>;
+    case Op::FOR_EACH:
+        return _helper<Op::FOR_EACH>;
+    case Op::IF_EQ:
+        return _helper<Op::IF_EQ>;
+    case Op::IF_LT:
+        return _helper<Op::IF_LT>;
+    case Op::IF_LTEQ:
+        return _helper<Op::IF_LTEQ>;
+    case Op::IF_GT:
+        return _helper<Op::IF_GT>;
+    case Op::IF_GTEQ:
+        return _helper<Op::IF_GTEQ>;
+    case Op::IF_SAME:
+        return _helper<Op::IF_SAME>;
+    case Op::IF_MATCH:
+        return _helper<Op::IF_MATCH>;
+    case Op::THROW:
+        return _helper<Op::THROW>;
+    case Op::ASSERT:
+        return _helper<Op::ASSERT>;
+    case Op::ADD_CONST:
+        return _helper<Op::ADD_CONST>;
+    case Op::SUB_CONST:
+        return _helper<Op::SUB_CONST>;
+    default:
+        return nullptr;
+    }
+}
+
+// MARK: Assembler -------------------------------------------------------------
+
+// Just enough of x86-64 for the templates below. Jumps go to labels, which
+// are patched once the code is complete.
+struct Assembler {
+    enum Reg : u8 {
+        RAX,
+        RCX,
+        RDX,
+        RBX,
+        RSP,
+        RBP,
+        RSI,
+        RDI,
+        R8,
+        R9,
+        R10,
+        R11,
+        R12,
+        R13,
+        R14,
+        R15,
+    };
+
+    enum Cond : u8 {
+        O = 0x0,
+        E = 0x4,
+        NE = 0x5,
+        A = 0x7,
+        L = 0xc,
+        GE = 0xd,
+        LE = 0xe,
+        G = 0xf,
+    };
+
+    static Cond negate(Cond cc) {
+        return static_cast<Cond>(cc ^ 1);
+    }
+
+    struct Fixup {
+        usize at;
+        usize label;
+    };
+
+    Vec<u8> _buf;
+    Vec<Opt<usize>> _labels;
+    Vec<Fixup> _fixups;
+
+    usize here() const {
+        return _buf.len();
+    }
+
+    usize label() {
+        _labels.pushBack(NONE);
+        return _labels.len() - 1;
+    }
+
+    void bind(usize label) {
+        _labels[label] = here();
+    }
+
+    // Resolves every jump, fails if one goes to a label never bound.
+    bool link() {
+        for (auto& f : _fixups) {
+            if (not _labels[f.label])
+                return false;
+            i32 rel = static_cast<i32>(_labels[f.label].unwrap()) - static_cast<i32>(f.at + 4);
+            std::memcpy(&_buf[f.at], &rel, sizeof(rel));
+        }
+        return true;
+    }
+
+    // MARK: Encoding
+
+    void byte(u8 b) {
+        _buf.pushBack(b);
+    }
+
+    void dword(u32 d) {
+        for (usize i = 0; i < 4; i++)
+            byte((d >> (i * 8)) & 0xff);
+    }
+
+    void qword(u64 q) {
+        for (usize i = 0; i < 8; i++)
+            byte((q >> (i * 8)) & 0xff);
+    }
+
+    void rex(bool w, u8 reg, u8 rm) {
+        u8 r = 0x40 | (w ? 0x8 : 0) | ((reg >> 3) << 2) | (rm >> 3);
+        if (r != 0x40)
+            byte(r);
+    }
+
+    // Register to register, reg is the source of most two operand forms.
+    void rr(u8 opcode, Reg reg, Reg rm) {
+        rex(true, reg, rm);
+        byte(opcode);
+        byte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    // Register and [base + disp32].
+    void rm(u8 opcode, u8 reg, Reg base, i32 disp, bool w = true) {
+        rex(w, reg, base);
+        byte(opcode);
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == RSP)
+            byte(0x24);
+        dword(static_cast<u32>(disp));
+    }
+
+    // MARK: Instructions
+
+    void push(Reg r) {
+        rex(false, 0, r);
+        byte(0x50 | (r & 7));
+    }
+
+    void pop(Reg r) {
+        rex(false, 0, r);
+        byte(0x58 | (r & 7));
+    }
+
+    void ret() {
+        byte(0xc3);
+    }
+
+    void mov(Reg dst, Reg src) {
+        rr(0x89, src, dst);
+    }
+
+    void load(Reg dst, Reg base, i32 disp) {
+        rm(0x8b, dst, base, disp);
+    }
+
+    void store(Reg base, i32 disp, Reg src) {
+        rm(0x89, src, base, disp);
+    }
+
+    // mov qword [base + disp], imm32 sign extended
+    void storeImm(Reg base, i32 disp, i32 imm) {
+        rm(0xc7, 0, base, disp);
+        dword(static_cast<u32>(imm));
+    }
+
+    void lea(Reg dst, Reg base, i32 disp) {
+        rm(0x8d, dst, base, disp);
+    }
+
+    void movImm(Reg dst, u64 imm) {
+        rex(true, 0, dst);
+        byte(0xb8 | (dst & 7));
+        qword(imm);
+    }
+
+    void add(Reg dst, Reg src) {
+        rr(0x01, src, dst);
+    }
+
+    void sub(Reg dst, Reg src) {
+        rr(0x29, src, dst);
+    }
+
+    void and_(Reg dst, Reg src) {
+        rr(0x21, src, dst);
+    }
+
+    void or_(Reg dst, Reg src) {
+        rr(0x09, src, dst);
+    }
+
+    void cmp(Reg lhs, Reg rhs) {
+        rr(0x39, rhs, lhs);
+    }
+
+    void imul(Reg dst, Reg src) {
+        rex(true, dst, src);
+        byte(0x0f);
+        byte(0xaf);
+        byte(0xc0 | ((dst & 7) << 3) | (src & 7));
+    }
+
+    void shift(u8 ext, Reg r, u8 count) {
+        rex(true, 0, r);
+        byte(0xc1);
+        byte(0xc0 | (ext << 3) | (r & 7));
+        byte(count);
+    }
+
+    void shl(Reg r, u8 count) {
+        shift(4, r, count);
+    }
+
+    void shr(Reg r, u8 count) {
+        shift(5, r, count);
+    }
+
+    void sar(Reg r, u8 count) {
+        shift(7, r, count);
+    }
+
+    // cmp r32, imm32
+    void cmp32(Reg r, u32 imm) {
+        rex(false, 0, r);
+        byte(0x81);
+        byte(0xf8 | (r & 7));
+        dword(imm);
+    }
+
+    // cmp r64, imm8 sign extended
+    void cmp8(Reg r, i8 imm) {
+        rex(true, 0, r);
+        byte(0x83);
+        byte(0xf8 | (r & 7));
+        byte(static_cast<u8>(imm));
+    }
+
+    void test32(Reg r) {
+        rex(false, r, r);
+        byte(0x85);
+        byte(0xc0 | ((r & 7) << 3) | (r & 7));
+    }
+
+    void zero32(Reg r) {
+        rex(false, r, r);
+        byte(0x31);
+        byte(0xc0 | ((r & 7) << 3) | (r & 7));
+    }
+
+    void call(Reg r) {
+        rex(false, 0, r);
+        byte(0xff);
+        byte(0xd0 | (r & 7));
+    }
+
+    void jmp(Reg r) {
+        rex(false, 0, r);
+        byte(0xff);
+        byte(0xe0 | (r & 7));
+    }
+
+    void jmp(usize label) {
+        byte(0xe9);
+        _fixups.pushBack({here(), label});
+        dword(0);
+    }
+
+    void jcc(Cond cc, usize label) {
+        byte(0x0f);
+        byte(0x80 | cc);
+        _fixups.pushBack({here(), label});
+        dword(0);
+    }
+};
+
+// MARK: Templates -------------------------------------------------------------
+
+// The code for a prototype is entered through a prologue that jumps to the
+// instruction to resume at. Registers of the frame are addressed from r12,
+// the instructions from r13 and the frame itself sits in rbx. Instructions
+// call their helper, except integer arithmetic and comparisons that were
+// quickened by the interpreter, which get an inline fast path guarded by the
+// tags of their operands.
+struct Emitter {
+    using enum Assembler::Reg;
+    using Cond = Assembler::Cond;
+
+    Assembler _asm;
+    Proto& _proto;
+    Vec<usize> _pcs; // A label per instruction, and one past the end
+    usize _epilogue;
+
+    static constexpr u64 INTEGER_TAG = Value::_INTEGER_TAG;
+
+    Emitter(Proto& proto) : _proto(proto) {
+        for (usize i = 0; i <= proto._code.len(); i++)
+            _pcs.pushBack(_asm.label());
+        _epilogue = _asm.label();
+    }
+
+    static i32 reg(u16 r) {
+        return static_cast<i32>(r * sizeof(Value));
+    }
+
+    void prologue() {
+        _asm.push(RBX);
+        _asm.push(R12);
+        _asm.push(R13);
+        _asm.mov(RBX, RDI);
+        _asm.load(R12, RDI, offsetof(NativeFrame, regs));
+        _asm.load(R13, RDI, offsetof(NativeFrame, code));
+        _asm.jmp(RSI);
+    }
+
+    void epilogue() {
+        _asm.bind(_epilogue);
+        _asm.pop(R13);
+        _asm.pop(R12);
+        _asm.pop(RBX);
+        _asm.ret();
+    }
+
+    // Hands the frame back to the interpreter at pc.
+    void leave(usize pc) {
+        _asm.storeImm(RBX, offsetof(NativeFrame, pc), static_cast<i32>(pc));
+        _asm.zero32(RAX);
+        _asm.jmp(_epilogue);
+    }
+
+    // Calls fn with the frame and the instruction at pc.
+    void call(u64 fn, usize pc) {
+        _asm.mov(RDI, RBX);
+        _asm.lea(RSI, R13, static_cast<i32>(pc * sizeof(Instr)));
+        _asm.movImm(RAX, fn);
+        _asm.call(RAX);
+    }
+
+    void call(Helper helper, usize pc) {
+        call(reinterpret_cast<u64>(helper), pc);
+    }
+
+    // Loads a register as an integer, or jumps to slow if it isn't inline.
+    void integer(u16 r, usize slow) {
+        _asm.load(RAX, R12, reg(r));
+        _asm.mov(RDX, RAX);
+        _asm.shr(RDX, 48);
+        _asm.cmp32(RDX, 0xffff);
+        _asm.jcc(Cond::NE, slow);
+        _asm.shl(RAX, 16);
+        _asm.sar(RAX, 16);
+    }
+
+    // Loads two registers as integers, or jumps to slow if one isn't inline.
+    void integers(u16 lhs, u16 rhs, usize slow) {
+        _asm.load(RAX, R12, reg(lhs));
+        _asm.load(RCX, R12, reg(rhs));
+        _asm.mov(RDX, RAX);
+        _asm.and_(RDX, RCX);
+        _asm.shr(RDX, 48);
+        _asm.cmp32(RDX, 0xffff);
+        _asm.jcc(Cond::NE, slow);
+        _asm.shl(RAX, 16);
+        _asm.sar(RAX, 16);
+        _asm.shl(RCX, 16);
+        _asm.sar(RCX, 16);
+    }
+
+    void arithmetic(Op op, Instr const& ins, usize pc) {
+        auto slow = _asm.label();
+        auto store = _asm.label();
+        if (op == Op::ADD_CONST_INT or op == Op::SUB_CONST_INT) {
+            integer(ins.b, slow);
+            _asm.movImm(RCX, static_cast<u64>(_proto._consts[ins.c].unwrap<Integer>()));
+        } else {
+            integers(ins.b, ins.c, slow);
+        }
+
+        if (op == Op::ADD_INT or op == Op::ADD_CONST_INT) {
+            _asm.add(RAX, RCX);
+        } else if (op == Op::SUB_INT or op == Op::SUB_CONST_INT) {
+            _asm.sub(RAX, RCX);
+        } else {
+            _asm.imul(RAX, RCX);
+            _asm.jcc(Cond::O, slow);
+        }
+
+        // The result has to fit inline
+        _asm.mov(RDX, RAX);
+        _asm.shl(RDX, 16);
+        _asm.sar(RDX, 16);
+        _asm.cmp(RDX, RAX);
+        _asm.jcc(Cond::NE, slow);
+
+        // And so does what it overwrites, nothing to release
+        _asm.load(RDX, R12, reg(ins.a));
+        _asm.mov(RCX, RDX);
+        _asm.shr(RCX, 48);
+        _asm.jcc(Cond::NE, store);
+        _asm.cmp8(RDX, static_cast<i8>(Value::_TRUE));
+        _asm.jcc(Cond::A, slow);
+
+        _asm.bind(store);
+        _asm.shl(RAX, 16);
+        _asm.shr(RAX, 16);
+        _asm.movImm(RCX, INTEGER_TAG);
+        _asm.or_(RAX, RCX);
+        _asm.store(R12, reg(ins.a), RAX);
+        _asm.jmp(_pcs[pc + 1]);
+
+        _asm.bind(slow);
+        call(_helperFor(_generic(op)), pc);
+        _asm.test32(RAX);
+        _asm.jcc(Cond::NE, _epilogue);
+    }
+
+    void compare(Op op, Instr const& ins, usize pc) {
+        Cond cc;
+        switch (op) {
+        case Op::IF_EQ_INT:
+            cc = Cond::E;
+            break;
+        case Op::IF_LT_INT:
+            cc = Cond::L;
+            break;
+        case Op::IF_LTEQ_INT:
+            cc = Cond::LE;
+            break;
+        case Op::IF_GT_INT:
+            cc = Cond::G;
+            break;
+        default:
+            cc = Cond::GE;
+            break;
+        }
+
+        // The jump that follows is skipped when the outcome isn't c
+        auto slow = _asm.label();
+        integers(ins.a, ins.b, slow);
+        _asm.cmp(RAX, RCX);
+        _asm.jcc(ins.c ? Assembler::negate(cc) : cc, _pcs[pc + 2]);
+        _asm.jmp(_pcs[pc + 1]);
+
+        _asm.bind(slow);
+        call(_helperFor(_generic(op)), pc);
+        _asm.cmp32(RAX, TAKEN);
+        _asm.jcc(Cond::E, _pcs[pc + 2]);
+        _asm.jcc(Cond::A, _epilogue);
+    }
+
+    // Counts a range on in place while its bounds are inline integers.
+    void range(Instr const& ins, usize pc) {
+        auto slow = _asm.label();
+        auto store = _asm.label();
+        integers(ins.a, ins.a + 1, slow);
+        _asm.cmp(RAX, RCX);
+        _asm.jcc(Cond::GE, _pcs[ins.target()]);
+
+        // The item it overwrites holds nothing to release
+        _asm.load(RDX, R12, reg(ins.a + 2));
+        _asm.mov(RCX, RDX);
+        _asm.shr(RCX, 48);
+        _asm.jcc(Cond::NE, store);
+        _asm.cmp8(RDX, static_cast<i8>(Value::_TRUE));
+        _asm.jcc(Cond::A, slow);
+
+        // The counter stays below the end, so it still fits inline
+        _asm.bind(store);
+        _asm.load(RDX, R12, reg(ins.a));
+        _asm.store(R12, reg(ins.a + 2), RDX);
+        _asm.movImm(RCX, 1);
+        _asm.add(RAX, RCX);
+        _asm.shl(RAX, 16);
+        _asm.shr(RAX, 16);
+        _asm.movImm(RCX, INTEGER_TAG);
+        _asm.or_(RAX, RCX);
+        _asm.store(R12, reg(ins.a), RAX);
+        _asm.jmp(_pcs[pc + 1]);
+
+        _asm.bind(slow);
+        call(_helper<Op::FOR_RANGE>, pc);
+        _asm.cmp32(RAX, TAKEN);
+        _asm.jcc(Cond::E, _pcs[ins.target()]);
+        _asm.jcc(Cond::A, _epilogue);
+    }
+
+    void instr(usize pc) {
+        auto const& ins = _proto._code[pc];
+        auto op = ins.op;
+        auto len = _proto._code.len();
+        _asm.bind(_pcs[pc]);
+
+        switch (op) {
+        case Op::NOP:
+            return;
+
+        case Op::JMP:
+            if (ins.target() > len)
+                return leave(pc);
+            if (ins.target() <= pc)
+                call(_poll, pc);
+            _asm.jmp(_pcs[ins.target()]);
+            return;
+
+        case Op::ADD_INT:
+        case Op::SUB_INT:
+        case Op::MUL_INT:
+            return arithmetic(op, ins, pc);
+
+        case Op::ADD_CONST_INT:
+        case Op::SUB_CONST_INT:
+            if (_proto._consts[ins.c].kind() != Value::INTEGER)
+                break;
+            return arithmetic(op, ins, pc);
+
+        case Op::FOR_RANGE:
+            if (ins.target() > len)
+                return leave(pc);
+            return range(ins, pc);
+
+        case Op::MATCH:
+            call(reinterpret_cast<u64>(_dispatch), pc);
+            _asm.jmp(RAX);
+            return;
+
+        case Op::IF_EQ_INT:
+        case Op::IF_LT_INT:
+        case Op::IF_LTEQ_INT:
+        case Op::IF_GT_INT:
+        case Op::IF_GTEQ_INT:
+            if (pc + 2 > len)
+                return leave(pc);
+            return compare(op, ins, pc);
+
+        default:
+            break;
+        }
+
+        auto generic = _generic(op);
+        auto helper = _helperFor(generic);
+        if (not helper)
+            return leave(pc);
+
+        if (generic == Op::JMP_IF or generic == Op::JMP_IF_NOT or generic == Op::FOR_EACH) {
+            if (ins.target() > len)
+                return leave(pc);
+            call(helper, pc);
+            _asm.cmp32(RAX, TAKEN);
+            _asm.jcc(Cond::E, _pcs[ins.target()]);
+            _asm.jcc(Cond::A, _epilogue);
+            return;
+        }
+
+        if (generic == Op::IF_EQ or generic == Op::IF_LT or
+            generic == Op::IF_LTEQ or generic == Op::IF_GT or
+            generic == Op::IF_GTEQ or generic == Op::IF_SAME or
+            generic == Op::IF_MATCH) {
+            if (pc + 2 > len)
+                return leave(pc);
+            call(helper, pc);
+            _asm.cmp32(RAX, TAKEN);
+            _asm.jcc(Cond::E, _pcs[pc + 2]);
+            _asm.jcc(Cond::A, _epilogue);
+            return;
+        }
+
+        call(helper, pc);
+        _asm.test32(RAX);
+        _asm.jcc(Cond::NE, _epilogue);
+    }
+
+    bool emit() {
+        prologue();
+        auto len = _proto._code.len();
+        for (usize pc = 0; pc < len; pc++)
+            instr(pc);
+        _asm.bind(_pcs[len]);
+        leave(len);
+        epilogue();
+        return _asm.link();
+    }
+};
+
+// MARK: Jit -------------------------------------------------------------------
+
+export struct Jit {
+    static bool& perfMap() {
+        static bool enabled = false;
+        return enabled;
+    }
+
+#if defined(__x86_64__) and defined(__linux__)
+
+    struct Code : Native {
+        using Entry = u32 (*)(NativeFrame* frame, void const* target);
+
+        u8* _mem;
+        usize _len;
+        Vec<usize> _entries; // Offset of every instruction
+
+        Code(u8* mem, usize len, Vec<usize> entries)
+            : _mem(mem), _len(len), _entries(std::move(entries)) {}
+
+        ~Code() override {
+            munmap(_mem, _len);
+        }
+
+        CompletionOr<> run(NativeFrame& frame) override {
+            auto entry = reinterpret_cast<Entry>(_mem);
+            if (entry(&frame, _mem + _entries[frame.pc]) == THROW)
+                return frame.error;
+            return Ok();
+        }
+
+        void const* entry(usize pc) const override {
+            return _mem + _entries[pc];
+        }
+    };
+
+    static void install() {
+        Tiering::instance().compile = compile;
+    }
+
+    // Lets perf put a name on the frames of native code.
+    static void _writePerfMap(u8 const* mem, usize len, Proto const& proto) {
+        char path[64];
+        std::snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+        auto* file = std::fopen(path, "a");
+        if (not file)
+            return;
+        std::fprintf(file, "%zx %zx luna:proto@%p (%zu instrs)\n", reinterpret_cast<usize>(mem), len, static_cast<void const*>(&proto), proto._code.len());
+        std::fclose(file);
+    }
+
+    static Opt<Rc<Native>> compile(Proto& proto) {
+        Emitter e{proto};
+        if (not e.emit())
+            return NONE;
+
+        auto& buf = e._asm._buf;
+        auto len = buf.len();
+        auto* mem = static_cast<u8*>(mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (mem == MAP_FAILED)
+            return NONE;
+        std::memcpy(mem, buf.buf(), len);
+        if (mprotect(mem, len, PROT_READ | PROT_EXEC) != 0) {
+            munmap(mem, len);
+            return NONE;
+        }
+
+        Vec<usize> entries;
+        for (auto label : e._pcs)
+            entries.pushBack(e._asm._labels[label].unwrap());
+
+        if (perfMap())
+            _writePerfMap(mem, len, proto);
+        return Rc<Native>{makeRc<Code>(mem, len, std::move(entries))};
+    }
+
+#else
+
+    // Other platforms stay in the interpreter.
+    static void install() {}
+
+#endif
+};
+
+static_assert(sizeof(Instr) == 8, "the templates address instructions by pc * 8");
+
+} // namespace Luna
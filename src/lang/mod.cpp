@@ -2,10 +2,16 @@ export module Luna;
 
 export import Karm.Diag;
 
+export import :arena;
 export import :base;
 export import :builtins;
 export import :eval;
 export import :expr;
+export import :heap;
+export import :jit;
 export import :objects;
 export import :ops;
+export import :optimizer;
 export import :parser;
+export import :resolver;
+export import :vm;
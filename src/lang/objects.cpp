@@ -4,28 +4,110 @@ module;
 
 export module Luna:objects;
 
+import :arena;
 import :base;
+import :heap;
 import :ops;
 
 namespace Luna {
 
-export struct Table : Base {
-    Map<Value, Value> _fields;
+// Describes the symbol keys of a table and the slot each one is stored in.
+// Tables that receive the same keys in the same order end up sharing a
+// shape, transitions between shapes are cached on the parent. Shapes are
+// owned by that tree and live as long as the program, so tables and inline
+// caches can point at them directly.
+export struct Shape {
+    // Tables with more symbol keys than this keep the rest in their map.
+    static constexpr usize MAX_SLOTS = 64;
+
+    Map<Symbol, usize> _slots;
+    Vec<Symbol> _keys;
+    Map<Symbol, Rc<Shape>> _transitions;
+
+    static Shape* root() {
+        static Rc<Shape> root = makeRc<Shape>();
+        return &root.unwrap();
+    }
+
+    usize len() const {
+        return _keys.len();
+    }
+
+    Opt<usize> lookup(Symbol key) const {
+        return _slots.lookup(key);
+    }
+
+    Shape* with(Symbol key) {
+        if (auto next = _transitions.lookup(key))
+            return &next.unwrap().unwrap();
+
+        auto next = makeRc<Shape>();
+        next->_slots = _slots;
+        next->_keys = _keys;
+        next->_slots.put(key, _keys.len());
+        next->_keys.pushBack(key);
+        _transitions.put(key, next);
+        return &next.unwrap();
+    }
+};
+
+export struct Table : Object {
+    Shape* _shape = Shape::root();
+    Vec<Value> _slots;
+    Map<Value, Value> _fields; // Keys the shape doesn't describe
 
-    Table(Map<Value, Value> fields = {})
-        : _fields(std::move(fields)) {}
+    Table(Map<Value, Value> fields = {}) {
+        for (auto const& [k, v] : fields.iterItems())
+            _put(k, v);
+    }
 
     static CompletionOr<Reference> create(Map<Value, Value> fields = {}) {
         return Ok(makeRc<Table>(fields));
     }
 
+    Opt<usize> _slot(Value const& key) const {
+        if (auto sym = key.is<Symbol>())
+            return _shape->lookup(*sym);
+        return NONE;
+    }
+
+    void _put(Value key, Value value) {
+        write(value);
+        if (auto slot = _slot(key)) {
+            _slots[slot.unwrap()] = value;
+            return;
+        }
+
+        auto sym = key.is<Symbol>();
+        if (sym and _shape->len() < Shape::MAX_SLOTS and not _fields.contains(key)) {
+            _shape = _shape->with(*sym);
+            _slots.pushBack(value);
+            return;
+        }
+
+        write(key);
+        _fields.put(key, value);
+    }
+
+    // Every entry, the shape keys in insertion order come first.
+    Vec<Tuple<Value, Value>> items() const {
+        Vec<Tuple<Value, Value>> res;
+        for (usize i : urange::zeroTo(_slots.len()))
+            res.pushBack({_shape->_keys[i], _slots[i]});
+        for (auto const& [k, v] : _fields.iterItems())
+            res.pushBack({k, v});
+        return res;
+    }
+
     CompletionOr<Value> get(Value key) override {
+        if (auto slot = _slot(key))
+            return Ok(_slots[slot.unwrap()]);
         return _fields.lookup(key)
             .okOr(Completion::exception("key not found"));
     }
 
     CompletionOr<> set(Value key, Value value) override {
-        _fields.put(key, value);
+        _put(key, value);
         return Ok();
     }
 
@@ -34,6 +116,8 @@ export struct Table : Base {
     }
 
     CompletionOr<Boolean> has(Value key) override {
+        if (_slot(key))
+            return Ok(true);
         return Ok(_fields.contains(key));
     }
 
@@ -45,7 +129,7 @@ export struct Table : Base {
         if (not try$(opEq(try$(len()), try$(opLen(rhs)))))
             return Ok(false);
 
-        for (auto const& [k, v] : _fields.iterItems()) {
+        for (auto const& [k, v] : items()) {
             if (not try$(opHas(rhs, k)))
                 return Ok(false);
 
@@ -59,7 +143,7 @@ export struct Table : Base {
         StringBuilder sb;
         sb.append("{"s);
         bool first = true;
-        for (auto const& [k, v] : _fields.iterItems()) {
+        for (auto const& [k, v] : items()) {
             if (not first)
                 sb.append(", "s);
             first = false;
@@ -73,19 +157,43 @@ export struct Table : Base {
     }
 
     CompletionOr<Boolean> boolean() override {
-        return Ok(_fields.len() != 0);
+        return Ok(_slots.len() != 0 or _fields.len() != 0);
     }
 
     CompletionOr<Integer> len() const override {
-        return Ok(_fields.len());
+        return Ok(_slots.len() + _fields.len());
     }
 
     void hash(Hasher& h) const override {
-        Karm::hash(h, _fields);
+        for (auto const& [k, v] : items()) {
+            Karm::hash(h, k);
+            Karm::hash(h, v);
+        }
+    }
+
+    void trace(Heap& heap) override {
+        for (auto& v : _slots)
+            heap.mark(v);
+        for (auto const& [k, v] : _fields.iterItems()) {
+            heap.mark(k);
+            heap.mark(v);
+        }
+    }
+
+    void clear(Vec<Value>& graveyard) override {
+        for (auto& v : _slots)
+            graveyard.pushBack(std::move(v));
+        for (auto& [k, v] : _fields.iterItems()) {
+            graveyard.pushBack(k);
+            graveyard.pushBack(std::move(v));
+        }
+        _shape = Shape::root();
+        _slots.clear();
+        _fields.clear();
     }
 };
 
-export struct List : Base {
+export struct List : Object {
     Vec<Value> _items;
 
     List(Vec<Value> items = {})
@@ -106,6 +214,7 @@ export struct List : Base {
         auto index = try$(asIndex(key));
         if (0 <= index and index < (Integer)_items.len()) {
             _items[index] = value;
+            write(value);
             return Ok();
         }
         return Completion::exception("index out of bound");
@@ -167,105 +276,656 @@ export struct List : Base {
     void hash(Hasher& h) const override {
         Karm::hash(h, _items);
     }
+
+    void trace(Heap& heap) override {
+        for (auto& v : _items)
+            heap.mark(v);
+    }
+
+    void clear(Vec<Value>& graveyard) override {
+        for (auto& v : _items)
+            graveyard.pushBack(std::move(v));
+        _items.clear();
+    }
+};
+
+// MARK: Inline Caches ---------------------------------------------------------
+
+// Hit and miss counters of a cache, sites register themselves while
+// profiling is enabled so their hit rates can be reported.
+export struct CacheStats {
+    String site;
+    usize hits = 0;
+    usize misses = 0;
+    usize entries = 0;
+    bool megamorphic = false;
+
+    virtual ~CacheStats() = default;
+
+    static bool& profiling() {
+        static bool profiling = false;
+        return profiling;
+    }
+
+    static Vec<Rc<CacheStats>>& sites() {
+        static Vec<Rc<CacheStats>> sites;
+        return sites;
+    }
+
+    static void track(Rc<CacheStats> cache, Value site) {
+        if (not profiling())
+            return;
+        cache->site = Io::format("{}", site);
+        sites().pushBack(cache);
+    }
+
+    Str state() const {
+        if (megamorphic)
+            return "megamorphic";
+        if (entries > 1)
+            return "polymorphic";
+        if (entries == 1)
+            return "monomorphic";
+        return "uninitialized";
+    }
+};
+
+// Caches where a constant symbol key lives in the tables seen at a site,
+// keyed on their shape. A set that adds the key remembers the transition.
+export struct PropertyCache : CacheStats {
+    static constexpr usize WAYS = 4;
+
+    struct Way {
+        Shape* shape;
+        Shape* next; // Shape after adding the key, nullptr if already there
+        usize slot;
+    };
+
+    Symbol _key;
+    Array<Way, WAYS> _ways = {};
+
+    PropertyCache(Symbol key)
+        : _key(key) {}
+
+    static Table* _table(Value const& target) {
+        if (auto obj = target.is<Reference>())
+            return (*obj).is<Table>();
+        return nullptr;
+    }
+
+    void _remember(Way way) {
+        if (entries == WAYS) {
+            megamorphic = true;
+            return;
+        }
+        _ways[entries++] = way;
+    }
+
+    CompletionOr<Value> get(Value const& target) {
+        auto* table = _table(target);
+        if (not table) {
+            misses++;
+            return opGet(target, _key);
+        }
+
+        for (usize i = 0; i < entries; i++) {
+            auto& way = _ways[i];
+            if (way.shape == table->_shape and not way.next) {
+                hits++;
+                return Ok(table->_slots[way.slot]);
+            }
+        }
+
+        misses++;
+        if (auto slot = table->_shape->lookup(_key); slot and not megamorphic)
+            _remember({table->_shape, nullptr, slot.unwrap()});
+        return table->get(_key);
+    }
+
+    CompletionOr<> set(Value const& target, Value const& value) {
+        auto* table = _table(target);
+        if (not table) {
+            misses++;
+            return opSet(target, _key, value);
+        }
+
+        auto* shape = table->_shape;
+        for (usize i = 0; i < entries; i++) {
+            auto& way = _ways[i];
+            if (way.shape != shape)
+                continue;
+            hits++;
+            if (way.next) {
+                table->_shape = way.next;
+                table->_slots.pushBack(value);
+            } else {
+                table->_slots[way.slot] = value;
+            }
+            table->write(value);
+            return Ok();
+        }
+
+        misses++;
+        table->_put(_key, value);
+        if (megamorphic)
+            return Ok();
+        if (table->_shape != shape)
+            _remember({shape, table->_shape, shape->len()});
+        else if (auto slot = shape->lookup(_key))
+            _remember({shape, nullptr, slot.unwrap()});
+        return Ok();
+    }
+};
+
+// A variable shared between a frame and the closures that capture it.
+export struct Cell : Object {
+    Value value = NONE;
+
+    void store(Value v) {
+        value = v;
+        write(value);
+    }
+
+    CompletionOr<Value> string() override {
+        return Ok(Io::format("<cell {}>", value));
+    }
+
+    void trace(Heap& heap) override {
+        heap.mark(value);
+    }
+
+    void clear(Vec<Value>& graveyard) override {
+        graveyard.pushBack(std::move(value));
+        value = NONE;
+    }
+};
+
+// Maps the names of a scope to the slots of its environments. Layouts built
+// by the resolver are shared by every environment created from the same
+// scope and are never mutated at runtime, an environment that needs to grow
+// one takes its own copy first.
+export struct Layout {
+    enum struct Kind : u8 {
+        PLAIN,   // the value lives in the slot
+        CELL,    // captured by a closure, the slot owns a fresh cell
+        UPVALUE, // the slot holds a cell captured from an outer function
+    };
+
+    using enum Kind;
+
+    Map<Value, usize> _names;
+    Vec<Kind> _kinds;
+    Vec<Opt<usize>> _aggregates; // Resolver bookkeeping, see Resolver::aggregate()
+    usize _len = 0;
+    usize _cells = 0;
+    bool _shared = false;
+
+    static Rc<Layout> shared() {
+        auto layout = makeRc<Layout>();
+        layout->_shared = true;
+        return layout;
+    }
+
+    usize len() const {
+        return _len;
+    }
+
+    Opt<usize> lookup(Value key) const {
+        return _names.lookup(key);
+    }
+
+    usize add(Value key, Kind kind = PLAIN) {
+        if (auto slot = lookup(key))
+            return slot.unwrap();
+        _names.put(key, _len);
+        _kinds.pushBack(kind);
+        return _len++;
+    }
+
+    // A slot that no name refers to, only the resolver knows what it holds.
+    usize anonymous() {
+        _kinds.pushBack(PLAIN);
+        return _len++;
+    }
+
+    bool boxed(usize slot) const {
+        return _kinds[slot] != PLAIN;
+    }
+
+    void box(usize slot) {
+        if (_kinds[slot] != PLAIN)
+            return;
+        _kinds[slot] = CELL;
+        _cells++;
+    }
+};
+
+// The tree-walking interpreter doesn't unwind a return, break or continue,
+// it leaves it pending in the environment of the call, its frame. Every node
+// stops right after the child that jumped, up to the loop or the call that
+// lands it.
+export enum struct Jump : u8 {
+    NONE,
+    RETURN,
+    BREAK,
+    CONTINUE,
 };
 
-export struct Environment : Base {
+export struct Environment : Object {
     Value _parent;
-    Reference _decls = makeRc<Table>();
+    Environment* _outer = nullptr;
+    Environment* _frame = this; // Environment of the call or program this one belongs to
+    Rc<Layout> _layout;
+    Vec<Value> _slots;
+    Map<Value, bool> _globals; // Declared by the programs run in a root, true for constants
+    Jump _jump = Jump::NONE;   // Pending in a frame
+    Value _jumped = NONE;      // Value of the pending jump
+
+    Environment(Value parent, Rc<Layout> layout)
+        : _parent(parent), _layout(layout) {
+        if (auto ref = parent.is<Reference>())
+            _outer = (*ref).is<Environment>();
+        else
+            Heap::instance().root(*this);
+        if (_outer)
+            _frame = _outer->_frame;
+        _slots.resize(_layout->len(), NONE);
+        if (_layout->_cells) {
+            for (usize i : urange::zeroTo(_slots.len()))
+                if (_layout->_kinds[i] == Layout::CELL)
+                    _slots[i] = Reference{makeRc<Cell>()};
+        }
+    }
 
-    Environment(Value parent) : _parent(parent) {}
+    ~Environment() override {
+        if (not _outer)
+            Heap::instance().unroot(*this);
+    }
 
     static CompletionOr<Reference> create(Value parent) {
-        return Ok(makeRc<Environment>(parent));
+        return create(parent, makeRc<Layout>());
+    }
+
+    static CompletionOr<Reference> create(Value parent, Rc<Layout> layout) {
+        return Ok(Pool<Environment>::instance().make(parent, layout));
+    }
+
+    static Reference ancestor(Reference env, usize depth) {
+        while (depth--)
+            env = env.is<Environment>()->_parent.unwrap<Reference>();
+        return env;
+    }
+
+    // Walk up the chain of enclosing environments, returns nullptr if the
+    // chain is shorter than expected.
+    Environment* up(usize depth) {
+        auto* env = this;
+        while (env and depth--)
+            env = env->_outer;
+        return env;
+    }
+
+    Cell& cell(usize slot) {
+        return static_cast<Cell&>(_slots[slot].unwrap<Reference>().unwrap());
+    }
+
+    void jump(Jump jump, Value value) {
+        _frame->_jump = jump;
+        _frame->_jumped = value;
+    }
+
+    Jump jumping() const {
+        return _frame->_jump;
+    }
+
+    // Takes the value of the pending jump once it reached its target.
+    Value land() {
+        _frame->_jump = Jump::NONE;
+        return std::exchange(_frame->_jumped, NONE);
+    }
+
+    Value load(usize slot) {
+        if (_layout->boxed(slot))
+            return cell(slot).value;
+        return _slots[slot];
+    }
+
+    void store(usize slot, Value value) {
+        if (_layout->boxed(slot)) {
+            cell(slot).store(value);
+        } else {
+            _slots[slot] = value;
+            write(value);
+        }
     }
 
     CompletionOr<Value> get(Value key) override {
-        if (try$(opHas(_decls, key)))
-            return opGet(_decls, key);
+        if (auto slot = _layout->lookup(key))
+            return Ok(load(slot.unwrap()));
 
-        if (try$(asBoolean(_parent)))
-            return opGet(_parent, key);
+        if (_outer)
+            return _outer->get(key);
 
         return Completion::exception("not defined");
     }
 
     CompletionOr<> set(Value key, Value value) override {
-        if (try$(opHas(_decls, key)))
-            return opSet(_decls, key, value);
-
-        if (try$(asBoolean(_parent))) {
-            if (try$(opHas(_parent, key)))
-                return opSet(_parent, key, value);
+        if (auto slot = _layout->lookup(key)) {
+            store(slot.unwrap(), value);
+            return Ok();
         }
 
-        return opSet(_decls, key, value);
+        if (_outer and try$(_outer->has(key)))
+            return _outer->set(key, value);
+
+        return decl(key, value);
     }
 
     CompletionOr<> decl(Value key, Value value) override {
-        return opSet(_decls, key, value);
+        if (auto slot = _layout->lookup(key)) {
+            store(slot.unwrap(), value);
+            return Ok();
+        }
+
+        if (_layout->_shared) {
+            _layout = makeRc<Layout>(_layout.unwrap());
+            _layout->_shared = false;
+        }
+        _layout->add(key);
+        _slots.pushBack(value);
+        write(value);
+        return Ok();
     }
 
     CompletionOr<Boolean> has(Value key) override {
-        if (try$(opHas(_decls, key)))
+        if (_layout->lookup(key))
             return Ok(true);
 
-        if (try$(asBoolean(_parent)))
-            return opHas(_parent, key);
+        if (_outer)
+            return _outer->has(key);
 
         return Ok(false);
     }
+
+    void trace(Heap& heap) override {
+        heap.mark(_parent);
+        heap.mark(_jumped);
+        for (auto& v : _slots)
+            heap.mark(v);
+    }
+
+    void clear(Vec<Value>& graveyard) override {
+        graveyard.pushBack(std::move(_parent));
+        graveyard.pushBack(std::move(_jumped));
+        for (auto& v : _slots)
+            graveyard.pushBack(std::move(v));
+        _parent = NONE;
+        _jumped = NONE;
+        _outer = nullptr;
+        _frame = this;
+        _slots.clear();
+    }
+};
+
+// Remembers where a global lives in the layout of the root environment. Root
+// layouts only ever grow, so a slot stays valid as long as the layout is the
+// same one, names that are not globals fall back to a lookup by name.
+export struct GlobalCache {
+    Value name;
+    Opt<Rc<Layout>> layout = NONE;
+    usize slot = 0;
+
+    Opt<usize> _resolve(Environment& global) {
+        if (layout and &layout.unwrap().unwrap() == &global._layout.unwrap())
+            return slot;
+
+        auto found = global._layout->lookup(name);
+        if (not found)
+            return NONE;
+
+        layout = global._layout;
+        slot = found.unwrap();
+        return slot;
+    }
+
+    CompletionOr<Value> load(Environment& env, usize depth) {
+        auto* global = env.up(depth);
+        if (not global)
+            return env.get(name);
+
+        auto found = _resolve(*global);
+        if (not found)
+            return env.get(name);
+
+        return Ok(global->_slots[found.unwrap()]);
+    }
+
+    CompletionOr<> store(Environment& env, usize depth, Value value) {
+        auto* global = env.up(depth);
+        if (not global)
+            return env.set(name, value);
+
+        auto found = _resolve(*global);
+        if (not found)
+            return env.set(name, value);
+
+        global->_slots[found.unwrap()] = value;
+        global->write(value);
+        return Ok();
+    }
 };
 
 struct Param {
     Value key;
     Value value = NONE;
     bool required = false;
+    usize slot = 0; // In the layout of the function
+};
+
+// Where the resolver found a variable, relative to the innermost scope.
+export struct Binding {
+    usize depth;
+    usize slot;
+    Rc<Layout> layout;
+};
+
+// Where a closure finds a captured cell when it is created, relative to the
+// environment it is created in, and the slot of its frame that receives it.
+export struct Capture {
+    usize depth;
+    usize slot;
+    usize target;
+};
+
+// Where each parameter of a callee takes its value from at a call site: the
+// index of an argument, or its default. A site keeps the plan for the last
+// signature it called, closures created from the same code share their
+// layout and so their plan.
+export struct ArgPlan {
+    static constexpr usize DEFAULT = static_cast<usize>(-1);
+    static constexpr usize MISSING = static_cast<usize>(-2);
+
+    Opt<Rc<Layout>> layout = NONE;
+    Vec<usize> sources;
+
+    bool matches(Layout const& other) const {
+        return layout and &layout.unwrap().unwrap() == &other;
+    }
+};
+
+// A call left by a function body to the function it returns from, so that
+// calls in tail position don't grow the native stack. It travels as the value
+// of the completion and owns everything the call needs, the site keeps the
+// plan alive.
+export struct TailCall : Object {
+    Value callee;
+    Vec<Value> values;
+    Vec<Opt<Value>> keys;
+    Rc<CacheStats> site;
+    ArgPlan* plan;
+
+    TailCall(Value callee, Vec<Value> values, Vec<Opt<Value>> keys, Rc<CacheStats> site, ArgPlan* plan)
+        : callee(callee), values(std::move(values)), keys(std::move(keys)), site(site), plan(plan) {}
+
+    static Completion create(Value callee, Vec<Value> values, Vec<Opt<Value>> keys, Rc<CacheStats> site, ArgPlan* plan) {
+        Reference call = Pool<TailCall>::instance().make(callee, std::move(values), std::move(keys), site, plan);
+        return Completion::tailCall(call);
+    }
+
+    Args args() const {
+        return {values.buf(), keys.len() ? keys.buf() : nullptr, values.len(), plan};
+    }
+
+    void trace(Heap& heap) override {
+        heap.mark(callee);
+        for (auto& v : values)
+            heap.mark(v);
+    }
+
+    void clear(Vec<Value>& graveyard) override {
+        graveyard.pushBack(std::move(callee));
+        for (auto& v : values)
+            graveyard.pushBack(std::move(v));
+        callee = NONE;
+        values.clear();
+    }
+};
+
+struct Upvalue {
+    usize slot;
+    Value cell;
 };
 
-using Native = Func<CompletionOr<Value>(Reference params)>;
+using Native = Func<CompletionOr<Value>(Args args)>;
 
 using Code = Union<
     Value,
     Native>;
 
-export struct Func : Base {
-    Reference _env;
+export struct Func : Object {
+    Value _env;
     Vec<Param> _sig;
     Code _code;
+    Rc<Layout> _layout;
+    Vec<Upvalue> _upvalues;
 
-    Func(Reference env, Vec<Param> sig, Code code)
-        : _env(env), _sig(sig), _code(std::move(code)) {}
+    Func(Value env, Vec<Param> sig, Code code, Rc<Layout> layout, Vec<Upvalue> upvalues)
+        : _env(env), _sig(sig), _code(std::move(code)), _layout(layout), _upvalues(std::move(upvalues)) {
+        for (auto& p : _sig)
+            p.slot = _layout->lookup(p.key).unwrapOr(0);
+    }
 
-    static CompletionOr<Reference> create(Reference env, Vec<Param> sig, Code code) {
-        return Ok(makeRc<Func>(env, sig, std::move(code)));
+    static CompletionOr<Reference> create(Reference env, Vec<Param> sig, Code code, Rc<Layout> layout = Layout::shared(), Vec<Upvalue> upvalues = {}) {
+        return Ok(makeRc<Func>(env, sig, std::move(code), layout, std::move(upvalues)));
     }
 
-    CompletionOr<Value> call(Reference params) override {
-        auto locals = try$(Environment::create(_env));
+    // Create a closure over the cells listed in captures, it only keeps the
+    // root environment alive instead of the whole chain it was created in.
+    static CompletionOr<Reference> close(Reference env, Vec<Param> sig, Code code, Rc<Layout> layout, Vec<Capture> const& captures, usize rootDepth) {
+        auto* scope = env.is<Environment>();
+        Vec<Upvalue> upvalues;
+        for (auto& c : captures)
+            upvalues.pushBack({c.target, scope->up(c.depth)->_slots[c.slot]});
+        return create(Environment::ancestor(env, rootDepth), sig, std::move(code), layout, std::move(upvalues));
+    }
 
-        Integer index = 0;
+    // Work out which argument each parameter takes, named arguments win over
+    // positional ones and parameters left over fall back to their default.
+    void match(Args args, ArgPlan& plan) const {
+        plan.layout = _layout;
+        plan.sources.clear();
+        usize index = 0;
         for (auto& s : _sig) {
-            if (try$(opHas(params, s.key))) {
-                try$(opDecl(locals, s.key, try$(opGet(params, s.key))));
-            } else if (try$(opHas(params, index))) {
-                try$(opDecl(locals, s.key, try$(opGet(params, index))));
+            if (auto i = args.find(s.key)) {
+                plan.sources.pushBack(i.unwrap());
+            } else if (auto i = args.nth(index)) {
+                plan.sources.pushBack(i.unwrap());
                 index++;
-            } else if (not s.required) {
-                try$(opDecl(locals, s.key, s.value));
             } else {
-                return Completion::exception("missing parameter");
+                plan.sources.pushBack(s.required ? ArgPlan::MISSING : ArgPlan::DEFAULT);
             }
         }
+    }
+
+    // Positional arguments are copied straight into the slots of the
+    // parameters, anything else goes through the plan of the call site.
+    CompletionOr<Reference> bind(Args args) {
+        auto locals = try$(Environment::create(_env, _layout));
+        auto* scope = locals.is<Environment>();
+        for (auto& u : _upvalues)
+            scope->_slots[u.slot] = u.cell;
+
+        if (not args.keyed() and args.len() >= _sig.len()) {
+            for (usize i : urange::zeroTo(_sig.len()))
+                scope->store(_sig[i].slot, args[i]);
+            return Ok(locals);
+        }
+
+        ArgPlan local;
+        auto& plan = args._plan ? *args._plan : local;
+        if (not plan.matches(*_layout))
+            match(args, plan);
+
+        for (usize i : urange::zeroTo(_sig.len())) {
+            auto source = plan.sources[i];
+            if (source == ArgPlan::MISSING)
+                return Completion::exception("missing parameter");
+            scope->store(_sig[i].slot, source == ArgPlan::DEFAULT ? _sig[i].value : args[source]);
+        }
 
+        return Ok(locals);
+    }
+
+    CompletionOr<Value> _eval(Args args) {
         return _code.visit(Visitor{
-            [&](Value expr) {
-                return opEval(expr, locals);
+            [&](Value expr) -> CompletionOr<Value> {
+                auto locals = try$(bind(args));
+                auto* frame = locals.is<Environment>();
+                frame->_frame = frame;
+                auto value = try$(opEval(expr, locals));
+                if (frame->jumping() != Jump::NONE)
+                    return Ok(frame->land());
+                return Ok(value);
             },
             [&](Native& native) {
-                return native(locals);
+                return native(args);
             },
         });
     }
+
+    CompletionOr<Value> call(Args args) override {
+        ForeignScope foreign;
+        auto res = _eval(args);
+        while (not res and res.none().type == Completion::TAIL_CALL) {
+            auto next = res.none().value;
+            auto& call = *next.unwrap<Reference>().is<TailCall>();
+            auto obj = try$(asObject(call.callee));
+            if (auto* func = obj.is<Func>())
+                res = func->_eval(call.args());
+            else
+                res = obj->call(call.args());
+        }
+        return res;
+    }
+
+    void trace(Heap& heap) override {
+        heap.mark(_env);
+        for (auto& p : _sig)
+            heap.mark(p.value);
+        for (auto& u : _upvalues)
+            heap.mark(u.cell);
+    }
+
+    void clear(Vec<Value>& graveyard) override {
+        graveyard.pushBack(std::move(_env));
+        for (auto& p : _sig)
+            graveyard.pushBack(std::move(p.value));
+        for (auto& u : _upvalues)
+            graveyard.pushBack(std::move(u.cell));
+        _env = NONE;
+        _sig.clear();
+        _upvalues.clear();
+    }
 };
 
 } // namespace Luna
@@ -5,6 +5,7 @@ module;
 export module Luna:ops;
 
 import Karm.Logger;
+import :arena;
 import :base;
 
 namespace Luna {
@@ -12,43 +13,37 @@ namespace Luna {
 // MARK: TypeOf ----------------------------------------------------------------
 
 Symbol typeOf(Value v) {
-    return v.visit(Visitor{
-        [](None) {
-            return Symbols::NONE;
-        },
-        [](Boolean) {
-            return Symbols::BOOLEAN;
-        },
-        [](Integer) {
-            return Symbols::INTEGER;
-        },
-        [](Number) {
-            return Symbols::NUMBER;
-        },
-        [](Symbol) {
-            return Symbols::SYMBOL;
-        },
-        [](String) {
-            return Symbols::STRING;
-        },
-        [](Reference) {
-            return Symbols::OBJECT;
-        },
-    });
+    switch (v.kind()) {
+    case Value::NONE:
+        return Symbols::NONE;
+    case Value::BOOLEAN:
+        return Symbols::BOOLEAN;
+    case Value::INTEGER:
+        return Symbols::INTEGER;
+    case Value::NUMBER:
+        return Symbols::NUMBER;
+    case Value::SYMBOL:
+        return Symbols::SYMBOL;
+    case Value::STRING:
+        return Symbols::STRING;
+    case Value::OBJECT:
+        return Symbols::OBJECT;
+    }
+    unreachable();
 }
 
 // MARK: Is --------------------------------------------------------------------
 
 Boolean isNone(Value v) {
-    return v.is<None>();
+    return v.kind() == Value::NONE;
 }
 
 Boolean isBoolean(Value v) {
-    return v.is<Boolean>();
+    return v.kind() == Value::BOOLEAN;
 }
 
 Boolean isInteger(Value v) {
-    return v.is<Integer>();
+    return v.kind() == Value::INTEGER;
 }
 
 Boolean isIndex(Value v) {
@@ -56,23 +51,23 @@ Boolean isIndex(Value v) {
 }
 
 Boolean isNumber(Value v) {
-    return v.is<Number>();
+    return v.kind() == Value::NUMBER;
 }
 
 Boolean isScalar(Value v) {
-    return isNone(v) or isBoolean(v) or isInteger(v) or isNumber(v);
+    return v.kind() <= Value::NUMBER;
 }
 
 Boolean isSymbol(Value v) {
-    return v.is<Symbol>();
+    return v.kind() == Value::SYMBOL;
 }
 
 Boolean isString(Value v) {
-    return v.is<String>();
+    return v.kind() == Value::STRING;
 }
 
 Boolean isObject(Value v) {
-    return v.is<Reference>();
+    return v.kind() == Value::OBJECT;
 }
 
 Boolean is(Value v, Symbol type) {
@@ -123,7 +118,7 @@ CompletionOr<Boolean> asBoolean(Value v) {
         [](Symbol) -> CompletionOr<Boolean> {
             return Ok(true);
         },
-        [](String s) -> CompletionOr<Boolean> {
+        [](Str s) -> CompletionOr<Boolean> {
             return Ok(s.len() > 0);
         },
         [](Reference o) -> CompletionOr<Boolean> {
@@ -195,7 +190,7 @@ CompletionOr<String> asString(Value v) {
         [](Symbol s) -> CompletionOr<String> {
             return Ok<String>(s.str());
         },
-        [](String s) -> CompletionOr<String> {
+        [](Str s) -> CompletionOr<String> {
             return Ok<String>(s);
         },
         [](Reference o) -> CompletionOr<String> {
@@ -207,6 +202,13 @@ CompletionOr<String> asString(Value v) {
     });
 }
 
+// The view borrows from v, it must not outlive it.
+CompletionOr<Str> asStr(Value const& v) {
+    if (auto str = v.is<Str>())
+        return Ok(*str);
+    return Completion::exception("could not convert to string");
+}
+
 CompletionOr<Symbol> asSymbol(Value v) {
     return v.visit(Visitor{
         [](Symbol s) -> CompletionOr<Symbol> {
@@ -266,7 +268,7 @@ CompletionOr<Boolean> opEq(Value lhs, Value rhs) {
     if (isString(lhs) or isString(rhs)) {
         if (isString(lhs) != isString(rhs))
             return Ok(false);
-        return Ok(try$(asString(lhs)) == try$(asString(rhs)));
+        return Ok(lhs == rhs);
     }
 
     if (isNumber(lhs) or isNumber(rhs))
@@ -275,6 +277,16 @@ CompletionOr<Boolean> opEq(Value lhs, Value rhs) {
     return Ok(try$(asInteger(lhs)) == try$(asInteger(rhs)));
 }
 
+// Equal without converting either side, the way a literal pattern of a
+// match compares: 1 doesn't match 1.0, nor #a "a".
+CompletionOr<Boolean> opMatch(Value value, Value literal) {
+    if (value.kind() != literal.kind())
+        return Ok(false);
+    if (isNone(value))
+        return Ok(true);
+    return opEq(value, literal);
+}
+
 static Symbol _fromOrdering(std::partial_ordering ordering) {
     if (ordering == std::partial_ordering::less)
         return Symbols::LESS;
@@ -291,62 +303,58 @@ static Symbol _fromOrdering(std::partial_ordering ordering) {
     unreachable();
 }
 
-static Symbol _fromOrdering(std::strong_ordering ordering) {
-    if (ordering == std::strong_ordering::less)
-        return Symbols::LESS;
+static std::partial_ordering _toOrdering(Symbol order) {
+    if (order == Symbols::LESS)
+        return std::partial_ordering::less;
 
-    if (ordering == std::strong_ordering::equivalent)
-        return Symbols::EQUIVALENT;
+    if (order == Symbols::EQUIVALENT)
+        return std::partial_ordering::equivalent;
 
-    if (ordering == std::strong_ordering::greater)
-        return Symbols::GREATER;
+    if (order == Symbols::GREATER)
+        return std::partial_ordering::greater;
 
-    if (ordering == std::strong_ordering::equal)
-        return Symbols::EQUIVALENT;
+    return std::partial_ordering::unordered;
+}
 
-    unreachable();
+// Objects order themselves by symbol, everything else is compared as is.
+static CompletionOr<std::partial_ordering> _order(Value lhs, Value rhs) {
+    if (auto o = lhs.is<Reference>())
+        return Ok(_toOrdering(try$(o->unwrap().cmp(rhs))));
+
+    if (isString(lhs) and isString(rhs))
+        return Ok<std::partial_ordering>(try$(asStr(lhs)) <=> try$(asStr(rhs)));
+
+    if (isString(lhs) or isString(rhs))
+        return Ok<std::partial_ordering>(try$(asString(lhs)) <=> try$(asString(rhs)));
+
+    if (isNumber(lhs) or isNumber(rhs))
+        return Ok<std::partial_ordering>(try$(asNumber(lhs)) <=> try$(asNumber(rhs)));
+
+    return Ok<std::partial_ordering>(try$(asInteger(lhs)) <=> try$(asInteger(rhs)));
 }
 
 CompletionOr<Symbol> opCmp(Value lhs, Value rhs) {
     if (auto o = lhs.is<Reference>())
         return o->unwrap().cmp(rhs);
+    return Ok(_fromOrdering(try$(_order(lhs, rhs))));
+}
 
-    if (isString(lhs) or isString(rhs))
-        return Ok(
-            _fromOrdering(
-                try$(asString(lhs)) <=>
-                try$(asString(rhs))
-            )
-        );
+// Comparisons answer directly instead of going through an ordering symbol.
 
-    if (isNumber(lhs) or isNumber(rhs))
-        return Ok(
-            _fromOrdering(
-                try$(asNumber(lhs)) <=>
-                try$(asNumber(rhs))
-            )
-        );
+CompletionOr<Boolean> opLt(Value lhs, Value rhs) {
+    return Ok(try$(_order(lhs, rhs)) < 0);
+}
 
-    return Ok(
-        _fromOrdering(
-            try$(asInteger(lhs)) <=>
-            try$(asInteger(rhs))
-        )
-    );
+CompletionOr<Boolean> opLtEq(Value lhs, Value rhs) {
+    return Ok(try$(_order(lhs, rhs)) <= 0);
 }
 
-CompletionOr<Boolean> opAnd(Value lhs, Value rhs) {
-    return Ok(
-        try$(asBoolean(lhs)) and
-        try$(asBoolean(rhs))
-    );
+CompletionOr<Boolean> opGt(Value lhs, Value rhs) {
+    return Ok(try$(_order(lhs, rhs)) > 0);
 }
 
-CompletionOr<Boolean> opOr(Value lhs, Value rhs) {
-    return Ok(
-        try$(asBoolean(lhs)) or
-        try$(asBoolean(rhs))
-    );
+CompletionOr<Boolean> opGtEq(Value lhs, Value rhs) {
+    return Ok(try$(_order(lhs, rhs)) >= 0);
 }
 
 CompletionOr<Boolean> opNot(Value v) {
@@ -378,23 +386,17 @@ CompletionOr<Boolean> opHas(Value val, Value key) {
 }
 
 CompletionOr<Value> opLen(Value val) {
-    if (isString(val)) {
-        return Ok((Integer)try$(asString(val)).len());
+    if (auto str = val.is<Str>()) {
+        return Ok((Integer)str->len());
     } else {
         auto obj = try$(asObject(val));
         return obj->len();
     }
 }
 
-CompletionOr<Value> opCall(Value val, Reference params) {
+CompletionOr<Value> opCall(Value val, Args args) {
     auto obj = try$(asObject(val));
-    auto res = obj->call(params);
-    if (res)
-        return res;
-    Completion completion = res.none();
-    if (completion.type == Completion::EXCEPTION)
-        return res;
-    return Ok(completion.value);
+    return obj->call(args);
 }
 
 CompletionOr<Value> opNeg(Value v) {
@@ -417,13 +419,18 @@ CompletionOr<Value> opNeg(Value v) {
     });
 }
 
+static CompletionOr<Value> _stringValue(Value v) {
+    if (isString(v))
+        return Ok(v);
+    return Ok(try$(asString(v)));
+}
+
 CompletionOr<Value> opAdd(Value lhs, Value rhs) {
     if (isString(lhs) or isString(rhs)) {
         return Ok(
-            Io::format(
-                "{}{}",
-                try$(asString(lhs)),
-                try$(asString(rhs))
+            StringBox::concat(
+                try$(_stringValue(lhs)),
+                try$(_stringValue(rhs))
             )
         );
     }
@@ -544,6 +551,8 @@ CompletionOr<Value> opBinOr(Value lhs, Value rhs) {
 
 template <typename T, typename... Args>
 CompletionOr<Reference> opNew(Args&&... args) {
+    if (auto* arena = Arena::current())
+        return Ok(arena->make<T>(std::forward<Args>(args)...));
     return Ok(makeRc<T>(std::forward<Args>(args)...));
 }
 
@@ -561,11 +570,23 @@ export CompletionOr<Value> opEval(Value v, Reference env) {
     });
 }
 
+// Truth of a condition, expressions that can decide it without building
+// their value do so.
+export CompletionOr<Boolean> opTest(Value v, Reference env) {
+    if (auto o = v.is<Reference>()) {
+        if (auto res = try$((*o)->test(env)))
+            return Ok(res.unwrap());
+    }
+    return asBoolean(try$(opEval(v, env)));
+}
+
 } // namespace Luna
 
 template <>
 struct Karm::Io::Formatter<Luna::Value> {
     Res<> format(TextWriter& writer, Luna::Value const& val) {
+        if (auto str = val.is<Str>())
+            return writer.writeStr(*str);
         auto res = Luna::asString(val);
         if (not res)
             return Error::other("exception occurred");
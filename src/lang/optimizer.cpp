@@ -0,0 +1,77 @@
+module;
+
+#include <karm/macros>
+
+export module Luna:optimizer;
+
+import :base;
+import :objects;
+
+namespace Luna {
+
+// MARK: Optimizer -------------------------------------------------------------
+
+// Rewrites a parsed program before it is resolved. Pure expressions whose
+// operands are all constants are folded by evaluating them once, so they
+// follow the exact semantics of the evaluators. Branches that can't be taken
+// and statements without effects are dropped. An expression that throws is
+// left in place so that it still throws at runtime.
+export struct Optimizer {
+    Opt<Reference> _env = NONE;
+
+    static bool& enabled() {
+        static bool enabled = true;
+        return enabled;
+    }
+
+    static CompletionOr<Value> optimizeProgram(Value expr) {
+        if (not enabled())
+            return Ok(expr);
+        Optimizer o;
+        try$(o.optimize(expr));
+        return Ok(expr);
+    }
+
+    // Values that evaluate to themselves, symbols are variables.
+    static bool constant(Value const& value) {
+        auto kind = value.kind();
+        return kind != Value::SYMBOL and kind != Value::OBJECT;
+    }
+
+    CompletionOr<> optimize(Value& expr) {
+        auto obj = expr.is<Reference>();
+        if (not obj)
+            return Ok();
+        auto rewritten = try$((*obj)->optimize(*this));
+        if (rewritten)
+            expr = rewritten.take();
+        return Ok();
+    }
+
+    // Optimize the operands of a pure expression, then evaluate it if they
+    // all turned out to be constants.
+    template <typename... Operands>
+    CompletionOr<Opt<Value>> fold(Base& expr, Operands&... operands) {
+        for (auto* operand : {&operands...})
+            try$(optimize(*operand));
+        return evaluate(expr, operands...);
+    }
+
+    // Evaluate a pure expression whose operands are already optimized, if
+    // they are all constants.
+    template <typename... Operands>
+    CompletionOr<Opt<Value>> evaluate(Base& expr, Operands&... operands) {
+        if (not(constant(operands) and ...))
+            return Ok(NONE);
+
+        if (not _env)
+            _env = try$(Environment::create(NONE));
+
+        auto res = expr.eval(_env.unwrap());
+        if (not res or not constant(res.unwrap()))
+            return Ok(NONE);
+        return Ok(res.take());
+    }
+};
+
+} // namespace Luna
@@ -6,6 +6,7 @@ export module Luna:parser;
 
 import Karm.Diag;
 import Karm.Logger;
+import :arena;
 import :expr;
 
 namespace Luna {
@@ -34,7 +35,9 @@ export struct Token {
 
         IF,     // if
         ELSE,   // else
-        FOR,    // or
+        FOR,    // for
+        IN,     // in
+        MATCH,  // match
         WHILE,  // while
         TRY,    // try
         CATCH,  // catch
@@ -67,6 +70,7 @@ export struct Token {
         COMMA,     // ,
         HASH,      // #
         DOT,       // .
+        DOTDOT,    // ..
         COLON,     // :
         SEMICOLON, // ;
 
@@ -142,6 +146,10 @@ export struct Token {
             return "'else'"s;
         case FOR:
             return "'for'"s;
+        case IN:
+            return "'in'"s;
+        case MATCH:
+            return "'match'"s;
         case WHILE:
             return "'while'"s;
         case TRY:
@@ -194,6 +202,8 @@ export struct Token {
             return "'#'"s;
         case DOT:
             return "'.'"s;
+        case DOTDOT:
+            return "'..'"s;
         case COLON:
             return "':'"s;
         case SEMICOLON:
@@ -290,6 +300,8 @@ static Map<Str, Token::Kind> const KEYWORDS = {
     {"if"s, Token::IF},
     {"else"s, Token::ELSE},
     {"for"s, Token::FOR},
+    {"in"s, Token::IN},
+    {"match"s, Token::MATCH},
     {"while"s, Token::WHILE},
     {"try"s, Token::TRY},
     {"catch"s, Token::CATCH},
@@ -407,6 +419,11 @@ export CompletionOr<Vec<Token>> lex(Io::SScan& s, DiagCollector& diag) {
             tokens.emplaceBack(Token::GTEQ, s.end(), Io::LocSpan{startLoc, endLoc});
             continue;
         }
+        if (s.skip("..")) {
+            Io::Loc endLoc = s.loc();
+            tokens.emplaceBack(Token::DOTDOT, s.end(), Io::LocSpan{startLoc, endLoc});
+            continue;
+        }
 
 // Single-character tokens
 #define SINGLE_CHAR_TOKEN(ch, kind)                                              \
@@ -477,9 +494,75 @@ enum struct Prec {
     HIGHEST
 };
 
-static CompletionOr<Value> _intoAssign(DiagCollector& diag, Value lhs, Value rhs, Io::LocSpan span) {
+// MARK: Scopes ----------------------------------------------------------------
+
+// A block needs no environment of its own unless a name gets bound in it
+// while it runs, by a declaration or by assigning a name that isn't
+// declared yet. Only the statements of a block count as declared for the
+// rest of it: anything else might not have run by the time we get there.
+
+struct Parser {
+    struct Scope {
+        Vec<Value> names;
+        usize declarations;
+    };
+
+    DiagCollector& diag;
+
+    // Statements parsed so far that may bind a name in the innermost
+    // environment, and the scopes around it, innermost last.
+    usize declarations = 0;
+    Vec<Scope> scopes = {};
+
+    Completion fatal(Diag::Diagnostic d) {
+        return diag.fatal(std::move(d));
+    }
+
+    Completion expected(Str expected, Token const& got) {
+        return diag.expected(expected, got);
+    }
+
+    Completion unexpected(Token const& tok, Str context = ""s) {
+        return diag.unexpected(tok, context);
+    }
+};
+
+static void _enter(Parser& p, Vec<Value> names = {}) {
+    p.scopes.pushBack({std::move(names), p.declarations});
+}
+
+// Leave a scope with an environment of its own, its bindings don't count
+// for the enclosing one. Returns whether anything got bound in it.
+static bool _leave(Parser& p) {
+    auto declarations = p.scopes[p.scopes.len() - 1].declarations;
+    p.scopes.popBack();
+    return std::exchange(p.declarations, declarations) != declarations;
+}
+
+static bool _declared(Parser& p, Value name) {
+    for (auto& scope : p.scopes) {
+        for (auto& n : scope.names) {
+            if (n == name)
+                return true;
+        }
+    }
+    return false;
+}
+
+// Remember the name a statement of the current scope declares.
+static void _statement(Parser& p, Value stmt) {
+    auto obj = stmt.is<Reference>();
+    if (not obj or not p.scopes.len())
+        return;
+    if (auto* decl = (*obj).is<DeclExpr>())
+        p.scopes[p.scopes.len() - 1].names.pushBack(decl->_key);
+}
+
+static CompletionOr<Value> _intoAssign(Parser& p, Value lhs, Value rhs, Io::LocSpan span) {
     if (isSymbol(lhs)) {
-        return opNew<SetEnvExpr>(try$(opNew<QuoteExpr>(lhs)), rhs);
+        if (not _declared(p, lhs))
+            p.declarations++;
+        return opNew<SetEnvExpr>(lhs, rhs);
     }
 
     if (isObject(lhs)) {
@@ -489,20 +572,20 @@ static CompletionOr<Value> _intoAssign(DiagCollector& diag, Value lhs, Value rhs
         }
     }
 
-    return diag.fatal(
+    return p.fatal(
         Diag::Diagnostic::error("E0200", "expression is not assignable")
             .withPrimaryLabel(span, "cannot assign to this expression")
             .withNote("only variables and object properties can be assigned to")
     );
 }
 
-static CompletionOr<Symbol> _parseIdent(Cursor<Token>& c, DiagCollector& diag) {
+static CompletionOr<Symbol> _parseIdent(Cursor<Token>& c, Parser& p) {
     if (*c == Token::IDENT)
         return Ok(Symbol::from(c.next().text));
-    return diag.expected("identifier"s, *c);
+    return p.expected("identifier"s, *c);
 }
 
-static CompletionOr<Value> _parseValue(Cursor<Token>& c, DiagCollector& diag) {
+static CompletionOr<Value> _parseValue(Cursor<Token>& c, Parser& p) {
     if (c.skip(Token::NONE)) {
         return Ok(NONE);
     } else if (c.skip(Token::TRUE)) {
@@ -515,11 +598,11 @@ static CompletionOr<Value> _parseValue(Cursor<Token>& c, DiagCollector& diag) {
         return Ok(Io::atof(c.next().text).take());
     } else if (c.skip(Token::LSTR)) {
         if (*c != Token::SPAN)
-            return diag.expected("string content"s, *c);
-        String str = c.next().text;
+            return p.expected("string content"s, *c);
+        auto str = StringBox::intern(c.next().text);
 
         if (not c.skip(Token::RSTR)) {
-            return diag.fatal(
+            return p.fatal(
                 Diag::Diagnostic::error("E0102", "unterminated string literal")
                     .withPrimaryLabel(c->span, "expected closing '\"'")
                     .withHelp("add a closing '\"' to terminate the string")
@@ -528,66 +611,178 @@ static CompletionOr<Value> _parseValue(Cursor<Token>& c, DiagCollector& diag) {
 
         return Ok(str);
     } else {
-        return diag.expected("value"s, *c);
+        return p.expected("value"s, *c);
     }
 }
 
-static CompletionOr<Value> _parseIdentOrValue(Cursor<Token>& c, DiagCollector& diag) {
+static CompletionOr<Value> _parseIdentOrValue(Cursor<Token>& c, Parser& p) {
     if (*c == Token::IDENT)
-        return _parseIdent(c, diag);
-    return _parseValue(c, diag);
+        return _parseIdent(c, p);
+    return _parseValue(c, p);
 }
 
-static CompletionOr<Value> _parseExpr(Cursor<Token>& c, DiagCollector& diag, Prec prec);
+static CompletionOr<Value> _parseExpr(Cursor<Token>& c, Parser& p, Prec prec);
 
-static CompletionOr<Value> _parseVar(Cursor<Token>& c, DiagCollector& diag) {
-    auto varToken = c.next(); // consume 'var'
+static CompletionOr<Value> _parseVar(Cursor<Token>& c, Parser& p) {
+    auto varToken = c.next(); // consume 'var' or 'const'
+    bool constant = varToken == Token::CONST;
 
-    auto ident = try$(_parseIdent(c, diag));
+    auto ident = try$(_parseIdent(c, p));
 
     if (not c.skip(Token::ASSIGN)) {
-        return diag.fatal(
-            Diag::Diagnostic::error("E0103", "expected '=' in variable declaration")
+        return p.fatal(
+            Diag::Diagnostic::error("E0103", constant ? "expected '=' in constant declaration" : "expected '=' in variable declaration")
                 .withPrimaryLabel(c->span, "expected '=' here")
-                .withSecondaryLabel(varToken.span, "variable declared here")
+                .withSecondaryLabel(varToken.span, constant ? "constant declared here" : "variable declared here")
                 .withHelp("add '=' followed by an initial value")
         );
     }
-    auto expr = try$(_parseExpr(c, diag, Prec::LOWEST));
+    auto expr = try$(_parseExpr(c, p, Prec::LOWEST));
 
-    return opNew<DeclExpr>(ident, expr);
+    p.declarations++;
+    return opNew<DeclExpr>(ident, expr, constant);
 }
 
-static CompletionOr<Value> _parseIf(Cursor<Token>& c, DiagCollector& diag) {
+// A constant is a statement of a block or of the program, so that it is
+// assigned at most once by every environment created for its scope.
+static CompletionOr<Value> _parseStatement(Cursor<Token>& c, Parser& p) {
+    if (*c == Token::CONST)
+        return _parseVar(c, p);
+    return _parseExpr(c, p, Prec::LOWEST);
+}
+
+static CompletionOr<Value> _parseIf(Cursor<Token>& c, Parser& p) {
     c.next(); // consume 'if'
 
-    auto cond = try$(_parseExpr(c, diag, Prec::LOWEST));
+    auto cond = try$(_parseExpr(c, p, Prec::LOWEST));
 
-    auto then = try$(_parseExpr(c, diag, Prec::LOWEST));
+    auto then = try$(_parseExpr(c, p, Prec::LOWEST));
     if (c.skip(Token::ELSE)) {
-        auto else_ = try$(_parseExpr(c, diag, Prec::LOWEST));
+        auto else_ = try$(_parseExpr(c, p, Prec::LOWEST));
         return opNew<IfExpr>(cond, then, else_);
     }
 
     return opNew<IfExpr>(cond, then, NONE);
 }
 
-static CompletionOr<Value> _parseWhile(Cursor<Token>& c, DiagCollector& diag) {
+static CompletionOr<Value> _parseWhile(Cursor<Token>& c, Parser& p) {
     c.next(); // consume 'while'
 
-    auto cond = try$(_parseExpr(c, diag, Prec::LOWEST));
-    auto body = try$(_parseExpr(c, diag, Prec::LOWEST));
+    auto cond = try$(_parseExpr(c, p, Prec::LOWEST));
+    auto body = try$(_parseExpr(c, p, Prec::LOWEST));
 
     return opNew<WhileExpr>(cond, body);
 }
 
-static CompletionOr<Value> _parseTry(Cursor<Token>& c, DiagCollector& diag) {
+static CompletionOr<Value> _parseFor(Cursor<Token>& c, Parser& p) {
+    auto forToken = c.next(); // consume 'for'
+
+    if (not c.skip(Token::LPAREN))
+        return p.expected("'('"s, *c);
+    auto ident = try$(_parseIdent(c, p));
+
+    if (not c.skip(Token::IN)) {
+        return p.fatal(
+            Diag::Diagnostic::error("E0113", "expected 'in' in for loop")
+                .withPrimaryLabel(c->span, "expected 'in' here")
+                .withSecondaryLabel(forToken.span, "for loop started here")
+                .withHelp("for loop syntax: for (i in 0..n) { ... } or for (x in list) { ... }")
+        );
+    }
+    auto start = try$(_parseExpr(c, p, Prec::LOWEST));
+
+    Opt<Value> end = NONE;
+    if (c.skip(Token::DOTDOT))
+        end = try$(_parseExpr(c, p, Prec::LOWEST));
+
+    if (not c.skip(Token::RPAREN))
+        return p.expected("')'"s, *c);
+    _enter(p, {ident});
+    auto body = try$(_parseExpr(c, p, Prec::LOWEST));
+    _leave(p);
+
+    return opNew<ForExpr>(ident, start, end, body);
+}
+
+static CompletionOr<MatchExpr::Pattern> _parsePattern(Cursor<Token>& c, Parser& p) {
+    using Pattern = MatchExpr::Pattern;
+
+    if (c.skip(Token::ELSE))
+        return Ok(Pattern{Pattern::ANY});
+
+    if (c.skip(Token::IS)) {
+        if (not c.skip(Token::HASH))
+            return p.expected("'#' and a type"s, *c);
+        return Ok(Pattern{Pattern::TYPE, try$(_parseIdent(c, p))});
+    }
+
+    if (c.skip(Token::HASH))
+        return Ok(Pattern{Pattern::LITERAL, try$(_parseIdent(c, p))});
+
+    if (c.skip(Token::MINUS)) {
+        if (*c != Token::INTEGER and *c != Token::NUMBER)
+            return p.expected("number"s, *c);
+        auto value = try$(_parseValue(c, p));
+        if (value.kind() == Value::INTEGER)
+            return Ok(Pattern{Pattern::LITERAL, -value.unwrap<Integer>()});
+        return Ok(Pattern{Pattern::LITERAL, -value.unwrap<Number>()});
+    }
+
+    return Ok(Pattern{Pattern::LITERAL, try$(_parseValue(c, p))});
+}
+
+static CompletionOr<Value> _parseMatch(Cursor<Token>& c, Parser& p) {
+    c.next(); // consume 'match'
+
+    if (not c.skip(Token::LPAREN))
+        return p.expected("'('"s, *c);
+    auto value = try$(_parseExpr(c, p, Prec::LOWEST));
+    if (not c.skip(Token::RPAREN))
+        return p.expected("')'"s, *c);
+
+    auto openBrace = *c;
+    if (not c.skip(Token::LBRACE))
+        return p.expected("'{'"s, *c);
+
+    Vec<MatchExpr::Arm> arms;
+    do {
+        if (*c == Token::RBRACE)
+            break;
+
+        Vec<MatchExpr::Pattern> patterns;
+        do {
+            patterns.pushBack(try$(_parsePattern(c, p)));
+        } while (c.skip(Token::PIPE));
+
+        if (not c.skip(Token::COLON)) {
+            return p.fatal(
+                Diag::Diagnostic::error("E0115", "expected ':' after match pattern")
+                    .withPrimaryLabel(c->span, "expected ':' here")
+                    .withHelp("match arm syntax: <pattern>: <expr>")
+            );
+        }
+        auto body = try$(_parseExpr(c, p, Prec::LOWEST));
+        arms.pushBack({patterns, body});
+    } while (c.skip(Token::COMMA));
+
+    if (c.skip(Token::RBRACE))
+        return opNew<MatchExpr>(value, arms);
+
+    return p.fatal(
+        Diag::Diagnostic::error("E0116", "unclosed match")
+            .withPrimaryLabel(c->span, "expected '}' or ',' here")
+            .withSecondaryLabel(openBrace.span, "match started here")
+            .withHelp("separate arms with ',' and close the match with '}'")
+    );
+}
+
+static CompletionOr<Value> _parseTry(Cursor<Token>& c, Parser& p) {
     auto tryToken = c.next(); // consume 'try'
 
-    auto try_ = try$(_parseExpr(c, diag, Prec::LOWEST));
+    auto try_ = try$(_parseExpr(c, p, Prec::LOWEST));
 
     if (not c.skip(Token::CATCH)) {
-        return diag.fatal(
+        return p.fatal(
             Diag::Diagnostic::error("E0104", "expected 'catch' after try block")
                 .withPrimaryLabel(c->span, "expected 'catch' here")
                 .withSecondaryLabel(tryToken.span, "try block started here")
@@ -595,29 +790,31 @@ static CompletionOr<Value> _parseTry(Cursor<Token>& c, DiagCollector& diag) {
         );
     }
     if (not c.skip(Token::LPAREN)) {
-        return diag.expected("'('"s, *c);
+        return p.expected("'('"s, *c);
     }
-    auto ident = try$(_parseIdent(c, diag));
+    auto ident = try$(_parseIdent(c, p));
 
     if (not c.skip(Token::RPAREN)) {
-        return diag.expected("')'"s, *c);
+        return p.expected("')'"s, *c);
     }
-    auto catch_ = try$(_parseExpr(c, diag, Prec::LOWEST));
+    _enter(p, {ident});
+    auto catch_ = try$(_parseExpr(c, p, Prec::LOWEST));
+    _leave(p);
 
     return opNew<TryExpr>(try_, ident, catch_);
 }
 
-static CompletionOr<Value> _parseAssert(Cursor<Token>& c, DiagCollector& diag) {
+static CompletionOr<Value> _parseAssert(Cursor<Token>& c, Parser& p) {
     c.next(); // consume 'assert'
-    auto expr = try$(_parseExpr(c, diag, Prec::LOWEST));
+    auto expr = try$(_parseExpr(c, p, Prec::LOWEST));
     return opNew<AssertExpr>(expr);
 }
 
-static CompletionOr<Value> _parseFunc(Cursor<Token>& c, DiagCollector& diag) {
+static CompletionOr<Value> _parseFunc(Cursor<Token>& c, Parser& p) {
     auto fnToken = c.next(); // consume 'fn'
 
     if (not c.skip(Token::LPAREN)) {
-        return diag.fatal(
+        return p.fatal(
             Diag::Diagnostic::error("E0105", "expected '(' after 'fn'")
                 .withPrimaryLabel(c->span, "expected '(' here")
                 .withSecondaryLabel(fnToken.span, "function keyword here")
@@ -628,30 +825,35 @@ static CompletionOr<Value> _parseFunc(Cursor<Token>& c, DiagCollector& diag) {
     Vec<ParamExpr> sig;
     if (not c.skip(Token::RPAREN)) {
         do {
-            auto key = try$(_parseIdent(c, diag));
+            auto key = try$(_parseIdent(c, p));
 
             Opt<Value> value;
             if (c.skip(Token::COLON)) {
-                value = try$(_parseExpr(c, diag, Prec::LOWEST));
+                value = try$(_parseExpr(c, p, Prec::LOWEST));
             }
 
             sig.pushBack({key, value});
         } while (c.skip(Token::COMMA));
 
         if (not c.skip(Token::RPAREN)) {
-            return diag.expected("')'"s, *c);
+            return p.expected("')'"s, *c);
         }
     }
-    auto code = try$(_parseExpr(c, diag, Prec::LOWEST));
+    Vec<Value> params;
+    for (auto& param : sig)
+        params.pushBack(param.key);
+    _enter(p, params);
+    auto code = try$(_parseExpr(c, p, Prec::LOWEST));
+    _leave(p);
 
     return opNew<FuncExpr>(sig, code);
 }
 
-static CompletionOr<Value> _parseParent(Cursor<Token>& c, DiagCollector& diag) {
+static CompletionOr<Value> _parseParent(Cursor<Token>& c, Parser& p) {
     auto openParen = c.next(); // consume '('
-    auto expr = try$(_parseExpr(c, diag, Prec::LOWEST));
+    auto expr = try$(_parseExpr(c, p, Prec::LOWEST));
     if (not c.skip(Token::RPAREN)) {
-        return diag.fatal(
+        return p.fatal(
             Diag::Diagnostic::error("E0106", "unclosed parenthesis")
                 .withPrimaryLabel(c->span, "expected ')' here")
                 .withSecondaryLabel(openParen.span, "opening '(' here")
@@ -676,7 +878,7 @@ static bool _isTableHead(Cursor<Token> c) {
     return true;
 }
 
-static CompletionOr<Value> _parseTable(Cursor<Token>& c, DiagCollector& diag) {
+static CompletionOr<Value> _parseTable(Cursor<Token>& c, Parser& p) {
     auto openBrace = c.next(); // consume '{'
 
     if (c.skip(Token::RBRACE))
@@ -684,46 +886,49 @@ static CompletionOr<Value> _parseTable(Cursor<Token>& c, DiagCollector& diag) {
 
     Vec<Tuple<Value, Value>> exprs;
     do {
-        auto key = try$(_parseIdentOrValue(c, diag));
+        auto key = try$(_parseIdentOrValue(c, p));
         if (not c.skip(Token::COLON)) {
-            return diag.fatal(
+            return p.fatal(
                 Diag::Diagnostic::error("E0107", "expected ':' in table entry")
                     .withPrimaryLabel(c->span, "expected ':' here")
                     .withHelp("table syntax: { key: value, ... }")
             );
         }
-        auto value = try$(_parseExpr(c, diag, Prec::LOWEST));
+        auto value = try$(_parseExpr(c, p, Prec::LOWEST));
         exprs.pushBack({key, value});
     } while (c.skip(Token::COMMA));
 
     if (c.skip(Token::RBRACE))
         return opNew<TableExpr>(exprs);
 
-    return diag.fatal(
+    return p.fatal(
         Diag::Diagnostic::error("E0108", "unclosed table")
             .withPrimaryLabel(c->span, "expected '}' here")
             .withSecondaryLabel(openBrace.span, "table started here")
     );
 }
 
-static CompletionOr<Value> _parseBlock(Cursor<Token>& c, DiagCollector& diag) {
+static CompletionOr<Value> _parseBlock(Cursor<Token>& c, Parser& p) {
     auto openBrace = c.next(); // consume '{'
 
     if (c.skip(Token::RBRACE))
-        return opNew<BlockExpr>();
+        return opNew<BlockExpr>(Vec<Value>{}, false);
 
     Vec<Value> exprs;
+    _enter(p);
     do {
         if (*c == Token::RBRACE)
             break;
 
-        exprs.pushBack(try$(_parseExpr(c, diag, Prec::LOWEST)));
+        exprs.pushBack(try$(_parseStatement(c, p)));
+        _statement(p, exprs[exprs.len() - 1]);
     } while (c.skip(Token::SEMICOLON));
+    bool scoped = _leave(p);
 
     if (c.skip(Token::RBRACE))
-        return opNew<BlockExpr>(exprs);
+        return opNew<BlockExpr>(exprs, scoped);
 
-    return diag.fatal(
+    return p.fatal(
         Diag::Diagnostic::error("E0109", "unclosed block")
             .withPrimaryLabel(c->span, "expected '}' or ';' here")
             .withSecondaryLabel(openBrace.span, "block started here")
@@ -731,7 +936,7 @@ static CompletionOr<Value> _parseBlock(Cursor<Token>& c, DiagCollector& diag) {
     );
 }
 
-static CompletionOr<Value> _parseList(Cursor<Token>& c, DiagCollector& diag) {
+static CompletionOr<Value> _parseList(Cursor<Token>& c, Parser& p) {
     auto openBracket = c.next(); // consume '['
 
     if (c.skip(Token::RBRACKET))
@@ -739,103 +944,116 @@ static CompletionOr<Value> _parseList(Cursor<Token>& c, DiagCollector& diag) {
 
     Vec<Value> exprs;
     do {
-        exprs.pushBack(try$(_parseExpr(c, diag, Prec::LOWEST)));
+        exprs.pushBack(try$(_parseExpr(c, p, Prec::LOWEST)));
     } while (c.skip(Token::COMMA));
 
     if (c.skip(Token::RBRACKET))
         return opNew<ListExpr>(exprs);
 
-    return diag.fatal(
+    return p.fatal(
         Diag::Diagnostic::error("E0110", "unclosed list")
             .withPrimaryLabel(c->span, "expected ']' or ',' here")
             .withSecondaryLabel(openBracket.span, "list started here")
     );
 }
 
-static CompletionOr<Value> _parsePrefix(Cursor<Token>& c, DiagCollector& diag) {
+static CompletionOr<Value> _parsePrefix(Cursor<Token>& c, Parser& p) {
     auto t = *c;
     switch (t.kind) {
     case Token::LPAREN:
-        return _parseParent(c, diag);
+        return _parseParent(c, p);
 
     case Token::LBRACE: {
         if (_isTableHead(c))
-            return _parseTable(c, diag);
-        return _parseBlock(c, diag);
+            return _parseTable(c, p);
+        return _parseBlock(c, p);
     }
 
     case Token::LBRACKET:
-        return _parseList(c, diag);
+        return _parseList(c, p);
 
     case Token::NOT: {
         c.next();
-        return opNew<NotExpr>(try$(_parseExpr(c, diag, Prec::UNARY)));
+        return opNew<NotExpr>(try$(_parseExpr(c, p, Prec::UNARY)));
     }
     case Token::MINUS: {
         c.next();
-        return opNew<NegExpr>(try$(_parseExpr(c, diag, Prec::UNARY)));
+        return opNew<NegExpr>(try$(_parseExpr(c, p, Prec::UNARY)));
     }
     case Token::HASH: {
         c.next();
-        return opNew<QuoteExpr>(try$(_parseExpr(c, diag, Prec::UNARY)));
+        return opNew<QuoteExpr>(try$(_parseExpr(c, p, Prec::UNARY)));
     }
 
     case Token::IDENT:
-        return _parseIdent(c, diag);
+        return _parseIdent(c, p);
 
     case Token::VAR:
-        return _parseVar(c, diag);
+        return _parseVar(c, p);
+
+    case Token::CONST:
+        return p.fatal(
+            Diag::Diagnostic::error("E0114", "constant declared outside of a block")
+                .withPrimaryLabel(c->span, "constant declared here")
+                .withHelp("wrap the declaration in '{' and '}'")
+        );
 
     case Token::RETURN: {
         c.next();
         if (*c == Token::SEMICOLON)
             return opNew<ReturnExpr>(NONE);
-        return opNew<ReturnExpr>(try$(_parseExpr(c, diag, Prec::LOWEST)));
+        return opNew<ReturnExpr>(try$(_parseExpr(c, p, Prec::LOWEST)));
     }
 
     case Token::CONTINUE: {
         c.next();
         if (*c == Token::SEMICOLON)
             return opNew<ContinueExpr>(NONE);
-        return opNew<ContinueExpr>(try$(_parseExpr(c, diag, Prec::LOWEST)));
+        return opNew<ContinueExpr>(try$(_parseExpr(c, p, Prec::LOWEST)));
     }
 
     case Token::BREAK: {
         c.next();
         if (*c == Token::SEMICOLON)
             return opNew<BreakExpr>(NONE);
-        return opNew<BreakExpr>(try$(_parseExpr(c, diag, Prec::LOWEST)));
+        return opNew<BreakExpr>(try$(_parseExpr(c, p, Prec::LOWEST)));
     }
 
     case Token::THROW: {
         c.next();
         if (*c == Token::SEMICOLON)
             return opNew<ThrowExpr>(NONE);
-        return opNew<ThrowExpr>(try$(_parseExpr(c, diag, Prec::LOWEST)));
+        return opNew<ThrowExpr>(try$(_parseExpr(c, p, Prec::LOWEST)));
     }
 
     case Token::IF:
-        return _parseIf(c, diag);
+        return _parseIf(c, p);
 
     case Token::WHILE:
-        return _parseWhile(c, diag);
+        return _parseWhile(c, p);
+
+    case Token::FOR:
+        return _parseFor(c, p);
+
+    case Token::MATCH:
+        return _parseMatch(c, p);
 
     case Token::TRY:
-        return _parseTry(c, diag);
+        return _parseTry(c, p);
 
     case Token::ASSERT:
-        return _parseAssert(c, diag);
+        return _parseAssert(c, p);
 
     case Token::FN:
-        return _parseFunc(c, diag);
+        return _parseFunc(c, p);
 
     case Token::TYPEOF: {
         c.next();
-        return opNew<TypeOfExpr>(try$(_parseExpr(c, diag, Prec::UNARY)));
+        return opNew<TypeOfExpr>(try$(_parseExpr(c, p, Prec::UNARY)));
     }
 
     default:
-        return _parseValue(c, diag);
+        return _parseValue(c, p);
     }
 }
 
@@ -874,7 +1092,7 @@ static Prec _peekPrec(Cursor<Token>& c) {
     }
 }
 
-static CompletionOr<Value> _parseCall(Cursor<Token>& c, DiagCollector& diag, Value func, Token openParen) {
+static CompletionOr<Value> _parseCall(Cursor<Token>& c, Parser& p, Value func, Token openParen) {
     // Note: The LPAREN token is already consumed by _parseInfix
 
     Vec<ArgExpr> args;
@@ -886,17 +1104,17 @@ static CompletionOr<Value> _parseCall(Cursor<Token>& c, DiagCollector& diag, Val
                 next.next();
 
                 if (next.skip(Token::COLON)) {
-                    key = try$(_parseIdent(c, diag));
+                    key = try$(_parseIdent(c, p));
                     c.next(); // skip colon
                 }
             }
 
-            auto expr = try$(_parseExpr(c, diag, Prec::LOWEST));
+            auto expr = try$(_parseExpr(c, p, Prec::LOWEST));
             args.pushBack(ArgExpr{key, expr});
         } while (c.skip(Token::COMMA));
 
         if (not c.skip(Token::RPAREN)) {
-            return diag.fatal(
+            return p.fatal(
                 Diag::Diagnostic::error("E0111", "unclosed function call")
                     .withPrimaryLabel(c->span, "expected ')' here")
                     .withSecondaryLabel(openParen.span, "opening '(' here")
@@ -907,10 +1125,10 @@ static CompletionOr<Value> _parseCall(Cursor<Token>& c, DiagCollector& diag, Val
     return opNew<CallExpr>(func, args);
 }
 
-static CompletionOr<Value> _parseIndex(Cursor<Token>& c, DiagCollector& diag, Value lhs, Token openBracket) {
-    auto rhs = try$(_parseExpr(c, diag, Prec::LOWEST));
+static CompletionOr<Value> _parseIndex(Cursor<Token>& c, Parser& p, Value lhs, Token openBracket) {
+    auto rhs = try$(_parseExpr(c, p, Prec::LOWEST));
     if (not c.skip(Token::RBRACKET)) {
-        return diag.fatal(
+        return p.fatal(
             Diag::Diagnostic::error("E0112", "unclosed index expression")
                 .withPrimaryLabel(c->span, "expected ']' here")
                 .withSecondaryLabel(openBracket.span, "opening '[' here")
@@ -919,61 +1137,61 @@ static CompletionOr<Value> _parseIndex(Cursor<Token>& c, DiagCollector& diag, Va
     return opNew<GetExpr>(lhs, rhs);
 }
 
-static CompletionOr<Value> _parseInfix(Cursor<Token>& c, DiagCollector& diag, Value lhs, Io::LocSpan lhsSpan) {
+static CompletionOr<Value> _parseInfix(Cursor<Token>& c, Parser& p, Value lhs, Io::LocSpan lhsSpan) {
     Token op = c.next();
     switch (op.kind) {
     case Token::ASSIGN:
-        return _intoAssign(diag, lhs, try$(_parseExpr(c, diag, Prec::ASSIGN)), lhsSpan);
+        return _intoAssign(p, lhs, try$(_parseExpr(c, p, Prec::ASSIGN)), lhsSpan);
 
     case Token::OR:
-        return opNew<OrExpr>(lhs, try$(_parseExpr(c, diag, Prec::OR)));
+        return opNew<OrExpr>(lhs, try$(_parseExpr(c, p, Prec::OR)));
     case Token::AND:
-        return opNew<AndExpr>(lhs, try$(_parseExpr(c, diag, Prec::AND)));
+        return opNew<AndExpr>(lhs, try$(_parseExpr(c, p, Prec::AND)));
 
     case Token::EQ:
-        return opNew<EqExpr>(lhs, try$(_parseExpr(c, diag, Prec::EQUALITY)));
+        return opNew<EqExpr>(lhs, try$(_parseExpr(c, p, Prec::EQUALITY)));
     case Token::NEQ:
-        return opNew<NEqExpr>(lhs, try$(_parseExpr(c, diag, Prec::EQUALITY)));
+        return opNew<NEqExpr>(lhs, try$(_parseExpr(c, p, Prec::EQUALITY)));
 
     case Token::LT:
-        return opNew<LtExpr>(lhs, try$(_parseExpr(c, diag, Prec::COMPARISON)));
+        return opNew<LtExpr>(lhs, try$(_parseExpr(c, p, Prec::COMPARISON)));
     case Token::LTEQ:
-        return opNew<LtEqExpr>(lhs, try$(_parseExpr(c, diag, Prec::COMPARISON)));
+        return opNew<LtEqExpr>(lhs, try$(_parseExpr(c, p, Prec::COMPARISON)));
     case Token::GT:
-        return opNew<GtExpr>(lhs, try$(_parseExpr(c, diag, Prec::COMPARISON)));
+        return opNew<GtExpr>(lhs, try$(_parseExpr(c, p, Prec::COMPARISON)));
     case Token::GTEQ:
-        return opNew<GtEqExpr>(lhs, try$(_parseExpr(c, diag, Prec::COMPARISON)));
+        return opNew<GtEqExpr>(lhs, try$(_parseExpr(c, p, Prec::COMPARISON)));
 
     case Token::PLUS:
-        return opNew<AddExpr>(lhs, try$(_parseExpr(c, diag, Prec::TERM)));
+        return opNew<AddExpr>(lhs, try$(_parseExpr(c, p, Prec::TERM)));
     case Token::MINUS:
-        return opNew<SubExpr>(lhs, try$(_parseExpr(c, diag, Prec::TERM)));
+        return opNew<SubExpr>(lhs, try$(_parseExpr(c, p, Prec::TERM)));
     case Token::STAR:
-        return opNew<MulExpr>(lhs, try$(_parseExpr(c, diag, Prec::FACTOR)));
+        return opNew<MulExpr>(lhs, try$(_parseExpr(c, p, Prec::FACTOR)));
     case Token::SLASH:
-        return opNew<DivExpr>(lhs, try$(_parseExpr(c, diag, Prec::FACTOR)));
+        return opNew<DivExpr>(lhs, try$(_parseExpr(c, p, Prec::FACTOR)));
     case Token::PERCENT:
-        return opNew<ModExpr>(lhs, try$(_parseExpr(c, diag, Prec::FACTOR)));
+        return opNew<ModExpr>(lhs, try$(_parseExpr(c, p, Prec::FACTOR)));
 
     case Token::DOT:
-        return opNew<GetExpr>(lhs, try$(opNew<QuoteExpr>(try$(_parseIdentOrValue(c, diag)))));
+        return opNew<GetExpr>(lhs, try$(opNew<QuoteExpr>(try$(_parseIdentOrValue(c, p)))));
     case Token::LPAREN:
-        return _parseCall(c, diag, lhs, op);
+        return _parseCall(c, p, lhs, op);
     case Token::LBRACKET:
-        return _parseIndex(c, diag, lhs, op);
+        return _parseIndex(c, p, lhs, op);
     case Token::IS:
-        return opNew<IsExpr>(lhs, try$(_parseExpr(c, diag, Prec::TYPE)));
+        return opNew<IsExpr>(lhs, try$(_parseExpr(c, p, Prec::TYPE)));
     case Token::AS:
-        return opNew<AsExpr>(lhs, try$(_parseExpr(c, diag, Prec::TYPE)));
+        return opNew<AsExpr>(lhs, try$(_parseExpr(c, p, Prec::TYPE)));
 
     default:
-        return diag.unexpected(op, "infix position"s);
+        return p.unexpected(op, "infix position"s);
     }
 }
 
-static CompletionOr<Value> _parseExpr(Cursor<Token>& c, DiagCollector& diag, Prec minPrec) {
+static CompletionOr<Value> _parseExpr(Cursor<Token>& c, Parser& p, Prec minPrec) {
     Io::LocSpan lhsSpan = c->span;
-    auto lhs = try$(_parsePrefix(c, diag));
+    auto lhs = try$(_parsePrefix(c, p));
     // Update lhsSpan to include the full prefix expression
     // The end is now the start of the current token (which is after the prefix)
     if (not c.ended()) {
@@ -984,23 +1202,61 @@ static CompletionOr<Value> _parseExpr(Cursor<Token>& c, DiagCollector& diag, Pre
         Prec nextPrec = _peekPrec(c);
         if (nextPrec <= minPrec)
             break;
-        lhs = try$(_parseInfix(c, diag, lhs, lhsSpan));
+        lhs = try$(_parseInfix(c, p, lhs, lhsSpan));
     }
     return Ok(lhs);
 }
 
-static CompletionOr<Value> _parseTopLevel(Cursor<Token>& c, DiagCollector& diag) {
+static CompletionOr<Value> _parseTopLevel(Cursor<Token>& c, Parser& p) {
     Vec<Value> exprs;
+    _enter(p);
     do {
         if (c.skip(Token::EOF))
             break;
-        exprs.pushBack(try$(_parseExpr(c, diag, Prec::LOWEST)));
+        exprs.pushBack(try$(_parseStatement(c, p)));
+        _statement(p, exprs[exprs.len() - 1]);
     } while (c.skip(Token::SEMICOLON) or *c != Token::EOF);
+    _leave(p);
 
     return opNew<BlockExpr>(exprs, false);
 }
 
-export CompletionOr<Value> parse(Str code, DiagCollector& diag) {
+// MARK: Program ---------------------------------------------------------------
+
+// The result of parsing a script, its nodes are allocated from an arena that
+// stays alive for as long as the program or any of its nodes does.
+export struct Program {
+    Arena* _arena;
+    Value body = NONE;
+
+    Program() : _arena(new Arena()) {}
+
+    Program(Program const& other) : _arena(other._arena), body(other.body) {
+        _arena->ref();
+    }
+
+    Program(Program&& other)
+        : _arena(std::exchange(other._arena, nullptr)), body(std::move(other.body)) {}
+
+    ~Program() {
+        // Nodes first, they still hold on to the arena
+        body = NONE;
+        if (_arena)
+            _arena->deref();
+    }
+
+    Program& operator=(Program other) {
+        std::swap(_arena, other._arena);
+        std::swap(body, other.body);
+        return *this;
+    }
+
+    Arena& arena() {
+        return *_arena;
+    }
+};
+
+export CompletionOr<Program> parse(Str code, DiagCollector& diag) {
     Io::SScan s{code};
     auto tokensRes = lex(s, diag);
     if (not tokensRes) {
@@ -1009,7 +1265,12 @@ export CompletionOr<Value> parse(Str code, DiagCollector& diag) {
 
     auto tokens = tokensRes.take();
     Cursor<Token> c{tokens};
-    return _parseTopLevel(c, diag);
+
+    Program program;
+    ArenaScope scope{program.arena()};
+    Parser p{diag};
+    program.body = try$(_parseTopLevel(c, p));
+    return Ok(std::move(program));
 }
 
 } // namespace Luna
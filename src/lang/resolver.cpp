@@ -0,0 +1,511 @@
+module;
+
+#include <karm/macros>
+
+export module Luna:resolver;
+
+import :base;
+import :ops;
+import :objects;
+import :optimizer;
+import :vm;
+
+namespace Luna {
+
+// MARK: Resolved Variables ----------------------------------------------------
+
+export struct LocalExpr : Base {
+    // <ident> bound to a slot of an enclosing scope
+
+    Value _name;
+    Binding _binding;
+
+    LocalExpr(Value name, Binding binding)
+        : _name(name), _binding(binding) {}
+
+    CompletionOr<Value> eval(Reference env) override {
+        return Ok(env.is<Environment>()->up(_binding.depth)->load(_binding.slot));
+    }
+
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        return c.load(_binding, dst);
+    }
+
+    CompletionOr<Value> string() override {
+        return Ok(Io::format("{}", _name));
+    }
+};
+
+export struct GlobalExpr : Base {
+    // <ident> not bound by any enclosing scope
+
+    GlobalCache _cache;
+    usize _depth;
+
+    GlobalExpr(Value name, usize depth)
+        : _cache{name}, _depth(depth) {}
+
+    CompletionOr<Value> eval(Reference env) override {
+        return _cache.load(*env.is<Environment>(), _depth);
+    }
+
+    CompletionOr<> compile(Compiler& c, u16 dst) override {
+        c.emit(Op::LOAD_GLOBAL, dst, try$(c.operand(_depth)), try$(c.global(_cache.name)));
+        return Ok();
+    }
+
+    CompletionOr<Value> string() override {
+        return Ok(Io::format("{}", _cache.name));
+    }
+};
+
+// MARK: Aggregates ------------------------------------------------------------
+
+// A table or list literal declared to a local of a function that only ever
+// reads and writes it through constant keys it defines. Nothing can observe
+// the object then, each of its fields gets a slot next to the variable and
+// the literal is never built.
+export struct Aggregate {
+    Rc<Layout> layout;
+    usize slot;
+    Vec<Value> keys; // One per element of the literal
+    Vec<Value> uses; // Keys read or written
+    Vec<usize> slots;
+    bool escapes = false;
+    bool replaced = false;
+
+    Opt<usize> _index(Value const& key) const {
+        for (usize i : urange::zeroTo(keys.len())) {
+            if (keys[i] == key)
+                return i;
+        }
+        return NONE;
+    }
+
+    // Missing keys throw or add a field, the object has to exist for that.
+    void replace() {
+        if (escapes)
+            return;
+        for (auto& key : uses) {
+            if (not _index(key))
+                return;
+        }
+        for (usize i : urange::zeroTo(keys.len())) {
+            auto first = _index(keys[i]).unwrap();
+            slots.pushBack(first < i ? slots[first] : layout->anonymous());
+        }
+        replaced = true;
+    }
+
+    // The slot of a field, seen from where the variable is bound.
+    Binding field(Binding const& variable, Value const& key) const {
+        return {variable.depth, slots[_index(key).unwrap()], variable.layout};
+    }
+};
+
+// MARK: Resolver --------------------------------------------------------------
+
+// Binds every identifier to the slot of the scope that declares it, the
+// environments built at runtime mirror the scopes seen here one for one.
+// Names that no scope declares are looked up in the root environment.
+//
+// A function frame only links to the root environment. Variables of outer
+// functions that its body uses are boxed into cells, copied into the
+// closure when it is created and into its frame when it is called.
+//
+// Constants are only assigned by their declaration. Once it has run, their
+// value is substituted for their uses when it is known, and closures copy
+// them instead of sharing a cell.
+//
+// Literals that never escape the frame that declares them are replaced by
+// their fields, see Aggregate.
+export struct Resolver {
+    struct Function {
+        Rc<Layout> layout;
+        Function* parent;
+        usize base; // index of the function scope in _scopes
+        Vec<Capture>* captures;
+        Vec<Tuple<Layout*, usize>> origins;
+        usize horizon = 0; // Constants declared before the function was created
+        Vec<Rc<Aggregate>> aggregates = {};
+    };
+
+    struct Constant {
+        Layout* layout; // nullptr for globals
+        usize slot;
+        Value name;
+        usize order;
+        Opt<Value> value = NONE;
+    };
+
+    // A constant copied into the frame of a closure, the copy holds the
+    // cell instead if another closure needed the constant boxed.
+    struct Copy {
+        Layout* from;
+        usize slot;
+        Layout* to;
+        usize target;
+    };
+
+    struct Scope {
+        Rc<Layout> layout;
+        Function* function;
+    };
+
+    struct Pending {
+        Vec<Scope> scopes;
+        Function* function;
+        Value* body;
+    };
+
+    Vec<Scope> _scopes;
+    Vec<Pending> _pending;
+    Vec<Rc<Function>> _functions;
+    Function* _current = nullptr;
+    Vec<Constant> _constants;
+    Vec<Copy> _copies;
+    Vec<Rc<Aggregate>> _aggregates; // Declared outside of any function
+    Map<Value, bool> _globals;      // Declared so far, true for constants
+    usize _order = 1;               // Number of the next constant, copies are numbered 0
+    bool _propagated = false;       // Some constant was substituted for its uses
+    bool _tail = false;             // The value of the expression is returned right away
+    usize _trys = 0;                // Enclosing try blocks in the current function
+
+    // Globals declared by earlier programs run in env are checked like the
+    // ones of this program, a REPL resolves every input on its own.
+    static CompletionOr<Value> resolveProgram(Value expr, Reference env) {
+        auto& root = *env.is<Environment>();
+        Resolver r;
+        for (auto const& [key, constant] : root._globals.iterItems()) {
+            r._globals.put(key, constant);
+            if (constant)
+                r._constants.pushBack({nullptr, 0, key, 0});
+        }
+        try$(r.resolve(expr));
+        try$(r._flush(0));
+        for (auto& copy : r._copies) {
+            if (copy.from->boxed(copy.slot))
+                copy.to->_kinds[copy.target] = Layout::UPVALUE;
+        }
+        r._replace(r._aggregates);
+        root._globals = std::move(r._globals);
+
+        // Every function is resolved by now, folding may drop any node
+        if (r._propagated)
+            expr = try$(Optimizer::optimizeProgram(expr));
+        return Ok(expr);
+    }
+
+    // MARK: Scopes
+
+    void push(Rc<Layout> layout) {
+        _scopes.pushBack({layout, _current});
+    }
+
+    void pop() {
+        _scopes.popBack();
+    }
+
+    usize _base() const {
+        return _current ? _current->base : 0;
+    }
+
+    // Globals live in the root environment and are declared at runtime.
+    Opt<Binding> declare(Value key) {
+        if (_scopes.len() == 0) {
+            if (not _globals.contains(key))
+                _globals.put(key, false);
+            return NONE;
+        }
+        auto& layout = _scopes[_scopes.len() - 1].layout;
+        return Binding{0, layout->add(key), layout};
+    }
+
+    Opt<Binding> lookup(Value key) {
+        for (usize depth : urange::zeroTo(_scopes.len())) {
+            auto index = _scopes.len() - 1 - depth;
+            auto& scope = _scopes[index];
+            auto slot = scope.layout->lookup(key);
+            if (not slot)
+                continue;
+
+            _escape(scope, slot.unwrap());
+            if (scope.function == _current)
+                return Binding{depth, slot.unwrap(), scope.layout};
+
+            usize horizon;
+            auto* c = _constant(key, horizon);
+            auto copy = c and c->order < horizon;
+            auto upvalue = _capture(*_current, key, index, slot.unwrap(), copy);
+            return Binding{_scopes.len() - 1 - _current->base, upvalue, _current->layout};
+        }
+        return NONE;
+    }
+
+    // Make the variable at scope index/slot available to fn as an upvalue,
+    // threading it through every function in between.
+    usize _capture(Function& fn, Value key, usize index, usize slot, bool copy) {
+        auto* layout = &_scopes[index].layout.unwrap();
+        for (usize i : urange::zeroTo(fn.origins.len())) {
+            auto& [l, s] = fn.origins[i];
+            if (l == layout and s == slot)
+                return (*fn.captures)[i].target;
+        }
+
+        Capture capture;
+        Copy from{layout, slot};
+        if (_scopes[index].function == fn.parent) {
+            if (not copy)
+                layout->box(slot);
+            capture.depth = fn.base - 1 - index;
+            capture.slot = slot;
+        } else {
+            capture.depth = fn.base - 1 - fn.parent->base;
+            capture.slot = _capture(*fn.parent, key, index, slot, copy);
+            from = {&fn.parent->layout.unwrap(), capture.slot};
+        }
+        capture.target = fn.layout->add(key, copy ? Layout::PLAIN : Layout::UPVALUE);
+
+        if (copy) {
+            _constants.pushBack({&fn.layout.unwrap(), capture.target, key, 0});
+            _copies.pushBack({from.from, from.slot, &fn.layout.unwrap(), capture.target});
+        }
+        fn.captures->pushBack(capture);
+        fn.origins.pushBack({layout, slot});
+        return capture.target;
+    }
+
+    // MARK: Constants
+
+    Constant* _find(Layout* layout, usize slot, Value key) {
+        for (auto& c : _constants) {
+            if (c.layout == layout and (layout ? c.slot == slot : c.name == key))
+                return &c;
+        }
+        return nullptr;
+    }
+
+    // The constant that key names from the current scope, if any. A function
+    // created before the declaration only sees it once the declaration ran,
+    // horizon is the first declaration that isn't known to have run.
+    Constant* _constant(Value key, usize& horizon) {
+        horizon = _order;
+        auto* fn = _current;
+        for (usize depth : urange::zeroTo(_scopes.len())) {
+            auto& scope = _scopes[_scopes.len() - 1 - depth];
+            for (; fn != scope.function; fn = fn->parent)
+                horizon = fn->horizon;
+
+            auto slot = scope.layout->lookup(key);
+            if (not slot or scope.layout->_kinds[slot.unwrap()] == Layout::UPVALUE)
+                continue;
+            return _find(&scope.layout.unwrap(), slot.unwrap(), key);
+        }
+        for (; fn; fn = fn->parent)
+            horizon = fn->horizon;
+        return _find(nullptr, 0, key);
+    }
+
+    CompletionOr<> assign(Value key) {
+        usize horizon;
+        if (_constant(key, horizon))
+            return Completion::exception(Value{Io::format("cannot assign to constant {}", key)});
+        return Ok();
+    }
+
+    // A constant shares its scope with no other declaration of its name.
+    CompletionOr<> redeclare(Value key, bool constant) {
+        Layout* layout = nullptr;
+        usize slot = 0;
+        if (_scopes.len()) {
+            layout = &_scopes[_scopes.len() - 1].layout.unwrap();
+            auto found = layout->lookup(key);
+            if (not found)
+                return Ok();
+            slot = found.unwrap();
+        } else if (not _globals.contains(key)) {
+            return Ok();
+        }
+        if (constant or _find(layout, slot, key))
+            return Completion::exception(Value{Io::format("{} is already declared", key)});
+        return Ok();
+    }
+
+    // Record a constant once its declaration is resolved. Its value is folded
+    // again with the constants it uses substituted, unless it created
+    // functions whose body isn't resolved yet.
+    CompletionOr<> constant(Value key, Opt<Binding> const& binding, Value& value, usize pending) {
+        Constant c{nullptr, 0, key, _order++};
+        if (binding) {
+            c.layout = &binding->layout.unwrap();
+            c.slot = binding->slot;
+        } else {
+            _globals.put(key, true);
+        }
+        if (Optimizer::enabled() and _pending.len() == pending) {
+            Optimizer o;
+            try$(o.optimize(value));
+            if (Optimizer::constant(value))
+                c.value = value;
+        }
+        _constants.pushBack(c);
+        return Ok();
+    }
+
+    // The value a name stands for, if it is a constant known to be set.
+    Opt<Value> _known(Value key) {
+        usize horizon;
+        auto* c = _constant(key, horizon);
+        if (not c or c->order >= horizon)
+            return NONE;
+        return c->value;
+    }
+
+    // MARK: Aggregates
+
+    Vec<Rc<Aggregate>>& _tracked(Function* fn) {
+        return fn ? fn->aggregates : _aggregates;
+    }
+
+    // The literal tracked for a slot, if any, through the side table of the
+    // layout of its scope.
+    Opt<Rc<Aggregate>> _aggregate(Scope const& scope, usize slot) {
+        auto& index = scope.layout->_aggregates;
+        if (slot >= index.len() or not index[slot])
+            return NONE;
+        return _tracked(scope.function)[index[slot].unwrap()];
+    }
+
+    void _escape(Scope const& scope, usize slot) {
+        if (auto a = _aggregate(scope, slot))
+            a.unwrap()->escapes = true;
+    }
+
+    // Once a function and the closures it creates are resolved, nothing
+    // else can use its variables.
+    void _replace(Vec<Rc<Aggregate>>& aggregates) {
+        for (auto& a : aggregates) {
+            a->replace();
+            a->layout->_aggregates[a->slot] = NONE;
+        }
+        aggregates.clear();
+    }
+
+    bool declared(Value key) const {
+        return _scopes.len() and _scopes[_scopes.len() - 1].layout->lookup(key);
+    }
+
+    // Track a literal with the given keys declared to a local. A variable
+    // declared again holds other values as well.
+    Opt<Rc<Aggregate>> aggregate(Binding const& binding, Opt<Vec<Value>> keys, bool fresh) {
+        auto& scope = _scopes[_scopes.len() - 1];
+        if (not fresh) {
+            _escape(scope, binding.slot);
+            return NONE;
+        }
+        if (not keys or not Optimizer::enabled())
+            return NONE;
+
+        auto a = makeRc<Aggregate>(binding.layout, binding.slot, keys.take());
+        auto& tracked = _tracked(_current);
+        auto& index = binding.layout->_aggregates;
+        if (index.len() <= binding.slot)
+            index.resize(binding.slot + 1, NONE);
+        index[binding.slot] = tracked.len();
+        tracked.pushBack(a);
+        return a;
+    }
+
+    // A constant key read or written on a tracked literal isn't a use of its
+    // variable, any other use lets the literal escape. Closures always see
+    // the object itself.
+    CompletionOr<Opt<Rc<Aggregate>>> field(Value& target, Opt<Value> key) {
+        auto sym = target.is<Symbol>();
+        if (key and sym and not _known(*sym)) {
+            for (usize depth : urange::zeroTo(_scopes.len())) {
+                auto& scope = _scopes[_scopes.len() - 1 - depth];
+                auto slot = scope.layout->lookup(*sym);
+                if (not slot)
+                    continue;
+                auto a = _aggregate(scope, slot.unwrap());
+                if (not a or scope.function != _current)
+                    break;
+                a.unwrap()->uses.pushBack(key.unwrap());
+                target = Reference{makeRc<LocalExpr>(*sym, Binding{depth, slot.unwrap(), scope.layout})};
+                return Ok(a);
+            }
+        }
+        try$(resolve(target));
+        return Ok(NONE);
+    }
+
+    usize globalDepth() const {
+        return _scopes.len() - _base();
+    }
+
+    // A function body only runs once the scopes around it are complete, so
+    // it is resolved after its enclosing function. This lets a closure see
+    // the variables declared after it, itself included.
+    void function(Rc<Layout> layout, Vec<Value> params, Value& body, Vec<Capture>& captures) {
+        for (auto& param : params)
+            layout->add(param);
+
+        auto fn = makeRc<Function>(layout, _current, _scopes.len(), &captures);
+        fn->horizon = _order;
+        _functions.pushBack(fn);
+        _pending.pushBack({_scopes, &fn.unwrap(), &body});
+    }
+
+    CompletionOr<> _flush(usize from) {
+        while (_pending.len() > from) {
+            auto pending = _pending.popBack();
+            auto outerScopes = std::move(_scopes);
+            auto* outer = _current;
+
+            _scopes = pending.scopes;
+            _current = pending.function;
+            push(_current->layout);
+            auto outerTrys = std::exchange(_trys, 0);
+
+            auto mark = _pending.len();
+            try$(resolve(*pending.body, true));
+            try$(_flush(mark));
+            _replace(_current->aggregates);
+
+            _scopes = std::move(outerScopes);
+            _current = outer;
+            _trys = outerTrys;
+        }
+        return Ok();
+    }
+
+    // MARK: Expressions
+
+    // A call in tail position replaces the frame of the function it is made
+    // from, unless a try block still has to catch what it throws.
+    CompletionOr<> resolve(Value& expr, bool tail = false) {
+        if (auto sym = expr.is<Symbol>()) {
+            if (auto value = _known(*sym)) {
+                expr = value.take();
+                _propagated = true;
+                return Ok();
+            }
+            if (auto binding = lookup(*sym))
+                expr = Reference{makeRc<LocalExpr>(*sym, binding.unwrap())};
+            else
+                expr = Reference{makeRc<GlobalExpr>(*sym, globalDepth())};
+            return Ok();
+        }
+
+        if (auto obj = expr.is<Reference>()) {
+            auto outer = std::exchange(_tail, tail and _current and _trys == 0);
+            auto res = (*obj)->resolve(*this);
+            _tail = outer;
+            return res;
+        }
+
+        return Ok();
+    }
+};
+
+} // namespace Luna
@@ -0,0 +1,2030 @@
+module;
+
+#include <karm/macros>
+
+export module Luna:vm;
+
+import :base;
+import :heap;
+import :ops;
+import :objects;
+
+namespace Luna {
+
+// MARK: Instructions ----------------------------------------------------------
+
+export enum struct Op : u8 {
+    NOP,
+
+    LOAD_CONST,   // a = consts[b]
+    LOAD_VAR,     // a = env[consts[b]]
+    SET_VAR,      // env[b] = c
+    DECL_VAR,     // decl env[consts[b]] = a
+    LOAD_LOCAL,   // a = env.up(b).slots[c]
+    STORE_LOCAL,  // env.up(b).slots[c] = a
+    LOAD_CELL,    // a = env.up(b).slots[c].value
+    STORE_CELL,   // env.up(b).slots[c].value = a
+    LOAD_GLOBAL,  // a = globals[c] from env.up(b)
+    STORE_GLOBAL, // globals[c] from env.up(b) = a
+    LOAD_ENV,     // a = env
+    MOVE,         // a = b
+
+    ENTER, // env = new env(env) with layouts[a]
+    LEAVE, // env = env.parent (a times)
+
+    EQ,      // a = b == c
+    NEQ,     // a = b != c
+    LT,      // a = b < c
+    LTEQ,    // a = b <= c
+    GT,      // a = b > c
+    GTEQ,    // a = b >= c
+    ADD,     // a = b + c
+    SUB,     // a = b - c
+    MUL,     // a = b * c
+    DIV,     // a = b / c
+    MOD,     // a = b % c
+    BIN_AND, // a = b & c
+    BIN_OR,  // a = b | c
+
+    NOT,     // a = not b
+    NEG,     // a = -b
+    BIN_NOT, // a = ~b
+    TYPEOF,  // a = typeof(b)
+    IS,      // a = b is c
+    AS,      // a = b as c
+
+    GET,       // a = b[c]
+    SET,       // a[b] = c
+    GET_FIELD, // a = b.key with property cache c
+    SET_FIELD, // a.key = b with property cache c
+    TABLE,     // a = {}
+    LIST,      // a = [b..b+c]
+    FUNC,      // a = fn protos[b] with defaults from c..
+    CALL,      // a = b(b+1..) with call shape c
+    TAILCALL,  // CALL that replaces the current frame, followed by a return
+
+    JMP,        // pc = target
+    JMP_IF,     // if a: pc = target
+    JMP_IF_NOT, // if not a: pc = target
+    FOR_RANGE,  // if a < a+1: a+2 = a, a += 1, otherwise pc = target
+    FOR_EACH,   // if a < len(a+1): a+2 = (a+1)[a], a += 1, otherwise pc = target
+    MATCH,      // pc = the case of switches[b] for a, if it has one
+    IF_EQ,      // if (a == b) != c: skip the jump that follows
+    IF_LT,      // if (a < b) != c: skip the jump that follows
+    IF_LTEQ,    // if (a <= b) != c: skip the jump that follows
+    IF_GT,      // if (a > b) != c: skip the jump that follows
+    IF_GTEQ,    // if (a >= b) != c: skip the jump that follows
+    IF_SAME,    // if (a is the object consts[b]) != c: skip the jump that follows
+    IF_MATCH,   // if (a matches the literal consts[b]) != c: skip the jump that follows
+    TRY,        // push handler (catch into a, resume at target)
+    END_TRY,    // pop handler
+    RETURN,     // return a
+    THROW,      // throw a
+    ASSERT,     // assert a, consts[b] is the message
+
+    // Pairs of the instructions above that often follow each other, fused
+    // into one, see Superinstructions.
+    ADD_CONST,  // a = b + consts[c]
+    SUB_CONST,  // a = b - consts[c]
+    CALL_FIELD, // CALL of the field calls[c].field of b, which it replaces
+
+    // Variants of the instructions above for the operand types they saw,
+    // see Quickening.
+    ADD_INT,
+    ADD_NUM,
+    ADD_STR,
+    SUB_INT,
+    SUB_NUM,
+    MUL_INT,
+    MUL_NUM,
+    IF_EQ_INT,
+    IF_LT_INT,
+    IF_LT_NUM,
+    IF_LTEQ_INT,
+    IF_LTEQ_NUM,
+    IF_GT_INT,
+    IF_GT_NUM,
+    IF_GTEQ_INT,
+    IF_GTEQ_NUM,
+    ADD_CONST_INT,
+    SUB_CONST_INT,
+
+    _LEN,
+};
+
+export struct Instr {
+    Op op;
+    u8 deopts = 0; // Times a quickened variant had to fall back
+    u16 a = 0;
+    u16 b = 0;
+    u16 c = 0;
+
+    // Jumps spread their 32-bit target over b and c.
+    u32 target() const {
+        return b | (u32)c << 16;
+    }
+
+    void target(u32 t) {
+        b = t & 0xffff;
+        c = t >> 16;
+    }
+};
+
+// How often each instruction is followed by each other one, counted while
+// profiling. The superinstructions were picked from these on the test corpus.
+export struct OpStats {
+    static constexpr usize LEN = static_cast<usize>(Op::_LEN);
+
+    static bool& profiling() {
+        static bool profiling = false;
+        return profiling;
+    }
+
+    static Vec<usize>& pairs() {
+        static Vec<usize> pairs = [] {
+            Vec<usize> pairs;
+            pairs.resize(LEN * LEN, 0);
+            return pairs;
+        }();
+        return pairs;
+    }
+
+    static void count(Op op, Op next) {
+        pairs()[static_cast<usize>(op) * LEN + static_cast<usize>(next)]++;
+    }
+};
+
+// MARK: Prototype -------------------------------------------------------------
+
+export struct Proto;
+
+// Remembers the last callee of a call site and, when it is a function
+// compiled to bytecode, its prototype.
+export struct CallCache : CacheStats {
+    static constexpr usize MAX_MISSES = 4;
+
+    Value _callee = NONE;
+    Base* _target = nullptr;
+    Func* _func = nullptr;
+    Proto* _body = nullptr;
+    ArgPlan _plan;
+
+    static Proto* body(Func* func);
+
+    bool hit(Value const& callee) {
+        auto obj = callee.is<Reference>();
+        if (obj and &(*obj).unwrap() == _target) {
+            hits++;
+            return true;
+        }
+        misses++;
+        return false;
+    }
+
+    // Returns false once the site has seen too many different callees.
+    bool remember(Value const& callee) {
+        if (megamorphic)
+            return false;
+
+        auto obj = callee.is<Reference>();
+        if (not obj)
+            return false;
+
+        if (entries and misses > MAX_MISSES) {
+            megamorphic = true;
+            _callee = NONE;
+            _target = nullptr;
+            return false;
+        }
+
+        _callee = callee;
+        _target = &(*obj).unwrap();
+        _func = (*obj).is<Func>();
+        _body = _func ? body(_func) : nullptr;
+        entries = 1;
+        return true;
+    }
+};
+
+export struct CallSite {
+    Vec<Opt<Value>> shape;
+    Rc<CallCache> cache;
+    bool keyed = false; // Some arguments are named
+    u16 field = 0;      // Property of the callee of a CALL_FIELD
+
+    // The arguments sit in the registers following the callee.
+    Args args(Value const* regs) const {
+        return {regs + 1, keyed ? shape.buf() : nullptr, shape.len(), &cache->_plan};
+    }
+};
+
+// The cases of a match on integers and symbols. Integers of a dense range
+// are looked up by their offset in it, symbols and sparse integers by the
+// bits of their value in a hash table whose seed is picked to spread them
+// without collisions, so that a case takes a single probe. Other values go
+// on to the tests that follow the MATCH.
+export struct Switch {
+    struct Slot {
+        u64 bits = 0; // Never the bits of an integer or a symbol
+        u32 target = 0;
+    };
+
+    Integer _low = 0;
+    Vec<u32> _dense;
+    u64 _seed = 1;
+    u8 _shift = 63;
+    Vec<Slot> _slots;
+    u32 _integers = 0; // Where integers that aren't cases go
+    u32 _symbols = 0;  // And symbols
+
+    // Cases are integers that fit inline and symbols, whose bits are the
+    // value itself.
+    static bool fits(Value const& value) {
+        return value.kind() == Value::SYMBOL or
+               (value.kind() == Value::INTEGER and not value._isHeap());
+    }
+
+    usize _hash(u64 bits) const {
+        return (bits * _seed) >> _shift;
+    }
+
+    // Where to go for value, next when it is neither an integer nor a symbol.
+    usize target(Value const& value, usize next) const {
+        auto kind = value.kind();
+        if (kind != Value::INTEGER and kind != Value::SYMBOL)
+            return next;
+        auto miss = kind == Value::INTEGER ? _integers : _symbols;
+        if (kind == Value::INTEGER and value._isHeap())
+            return miss;
+
+        if (kind == Value::INTEGER and _dense.len()) {
+            auto i = value.unwrap<Integer>();
+            if (i < _low or i - _low >= static_cast<Integer>(_dense.len()))
+                return miss;
+            return _dense[i - _low];
+        }
+
+        if (not _slots.len())
+            return miss;
+        auto mask = _slots.len() - 1;
+        for (auto i = _hash(value._bits);; i = (i + 1) & mask) {
+            auto const& slot = _slots[i];
+            if (slot.bits == value._bits)
+                return slot.target;
+            if (not slot.bits)
+                return miss;
+        }
+    }
+
+    // Places the cases that aren't in the dense table with the current
+    // seed, returns the probes it took beyond the first of each.
+    usize _place(Vec<Tuple<Value, u32>> const& cases) {
+        for (auto& slot : _slots)
+            slot = {};
+        auto mask = _slots.len() - 1;
+        usize probes = 0;
+        for (auto& [key, target] : cases) {
+            if (key.kind() == Value::INTEGER and _dense.len())
+                continue;
+            auto i = _hash(key._bits);
+            while (_slots[i].bits) {
+                i = (i + 1) & mask;
+                probes++;
+            }
+            _slots[i] = {key._bits, target};
+        }
+        return probes;
+    }
+
+    static Switch build(Vec<Tuple<Value, u32>> const& cases, u32 integers, u32 symbols) {
+        Switch sw;
+        sw._integers = integers;
+        sw._symbols = symbols;
+
+        // Integers go in a dense table when they fill half of their range
+        Integer low = 0, high = 0;
+        usize ints = 0;
+        for (auto& [key, target] : cases) {
+            if (key.kind() != Value::INTEGER)
+                continue;
+            auto i = key.unwrap<Integer>();
+            low = ints ? min(low, i) : i;
+            high = ints ? max(high, i) : i;
+            ints++;
+        }
+        usize hashed = cases.len();
+        if (ints and static_cast<usize>(high - low) < max(ints * 2, static_cast<usize>(16))) {
+            sw._low = low;
+            sw._dense.resize(static_cast<usize>(high - low) + 1, integers);
+            for (auto& [key, target] : cases) {
+                if (key.kind() == Value::INTEGER)
+                    sw._dense[key.unwrap<Integer>() - low] = target;
+            }
+            hashed -= ints;
+        }
+        if (not hashed)
+            return sw;
+
+        // At most half full, so that a miss soon finds an empty slot
+        usize bits = 1;
+        while ((static_cast<usize>(1) << bits) < hashed * 2)
+            bits++;
+
+        // Odd seeds from a splitmix sequence, a few per size, until one
+        // places every case at its first probe
+        u64 state = 0;
+        auto best = sw;
+        usize fewest = 0;
+        bool placed = false;
+        for (usize size = 0; size < 3; size++, bits++) {
+            sw._slots.resize(static_cast<usize>(1) << bits, {});
+            sw._shift = static_cast<u8>(64 - bits);
+            for (usize attempt = 0; attempt < 32; attempt++) {
+                state += 0x9e3779b97f4a7c15;
+                auto z = state;
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+                sw._seed = (z ^ (z >> 31)) | 1;
+
+                auto probes = sw._place(cases);
+                if (not placed or probes < fewest) {
+                    best = sw;
+                    fewest = probes;
+                    placed = true;
+                }
+                if (not fewest)
+                    return best;
+            }
+        }
+        return best;
+    }
+};
+
+// MARK: Native code -----------------------------------------------------------
+
+// What native code sees of the frame it runs in.
+export struct NativeFrame {
+    Value* regs;
+    Instr const* code;
+    usize pc; // Where the interpreter takes over
+    Proto* proto;
+    Environment* scope;
+    Completion error = Completion::exception(NONE);
+};
+
+// Native code for a prototype, it can be entered at any instruction.
+export struct Native {
+    virtual ~Native() = default;
+
+    // Runs from frame.pc until an instruction only the interpreter handles
+    // and leaves its index in frame.pc.
+    virtual CompletionOr<> run(NativeFrame& frame) = 0;
+
+    // Where the code of the instruction at pc starts.
+    virtual void const* entry(usize pc) const = 0;
+};
+
+// Hands prototypes that are called or loop often over to the JIT, which
+// installs itself here on the platforms it supports.
+export struct Tiering {
+    using Compile = Opt<Rc<Native>> (*)(Proto& proto);
+
+    Compile compile = nullptr;
+    u32 threshold = 1000; // Calls and loop iterations before compiling
+
+    static Tiering& instance() {
+        static Tiering tiering;
+        return tiering;
+    }
+};
+
+export struct ProtoParam {
+    Value key;
+    bool hasDefault = false;
+};
+
+export struct Proto : Base {
+    Vec<Instr> _code;
+    Vec<Value> _consts;
+    Vec<Rc<Proto>> _protos;
+    Vec<CallSite> _calls;
+    Vec<Switch> _switches;
+    Vec<Rc<PropertyCache>> _properties;
+    Vec<ProtoParam> _sig;
+    Vec<Rc<Layout>> _layouts;
+    Vec<GlobalCache> _globals;
+    Rc<Layout> _layout = Layout::shared();
+    Vec<Capture> _captures;
+    Opt<usize> _rootDepth = NONE;
+    u16 _regs = 0;
+    u32 _heat = 0;
+    Opt<Rc<Native>> _native = NONE;
+
+    CompletionOr<Value> eval(Reference env) override;
+
+    CompletionOr<Value> string() override {
+        return Ok(Io::format("<proto {} instrs>", _code.len()));
+    }
+};
+
+// MARK: Compiler --------------------------------------------------------------
+
+export struct Compiler {
+    struct Loop {
+        usize start;
+        Vec<usize> breaks;
+        u16 dst;
+        usize scopes;
+        usize trys;
+    };
+
+    Proto& _proto;
+    u16 _top = 0;
+    usize _scopes = 0;
+    usize _trys = 0;
+    Vec<Loop> _loops;
+
+    Compiler(Proto& proto)
+        : _proto(proto) {}
+
+    static CompletionOr<Rc<Proto>> compileProgram(Value expr) {
+        auto proto = makeRc<Proto>();
+        Compiler c{*proto};
+        auto dst = try$(c.alloc());
+        try$(c.expr(expr, dst));
+        c.emit(Op::RETURN, dst);
+        return Ok(proto);
+    }
+
+    // MARK: Registers
+
+    CompletionOr<u16> alloc() {
+        if (_top == 0xffff)
+            return Completion::exception("too many registers");
+        auto reg = _top++;
+        if (_top > _proto._regs)
+            _proto._regs = _top;
+        return Ok(reg);
+    }
+
+    u16 mark() const {
+        return _top;
+    }
+
+    void reset(u16 mark) {
+        _top = mark;
+    }
+
+    CompletionOr<u16> operand(usize value) {
+        if (value > 0xffff)
+            return Completion::exception("operand out of range");
+        return Ok(static_cast<u16>(value));
+    }
+
+    CompletionOr<u16> constant(Value value) {
+        for (usize i : urange::zeroTo(_proto._consts.len())) {
+            auto const& c = _proto._consts[i];
+            if (not isObject(c) and not isObject(value) and c == value)
+                return Ok(static_cast<u16>(i));
+        }
+        if (_proto._consts.len() == 0xffff)
+            return Completion::exception("too many constants");
+        _proto._consts.pushBack(value);
+        return Ok(static_cast<u16>(_proto._consts.len() - 1));
+    }
+
+    // MARK: Emit
+
+    usize here() const {
+        return _proto._code.len();
+    }
+
+    usize emit(Op op, u16 a = 0, u16 b = 0, u16 c = 0) {
+        _proto._code.pushBack({.op = op, .a = a, .b = b, .c = c});
+        return _proto._code.len() - 1;
+    }
+
+    void patch(usize at, usize target) {
+        _proto._code[at].target(target);
+    }
+
+    void patch(usize at) {
+        patch(at, here());
+    }
+
+    // MARK: Expressions
+
+    CompletionOr<> expr(Value expr, u16 dst) {
+        if (auto sym = expr.is<Symbol>()) {
+            emit(Op::LOAD_VAR, dst, try$(constant(*sym)));
+            return Ok();
+        }
+
+        if (auto obj = expr.is<Reference>())
+            return (*obj)->compile(*this, dst);
+
+        emit(Op::LOAD_CONST, dst, try$(constant(expr)));
+        return Ok();
+    }
+
+    CompletionOr<> load(Binding const& binding, u16 dst) {
+        auto op = binding.layout->boxed(binding.slot) ? Op::LOAD_CELL : Op::LOAD_LOCAL;
+        emit(op, dst, try$(operand(binding.depth)), try$(operand(binding.slot)));
+        return Ok();
+    }
+
+    CompletionOr<> store(Binding const& binding, u16 src) {
+        auto op = binding.layout->boxed(binding.slot) ? Op::STORE_CELL : Op::STORE_LOCAL;
+        emit(op, src, try$(operand(binding.depth)), try$(operand(binding.slot)));
+        return Ok();
+    }
+
+    CompletionOr<> unary(Op op, Value operand, u16 dst) {
+        auto m = mark();
+        auto reg = try$(alloc());
+        try$(expr(operand, reg));
+        emit(op, dst, reg);
+        reset(m);
+        return Ok();
+    }
+
+    CompletionOr<> binary(Op op, Value lhs, Value rhs, u16 dst) {
+        auto m = mark();
+        auto l = try$(alloc());
+        try$(expr(lhs, l));
+
+        // A constant operand is read right from the constants
+        if ((op == Op::ADD or op == Op::SUB) and not rhs.is<Symbol>() and not isObject(rhs)) {
+            emit(op == Op::ADD ? Op::ADD_CONST : Op::SUB_CONST, dst, l, try$(constant(rhs)));
+            reset(m);
+            return Ok();
+        }
+
+        auto r = try$(alloc());
+        try$(expr(rhs, r));
+        emit(op, dst, l, r);
+        reset(m);
+        return Ok();
+    }
+
+    CompletionOr<> none(u16 dst) {
+        emit(Op::LOAD_CONST, dst, try$(constant(NONE)));
+        return Ok();
+    }
+
+    CompletionOr<u16> global(Value name) {
+        for (usize i : urange::zeroTo(_proto._globals.len())) {
+            if (_proto._globals[i].name == name)
+                return Ok(static_cast<u16>(i));
+        }
+        if (_proto._globals.len() == 0xffff)
+            return Completion::exception("too many globals");
+        _proto._globals.pushBack({name});
+        return Ok(static_cast<u16>(_proto._globals.len() - 1));
+    }
+
+    CompletionOr<u16> function(Vec<ProtoParam> sig, Value body, Rc<Layout> layout, Vec<Capture> captures, Opt<usize> rootDepth) {
+        auto proto = makeRc<Proto>();
+        proto->_sig = sig;
+        proto->_layout = layout;
+        proto->_captures = captures;
+        proto->_rootDepth = rootDepth;
+
+        Compiler inner{*proto};
+        auto ret = try$(inner.alloc());
+        try$(inner.expr(body, ret));
+        inner.emit(Op::RETURN, ret);
+
+        if (_proto._protos.len() == 0xffff)
+            return Completion::exception("too many functions");
+        _proto._protos.pushBack(proto);
+        return Ok(static_cast<u16>(_proto._protos.len() - 1));
+    }
+
+    CompletionOr<u16> callSite(Vec<Opt<Value>> shape, Rc<CallCache> cache) {
+        if (_proto._calls.len() == 0xffff)
+            return Completion::exception("too many calls");
+        bool keyed = false;
+        for (auto& key : shape)
+            keyed = keyed or key;
+        _proto._calls.pushBack({shape, cache, keyed});
+        return Ok(static_cast<u16>(_proto._calls.len() - 1));
+    }
+
+    CompletionOr<u16> switch_() {
+        if (_proto._switches.len() == 0xffff)
+            return Completion::exception("too many matches");
+        _proto._switches.pushBack({});
+        return Ok(static_cast<u16>(_proto._switches.len() - 1));
+    }
+
+    CompletionOr<u16> property(Rc<PropertyCache> cache) {
+        if (_proto._properties.len() == 0xffff)
+            return Completion::exception("too many properties");
+        _proto._properties.pushBack(cache);
+        return Ok(static_cast<u16>(_proto._properties.len() - 1));
+    }
+
+    // Fuses the GET_FIELD at `at` into the call of the field that follows,
+    // when the instructions in between only load its arguments.
+    bool fuseField(usize at, u16 site) {
+        for (usize i = at + 1; i < here(); i++) {
+            auto op = _proto._code[i].op;
+            if (op != Op::LOAD_CONST and op != Op::LOAD_LOCAL and op != Op::LOAD_CELL)
+                return false;
+        }
+        _proto._calls[site].field = _proto._code[at].c;
+        _proto._code.removeAt(at);
+        return true;
+    }
+
+    // MARK: Conditions
+
+    // Emits the jumps, added to `jumps`, taken when the condition is `when`.
+    // Otherwise execution falls through.
+    CompletionOr<> branch(Value cond, bool when, Vec<usize>& jumps) {
+        if (auto obj = cond.is<Reference>()) {
+            if (try$((*obj)->branch(*this, when, jumps)))
+                return Ok();
+        } else if (not cond.is<Symbol>()) {
+            if (try$(asBoolean(cond)) == when)
+                jumps.pushBack(emit(Op::JMP));
+            return Ok();
+        }
+
+        auto m = mark();
+        auto reg = try$(alloc());
+        try$(expr(cond, reg));
+        jumps.pushBack(emit(when ? Op::JMP_IF : Op::JMP_IF_NOT, reg));
+        reset(m);
+        return Ok();
+    }
+
+    // Compares and jumps without storing the outcome of the comparison.
+    CompletionOr<> compare(Op op, Value lhs, Value rhs, bool when, Vec<usize>& jumps) {
+        auto m = mark();
+        auto l = try$(alloc());
+        try$(expr(lhs, l));
+        auto r = try$(alloc());
+        try$(expr(rhs, r));
+        emit(op, l, r, when);
+        jumps.pushBack(emit(Op::JMP));
+        reset(m);
+        return Ok();
+    }
+
+    // Stores the outcome of a condition that jumps away when it is false.
+    CompletionOr<> boolean(Vec<usize> const& toFalse, u16 dst) {
+        emit(Op::LOAD_CONST, dst, try$(constant(true)));
+        auto toEnd = emit(Op::JMP);
+        for (auto at : toFalse)
+            patch(at);
+        emit(Op::LOAD_CONST, dst, try$(constant(false)));
+        patch(toEnd);
+        return Ok();
+    }
+
+    // MARK: Scopes and control flow
+
+    CompletionOr<> enter(Rc<Layout> layout) {
+        if (_proto._layouts.len() == 0xffff)
+            return Completion::exception("too many scopes");
+        _proto._layouts.pushBack(layout);
+        emit(Op::ENTER, static_cast<u16>(_proto._layouts.len() - 1));
+        _scopes++;
+        return Ok();
+    }
+
+    void leave() {
+        emit(Op::LEAVE, 1);
+        _scopes--;
+    }
+
+    usize beginTry(u16 reg) {
+        _trys++;
+        return emit(Op::TRY, reg);
+    }
+
+    void endTry() {
+        emit(Op::END_TRY);
+        _trys--;
+    }
+
+    void beginLoop(u16 dst) {
+        _loops.pushBack({here(), {}, dst, _scopes, _trys});
+    }
+
+    void repeat() {
+        patch(emit(Op::JMP), _loops[_loops.len() - 1].start);
+    }
+
+    void endLoop() {
+        auto loop = _loops.popBack();
+        for (auto at : loop.breaks)
+            patch(at);
+    }
+
+    // Unwind the scopes and handlers entered since the innermost loop.
+    void _unwindTo(Loop const& loop) {
+        for (usize i = loop.trys; i < _trys; i++)
+            emit(Op::END_TRY);
+        if (_scopes > loop.scopes)
+            emit(Op::LEAVE, static_cast<u16>(_scopes - loop.scopes));
+    }
+
+    CompletionOr<> break_(Value value) {
+        if (_loops.len() == 0)
+            return return_(value);
+
+        try$(expr(value, _loops[_loops.len() - 1].dst));
+        auto& loop = _loops[_loops.len() - 1];
+        _unwindTo(loop);
+        loop.breaks.pushBack(emit(Op::JMP));
+        return Ok();
+    }
+
+    CompletionOr<> continue_(Value value) {
+        if (_loops.len() == 0)
+            return return_(value);
+
+        auto m = mark();
+        auto reg = try$(alloc());
+        try$(expr(value, reg));
+        reset(m);
+
+        auto& loop = _loops[_loops.len() - 1];
+        _unwindTo(loop);
+        patch(emit(Op::JMP), loop.start);
+        return Ok();
+    }
+
+    CompletionOr<> return_(Value value) {
+        auto m = mark();
+        auto reg = try$(alloc());
+        try$(expr(value, reg));
+        emit(Op::RETURN, reg);
+        reset(m);
+        return Ok();
+    }
+};
+
+// MARK: Quickening ------------------------------------------------------------
+
+// Arithmetic and comparisons rewrite themselves into a variant for the types
+// of the operands they see, which only has to check their tags. A variant
+// whose guard fails goes back to the generic instruction, and a site that
+// keeps seeing different types is left generic for good.
+
+static constexpr u8 MAX_DEOPTS = 4;
+
+static bool _integers(Value const& lhs, Value const& rhs) {
+    return lhs.kind() == Value::INTEGER and rhs.kind() == Value::INTEGER;
+}
+
+static bool _numbers(Value const& lhs, Value const& rhs) {
+    return lhs.kind() == Value::NUMBER and rhs.kind() == Value::NUMBER;
+}
+
+static bool _strings(Value const& lhs, Value const& rhs) {
+    return lhs.kind() == Value::STRING and rhs.kind() == Value::STRING;
+}
+
+static void _quicken(Instr& ins, Value const& lhs, Value const& rhs) {
+    if (ins.deopts >= MAX_DEOPTS)
+        return;
+
+    bool ints = _integers(lhs, rhs);
+    bool nums = _numbers(lhs, rhs);
+    switch (ins.op) {
+    case Op::ADD:
+        if (ints)
+            ins.op = Op::ADD_INT;
+        else if (nums)
+            ins.op = Op::ADD_NUM;
+        else if (_strings(lhs, rhs))
+            ins.op = Op::ADD_STR;
+        break;
+    case Op::SUB:
+        if (ints or nums)
+            ins.op = ints ? Op::SUB_INT : Op::SUB_NUM;
+        break;
+    case Op::MUL:
+        if (ints or nums)
+            ins.op = ints ? Op::MUL_INT : Op::MUL_NUM;
+        break;
+    case Op::IF_EQ:
+        if (ints)
+            ins.op = Op::IF_EQ_INT;
+        break;
+    case Op::IF_LT:
+        if (ints or nums)
+            ins.op = ints ? Op::IF_LT_INT : Op::IF_LT_NUM;
+        break;
+    case Op::IF_LTEQ:
+        if (ints or nums)
+            ins.op = ints ? Op::IF_LTEQ_INT : Op::IF_LTEQ_NUM;
+        break;
+    case Op::IF_GT:
+        if (ints or nums)
+            ins.op = ints ? Op::IF_GT_INT : Op::IF_GT_NUM;
+        break;
+    case Op::IF_GTEQ:
+        if (ints or nums)
+            ins.op = ints ? Op::IF_GTEQ_INT : Op::IF_GTEQ_NUM;
+        break;
+    case Op::ADD_CONST:
+        if (ints)
+            ins.op = Op::ADD_CONST_INT;
+        break;
+    case Op::SUB_CONST:
+        if (ints)
+            ins.op = Op::SUB_CONST_INT;
+        break;
+    default:
+        break;
+    }
+}
+
+static void _deopt(Instr& ins, Op generic) {
+    ins.op = generic;
+    ins.deopts++;
+}
+
+// MARK: Superinstructions -----------------------------------------------------
+
+// The pairs that dominate the instruction counts are fused. Arithmetic takes
+// a constant operand directly, and the field a call is made on is looked up
+// by the call. A comparison and the jump that follows it run as a single
+// instruction: the jump is taken right away, unless it goes backward and
+// has to poll.
+
+static usize _branch(Instr const* code, usize pc, bool skip) {
+    if (skip)
+        return pc + 1;
+    auto target = code[pc].target();
+    return target > pc ? target : pc;
+}
+
+// MARK: Inlining --------------------------------------------------------------
+
+// Once a prototype is hot, the calls it makes that only ever saw one small
+// function get a copy of its code, guarded by the identity of the callee:
+//
+//     CALL dst, f, site          JMP copy
+//                          ->    ...
+//                                copy: IF_SAME f, <callee>, 0
+//                                      JMP call
+//                                      <code of the callee>
+//                                      JMP back
+//                                call: CALL dst, f, site
+//                                      JMP back
+//
+// Copies are appended to the code, so frames already running it aren't
+// disturbed. The locals of the callee become registers of the caller, only
+// callees that never need an environment are copied: no scopes, closures,
+// handlers, cells or globals.
+export struct Inliner {
+    struct Report {
+        String site;
+        usize size;
+        usize depth;
+    };
+
+    bool enabled = true;
+    usize maxSize = 32; // Instructions of a callee
+    usize maxDepth = 3; // Calls inlined into each other
+    usize budget = 256; // Instructions a prototype may grow by
+    bool reporting = false;
+    Vec<Report> reports;
+
+    static Inliner& instance() {
+        static Inliner inliner;
+        return inliner;
+    }
+
+    static bool same(Value const& lhs, Value const& rhs) {
+        auto l = lhs.is<Reference>();
+        auto r = rhs.is<Reference>();
+        return l and r and &(*l).unwrap() == &(*r).unwrap();
+    }
+
+    void run(Proto& proto);
+};
+
+struct Splicer {
+    Inliner& _inliner;
+    Proto& _proto;
+    Compiler _c;
+    usize _grown = 0;
+    Vec<Proto*> _callees; // Being copied, a function isn't inlined into itself
+
+    Splicer(Inliner& inliner, Proto& proto)
+        : _inliner(inliner), _proto(proto), _c(proto) {
+        _c._top = proto._regs;
+    }
+
+    // Everything the callee does has to fit in registers.
+    bool _fits(Proto const& callee) const {
+        auto len = callee._code.len();
+        if (len > _inliner.maxSize or _grown + len > _inliner.budget)
+            return false;
+
+        for (auto& p : callee._sig) {
+            auto slot = callee._layout->lookup(p.key);
+            if (not slot or callee._layout->boxed(slot.unwrap()))
+                return false;
+        }
+
+        for (auto& ins : callee._code) {
+            switch (ins.op) {
+            case Op::LOAD_LOCAL:
+            case Op::STORE_LOCAL:
+                if (ins.b != 0 or callee._layout->boxed(ins.c))
+                    return false;
+                break;
+
+            case Op::JMP:
+            case Op::JMP_IF:
+            case Op::JMP_IF_NOT:
+            case Op::FOR_RANGE:
+            case Op::FOR_EACH:
+                if (ins.target() >= len)
+                    return false;
+                break;
+
+            case Op::NOP:
+            case Op::LOAD_CONST:
+            case Op::MOVE:
+            case Op::EQ:
+            case Op::NEQ:
+            case Op::LT:
+            case Op::LTEQ:
+            case Op::GT:
+            case Op::GTEQ:
+            case Op::ADD:
+            case Op::SUB:
+            case Op::MUL:
+            case Op::DIV:
+            case Op::MOD:
+            case Op::BIN_AND:
+            case Op::BIN_OR:
+            case Op::NOT:
+            case Op::NEG:
+            case Op::BIN_NOT:
+            case Op::TYPEOF:
+            case Op::IS:
+            case Op::AS:
+            case Op::GET:
+            case Op::SET:
+            case Op::GET_FIELD:
+            case Op::SET_FIELD:
+            case Op::TABLE:
+            case Op::LIST:
+            case Op::CALL:
+            case Op::TAILCALL:
+            case Op::CALL_FIELD:
+            case Op::IF_EQ:
+            case Op::IF_LT:
+            case Op::IF_LTEQ:
+            case Op::IF_GT:
+            case Op::IF_GTEQ:
+            case Op::IF_SAME:
+            case Op::RETURN:
+            case Op::THROW:
+            case Op::ASSERT:
+            case Op::ADD_CONST:
+            case Op::SUB_CONST:
+            case Op::ADD_INT:
+            case Op::ADD_NUM:
+            case Op::ADD_STR:
+            case Op::SUB_INT:
+            case Op::SUB_NUM:
+            case Op::MUL_INT:
+            case Op::MUL_NUM:
+            case Op::IF_EQ_INT:
+            case Op::IF_LT_INT:
+            case Op::IF_LT_NUM:
+            case Op::IF_LTEQ_INT:
+            case Op::IF_LTEQ_NUM:
+            case Op::IF_GT_INT:
+            case Op::IF_GT_NUM:
+            case Op::IF_GTEQ_INT:
+            case Op::IF_GTEQ_NUM:
+            case Op::ADD_CONST_INT:
+            case Op::SUB_CONST_INT:
+                break;
+
+            default:
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Moves an instruction of the callee over to the registers, constants,
+    // caches and code of the prototype.
+    CompletionOr<Instr> _move(Proto const& callee, Instr ins, u16 regs, Vec<usize> const& at) {
+        auto reg = [&](u16 r) {
+            return static_cast<u16>(regs + r);
+        };
+
+        switch (ins.op) {
+        case Op::NOP:
+            break;
+
+        case Op::LOAD_CONST:
+        case Op::IF_SAME:
+        case Op::ASSERT:
+            ins.a = reg(ins.a);
+            ins.b = try$(_c.constant(callee._consts[ins.b]));
+            break;
+
+        case Op::ADD_CONST:
+        case Op::SUB_CONST:
+        case Op::ADD_CONST_INT:
+        case Op::SUB_CONST_INT:
+            ins.a = reg(ins.a);
+            ins.b = reg(ins.b);
+            ins.c = try$(_c.constant(callee._consts[ins.c]));
+            break;
+
+        case Op::GET_FIELD:
+        case Op::SET_FIELD:
+            ins.a = reg(ins.a);
+            ins.b = reg(ins.b);
+            ins.c = try$(_c.property(callee._properties[ins.c]));
+            break;
+
+        case Op::JMP:
+            ins.target(at[ins.target()]);
+            break;
+
+        case Op::JMP_IF:
+        case Op::JMP_IF_NOT:
+        case Op::FOR_RANGE:
+        case Op::FOR_EACH:
+            ins.a = reg(ins.a);
+            ins.target(at[ins.target()]);
+            break;
+
+        case Op::TABLE:
+        case Op::THROW:
+            ins.a = reg(ins.a);
+            break;
+
+        // The count of items and the outcome a comparison skips on stay
+        case Op::MOVE:
+        case Op::NOT:
+        case Op::NEG:
+        case Op::BIN_NOT:
+        case Op::TYPEOF:
+        case Op::LIST:
+        case Op::IF_EQ:
+        case Op::IF_LT:
+        case Op::IF_LTEQ:
+        case Op::IF_GT:
+        case Op::IF_GTEQ:
+        case Op::IF_EQ_INT:
+        case Op::IF_LT_INT:
+        case Op::IF_LT_NUM:
+        case Op::IF_LTEQ_INT:
+        case Op::IF_LTEQ_NUM:
+        case Op::IF_GT_INT:
+        case Op::IF_GT_NUM:
+        case Op::IF_GTEQ_INT:
+        case Op::IF_GTEQ_NUM:
+            ins.a = reg(ins.a);
+            ins.b = reg(ins.b);
+            break;
+
+        default:
+            ins.a = reg(ins.a);
+            ins.b = reg(ins.b);
+            ins.c = reg(ins.c);
+            break;
+        }
+        return Ok(ins);
+    }
+
+    static Instr _jump(usize target) {
+        Instr ins{.op = Op::JMP};
+        ins.target(target);
+        return ins;
+    }
+
+    // Copies the function that `call` made from `site` always called, and
+    // returns where the copy starts, the copy goes back to `back` once done.
+    CompletionOr<Opt<usize>> splice(Instr call, CallSite site, usize back, usize depth) {
+        auto& cache = *site.cache;
+        if (call.op != Op::CALL or depth > _inliner.maxDepth or site.keyed)
+            return Ok(NONE);
+        if (cache.megamorphic or cache.misses != 1 or not cache._body)
+            return Ok(NONE);
+
+        auto& callee = *cache._body;
+        auto& func = *cache._func;
+        if (&callee == &_proto or site.shape.len() < callee._sig.len() or not _fits(callee))
+            return Ok(NONE);
+        for (auto* outer : _callees) {
+            if (outer == &callee)
+                return Ok(NONE);
+        }
+
+        // The frame of the callee, then its registers
+        auto slots = callee._layout->len();
+        auto base = _c.mark();
+        for (usize i = 0; i < slots + callee._regs; i++)
+            try$(_c.alloc());
+        auto regs = static_cast<u16>(base + slots);
+        auto slot = [&](usize i) {
+            return static_cast<u16>(base + i);
+        };
+
+        auto start = _c.here();
+        _c.emit(Op::IF_SAME, call.b, try$(_c.constant(cache._callee)));
+        auto toCall = _c.emit(Op::JMP);
+
+        Vec<bool> bound;
+        bound.resize(slots, false);
+        for (usize i : urange::zeroTo(callee._sig.len())) {
+            auto param = callee._layout->lookup(callee._sig[i].key).unwrap();
+            _c.emit(Op::MOVE, slot(param), static_cast<u16>(call.b + 1 + i));
+            bound[param] = true;
+        }
+        for (auto& u : func._upvalues) {
+            if (callee._layout->boxed(u.slot))
+                continue;
+            _c.emit(Op::LOAD_CONST, slot(u.slot), try$(_c.constant(u.cell)));
+            bound[u.slot] = true;
+        }
+        for (usize i : urange::zeroTo(slots)) {
+            if (not bound[i])
+                try$(_c.none(slot(i)));
+        }
+
+        // A return takes two instructions, everything else one
+        Vec<usize> at;
+        auto pc = _c.here();
+        for (auto& ins : callee._code) {
+            at.pushBack(pc);
+            pc += ins.op == Op::RETURN ? 2 : 1;
+        }
+
+        Vec<Tuple<usize, u16>> calls;
+        for (auto& ins : callee._code) {
+            switch (ins.op) {
+            case Op::LOAD_LOCAL:
+                _c.emit(Op::MOVE, static_cast<u16>(regs + ins.a), slot(ins.c));
+                break;
+
+            case Op::STORE_LOCAL:
+                _c.emit(Op::MOVE, slot(ins.c), static_cast<u16>(regs + ins.a));
+                break;
+
+            case Op::RETURN:
+                _c.emit(Op::MOVE, call.a, static_cast<u16>(regs + ins.a));
+                _c.patch(_c.emit(Op::JMP), back);
+                break;
+
+            // The return that follows a tail call returns from the copy
+            case Op::CALL:
+            case Op::TAILCALL:
+            case Op::CALL_FIELD: {
+                auto& from = callee._calls[ins.c];
+                auto index = try$(_c.callSite(from.shape, from.cache));
+                if (ins.op == Op::CALL_FIELD)
+                    _proto._calls[index].field = try$(_c.property(callee._properties[from.field]));
+                auto op = ins.op == Op::TAILCALL ? Op::CALL : ins.op;
+                calls.pushBack({_c.emit(op, static_cast<u16>(regs + ins.a), static_cast<u16>(regs + ins.b), index), ins.c});
+                break;
+            }
+
+            default:
+                _proto._code.pushBack(try$(_move(callee, ins, regs, at)));
+                break;
+            }
+        }
+
+        _c.patch(toCall);
+        _c.emit(Op::CALL, call.a, call.b, call.c);
+        _c.patch(_c.emit(Op::JMP), back);
+        _grown += _c.here() - start;
+
+        if (_inliner.reporting)
+            _inliner.reports.pushBack({cache.site.len() ? cache.site : String{"<call>"s}, callee._code.len(), depth});
+
+        // The calls the callee makes are candidates in turn
+        _callees.pushBack(&callee);
+        for (auto& [pos, index] : calls) {
+            auto copy = try$(splice(_proto._code[pos], callee._calls[index], pos + 1, depth + 1));
+            if (copy)
+                _proto._code[pos] = _jump(copy.unwrap());
+        }
+        _callees.popBack();
+
+        return Ok(start);
+    }
+};
+
+void Inliner::run(Proto& proto) {
+    Splicer splicer{*this, proto};
+    auto len = proto._code.len();
+    for (usize pc : urange::zeroTo(len)) {
+        auto ins = proto._code[pc];
+        if (ins.op != Op::CALL)
+            continue;
+
+        // Out of registers or constants, what was copied so far still holds
+        auto copy = splicer.splice(ins, proto._calls[ins.c], pc + 1, 1);
+        if (not copy)
+            return;
+        if (copy.unwrap())
+            proto._code[pc] = Splicer::_jump(copy.unwrap().unwrap());
+    }
+}
+
+// MARK: Dispatch --------------------------------------------------------------
+
+// Where the compiler supports it, every instruction jumps straight to the
+// next one through a table of labels, so that each has its own indirect
+// branch to predict. Otherwise it goes back around the switch.
+#if defined(__GNUC__) or defined(__clang__)
+#    define LUNA_THREADED
+#endif
+
+#ifdef LUNA_THREADED
+#    define vmCase$(OP) \
+        case Op::OP:    \
+        op_##OP
+#    define vmNext$()                                       \
+        {                                                   \
+            if constexpr (PROFILE)                          \
+                OpStats::count(ins.op, code[frame->pc].op); \
+            ins = code[frame->pc++];                        \
+            goto* targets[static_cast<u8>(ins.op)];         \
+        }
+#else
+#    define vmCase$(OP) case Op::OP
+#    define vmNext$()                                       \
+        {                                                   \
+            if constexpr (PROFILE)                          \
+                OpStats::count(ins.op, code[frame->pc].op); \
+            break;                                          \
+        }
+#endif
+
+// MARK: Virtual Machine -------------------------------------------------------
+
+export struct Vm : Roots {
+    struct Frame {
+        Proto* proto;
+        Value keep;
+        usize pc;
+        usize base;
+        Reference env;
+        Environment* scope;
+        u16 ret;
+
+        void bind(Reference e) {
+            env = e;
+            scope = e.is<Environment>();
+        }
+    };
+
+    struct Handler {
+        usize frame;
+        usize target;
+        Reference env;
+        u16 reg;
+    };
+
+    Vec<Value> _regs;
+    Vec<Frame> _frames;
+    Vec<Handler> _handlers;
+
+    void _push(Proto& proto, Value keep, usize base, Reference env, u16 ret) {
+        _regs.resize(base + proto._regs, NONE);
+        _frames.pushBack({&proto, keep, 0, base, env, env.is<Environment>(), ret});
+    }
+
+    // Reuse the current frame for a call in tail position, its registers
+    // start out empty like those of a new frame.
+    void _replace(Proto& proto, Value keep, Reference env) {
+        auto& frame = _frames[_frames.len() - 1];
+        frame.keep = keep;
+        frame.proto = &proto;
+        frame.pc = 0;
+        frame.bind(env);
+        _regs.resize(frame.base, NONE);
+        _regs.resize(frame.base + proto._regs, NONE);
+    }
+
+    // Continues the frame in native code once its prototype is hot enough
+    // to have been compiled, the calls it makes are inlined first. This may
+    // grow its code and registers.
+    CompletionOr<> _tier(Frame& frame) {
+        auto& proto = *frame.proto;
+        if (not proto._native) {
+            auto& tiering = Tiering::instance();
+            auto& inliner = Inliner::instance();
+            if ((not tiering.compile and not inliner.enabled) or proto._heat++ != tiering.threshold)
+                return Ok();
+            if (inliner.enabled) {
+                inliner.run(proto);
+                _regs.resize(frame.base + proto._regs, NONE);
+            }
+            if (not tiering.compile)
+                return Ok();
+            proto._native = tiering.compile(proto);
+            if (not proto._native)
+                return Ok();
+        }
+
+        NativeFrame native{_regs.buf() + frame.base, proto._code.buf(), frame.pc, &proto, frame.scope};
+        auto res = proto._native.unwrap()->run(native);
+        frame.pc = native.pc;
+        return res;
+    }
+
+    void trace(Heap& heap) override {
+        for (auto& v : _regs)
+            heap.mark(v);
+        for (auto& f : _frames) {
+            heap.mark(f.keep);
+            heap.mark(f.env);
+        }
+        for (auto& h : _handlers)
+            heap.mark(h.env);
+    }
+
+    CompletionOr<Value> run(Proto& proto, Reference env) {
+        RootScope roots{*this};
+        _push(proto, NONE, 0, env, 0);
+        while (true) {
+            auto res = OpStats::profiling() ? _exec<true>() : _exec<false>();
+            if (res)
+                return res;
+
+            auto completion = res.none();
+            if (completion.type != Completion::EXCEPTION or _handlers.len() == 0)
+                return completion;
+
+            auto handler = _handlers.popBack();
+            while (_frames.len() > handler.frame + 1)
+                _frames.popBack();
+            auto& frame = _frames[handler.frame];
+            _regs.resize(frame.base + frame.proto->_regs, NONE);
+            frame.pc = handler.target;
+            frame.bind(handler.env);
+            _regs[frame.base + handler.reg] = completion.value;
+        }
+    }
+
+    template <bool PROFILE>
+    CompletionOr<Value> _exec() {
+        auto* frame = &_frames[_frames.len() - 1];
+        auto* proto = frame->proto;
+        auto* code = proto->_code.buf();
+        auto* regs = _regs.buf() + frame->base;
+        auto& heap = Heap::instance();
+
+        Instr ins;
+#ifdef LUNA_THREADED
+        // Same order as Op
+        static void* const targets[] = {
+            &&op_NOP,
+            &&op_LOAD_CONST,
+            &&op_LOAD_VAR,
+            &&op_SET_VAR,
+            &&op_DECL_VAR,
+            &&op_LOAD_LOCAL,
+            &&op_STORE_LOCAL,
+            &&op_LOAD_CELL,
+            &&op_STORE_CELL,
+            &&op_LOAD_GLOBAL,
+            &&op_STORE_GLOBAL,
+            &&op_LOAD_ENV,
+            &&op_MOVE,
+            &&op_ENTER,
+            &&op_LEAVE,
+            &&op_EQ,
+            &&op_NEQ,
+            &&op_LT,
+            &&op_LTEQ,
+            &&op_GT,
+            &&op_GTEQ,
+            &&op_ADD,
+            &&op_SUB,
+            &&op_MUL,
+            &&op_DIV,
+            &&op_MOD,
+            &&op_BIN_AND,
+            &&op_BIN_OR,
+            &&op_NOT,
+            &&op_NEG,
+            &&op_BIN_NOT,
+            &&op_TYPEOF,
+            &&op_IS,
+            &&op_AS,
+            &&op_GET,
+            &&op_SET,
+            &&op_GET_FIELD,
+            &&op_SET_FIELD,
+            &&op_TABLE,
+            &&op_LIST,
+            &&op_FUNC,
+            &&op_CALL,
+            &&op_TAILCALL,
+            &&op_JMP,
+            &&op_JMP_IF,
+            &&op_JMP_IF_NOT,
+            &&op_FOR_RANGE,
+            &&op_FOR_EACH,
+            &&op_MATCH,
+            &&op_IF_EQ,
+            &&op_IF_LT,
+            &&op_IF_LTEQ,
+            &&op_IF_GT,
+            &&op_IF_GTEQ,
+            &&op_IF_SAME,
+            &&op_IF_MATCH,
+            &&op_TRY,
+            &&op_END_TRY,
+            &&op_RETURN,
+            &&op_THROW,
+            &&op_ASSERT,
+            &&op_ADD_CONST,
+            &&op_SUB_CONST,
+            &&op_CALL_FIELD,
+            &&op_ADD_INT,
+            &&op_ADD_NUM,
+            &&op_ADD_STR,
+            &&op_SUB_INT,
+            &&op_SUB_NUM,
+            &&op_MUL_INT,
+            &&op_MUL_NUM,
+            &&op_IF_EQ_INT,
+            &&op_IF_LT_INT,
+            &&op_IF_LT_NUM,
+            &&op_IF_LTEQ_INT,
+            &&op_IF_LTEQ_NUM,
+            &&op_IF_GT_INT,
+            &&op_IF_GT_NUM,
+            &&op_IF_GTEQ_INT,
+            &&op_IF_GTEQ_NUM,
+            &&op_ADD_CONST_INT,
+            &&op_SUB_CONST_INT,
+        };
+        static_assert(sizeof(targets) / sizeof(*targets) == OpStats::LEN);
+#endif
+
+        while (true) {
+            ins = code[frame->pc++];
+            switch (ins.op) {
+            vmCase$(NOP):
+                vmNext$();
+
+            vmCase$(LOAD_CONST):
+                regs[ins.a] = proto->_consts[ins.b];
+                vmNext$();
+
+            vmCase$(LOAD_VAR):
+                regs[ins.a] = try$(frame->env->get(proto->_consts[ins.b]));
+                vmNext$();
+
+            vmCase$(SET_VAR):
+                try$(frame->env->set(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(DECL_VAR):
+                try$(frame->env->decl(proto->_consts[ins.b], regs[ins.a]));
+                vmNext$();
+
+            vmCase$(LOAD_LOCAL):
+                regs[ins.a] = frame->scope->up(ins.b)->_slots[ins.c];
+                vmNext$();
+
+            vmCase$(STORE_LOCAL): {
+                auto* scope = frame->scope->up(ins.b);
+                scope->_slots[ins.c] = regs[ins.a];
+                scope->write(regs[ins.a]);
+                vmNext$();
+            }
+
+            vmCase$(LOAD_CELL):
+                regs[ins.a] = frame->scope->up(ins.b)->cell(ins.c).value;
+                vmNext$();
+
+            vmCase$(STORE_CELL):
+                frame->scope->up(ins.b)->cell(ins.c).store(regs[ins.a]);
+                vmNext$();
+
+            vmCase$(LOAD_GLOBAL):
+                regs[ins.a] = try$(proto->_globals[ins.c].load(*frame->scope, ins.b));
+                vmNext$();
+
+            vmCase$(STORE_GLOBAL):
+                try$(proto->_globals[ins.c].store(*frame->scope, ins.b, regs[ins.a]));
+                vmNext$();
+
+            vmCase$(LOAD_ENV):
+                regs[ins.a] = frame->env;
+                vmNext$();
+
+            vmCase$(MOVE):
+                regs[ins.a] = regs[ins.b];
+                vmNext$();
+
+            vmCase$(ENTER):
+                frame->bind(try$(Environment::create(frame->env, proto->_layouts[ins.a])));
+                vmNext$();
+
+            vmCase$(LEAVE):
+                for (u16 i = 0; i < ins.a; i++)
+                    frame->bind(try$(asObject(frame->scope->_parent)));
+                vmNext$();
+
+            vmCase$(EQ):
+                regs[ins.a] = try$(opEq(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(NEQ):
+                regs[ins.a] = try$(opNot(try$(opEq(regs[ins.b], regs[ins.c]))));
+                vmNext$();
+
+            vmCase$(LT):
+                regs[ins.a] = try$(opLt(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(LTEQ):
+                regs[ins.a] = try$(opLtEq(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(GT):
+                regs[ins.a] = try$(opGt(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(GTEQ):
+                regs[ins.a] = try$(opGtEq(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(ADD):
+                _quicken(code[frame->pc - 1], regs[ins.b], regs[ins.c]);
+                regs[ins.a] = try$(opAdd(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(SUB):
+                _quicken(code[frame->pc - 1], regs[ins.b], regs[ins.c]);
+                regs[ins.a] = try$(opSub(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(MUL):
+                _quicken(code[frame->pc - 1], regs[ins.b], regs[ins.c]);
+                regs[ins.a] = try$(opMul(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(DIV):
+                regs[ins.a] = try$(opDiv(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(MOD):
+                regs[ins.a] = try$(opMod(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(BIN_AND):
+                regs[ins.a] = try$(opBinAnd(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(BIN_OR):
+                regs[ins.a] = try$(opBinOr(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(NOT):
+                regs[ins.a] = try$(opNot(regs[ins.b]));
+                vmNext$();
+
+            vmCase$(NEG):
+                regs[ins.a] = try$(opNeg(regs[ins.b]));
+                vmNext$();
+
+            vmCase$(BIN_NOT):
+                regs[ins.a] = try$(opBinNot(regs[ins.b]));
+                vmNext$();
+
+            vmCase$(TYPEOF):
+                regs[ins.a] = typeOf(regs[ins.b]);
+                vmNext$();
+
+            vmCase$(IS):
+                regs[ins.a] = is(regs[ins.b], try$(asSymbol(regs[ins.c])));
+                vmNext$();
+
+            vmCase$(AS):
+                regs[ins.a] = try$(as(regs[ins.b], try$(asSymbol(regs[ins.c]))));
+                vmNext$();
+
+            vmCase$(GET):
+                regs[ins.a] = try$(opGet(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(SET):
+                try$(opSet(regs[ins.a], regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(GET_FIELD):
+                regs[ins.a] = try$(proto->_properties[ins.c]->get(regs[ins.b]));
+                vmNext$();
+
+            vmCase$(SET_FIELD):
+                try$(proto->_properties[ins.c]->set(regs[ins.a], regs[ins.b]));
+                vmNext$();
+
+            vmCase$(TABLE):
+                regs[ins.a] = try$(Table::create());
+                vmNext$();
+
+            vmCase$(LIST): {
+                Vec<Value> items;
+                for (u16 i = 0; i < ins.c; i++)
+                    items.pushBack(regs[ins.b + i]);
+                regs[ins.a] = try$(List::create(items));
+            }
+                vmNext$();
+
+            vmCase$(FUNC): {
+                auto& target = proto->_protos[ins.b];
+                Vec<Param> sig;
+                u16 def = ins.c;
+                for (auto& p : target->_sig) {
+                    Param param{p.key};
+                    param.required = not p.hasDefault;
+                    if (p.hasDefault)
+                        param.value = regs[def++];
+                    sig.pushBack(param);
+                }
+                if (target->_rootDepth)
+                    regs[ins.a] = try$(Func::close(frame->env, sig, Value{Reference{target}}, target->_layout, target->_captures, target->_rootDepth.unwrap()));
+                else
+                    regs[ins.a] = try$(Func::create(frame->env, sig, Value{Reference{target}}, target->_layout));
+            }
+                vmNext$();
+
+            vmCase$(CALL_FIELD):
+                regs[ins.b] = try$(proto->_properties[proto->_calls[ins.c].field]->get(regs[ins.b]));
+                [[fallthrough]];
+
+            vmCase$(CALL):
+            vmCase$(TAILCALL): {
+                heap.poll();
+                auto callee = regs[ins.b];
+                auto& site = proto->_calls[ins.c];
+                auto args = site.args(regs + ins.b);
+
+                auto& cache = *site.cache;
+                Func* func;
+                Proto* body;
+                if (cache.hit(callee) or cache.remember(callee)) {
+                    func = cache._func;
+                    body = cache._body;
+                } else {
+                    func = isObject(callee) ? callee.unwrap<Reference>().is<Func>() : nullptr;
+                    body = func ? CallCache::body(func) : nullptr;
+                }
+
+                // Natives return into dst, a tail call is followed by the
+                // return of its result.
+                if (not body) {
+                    regs[ins.a] = try$(opCall(callee, args));
+                } else {
+                    auto locals = try$(func->bind(args));
+                    if (ins.op == Op::TAILCALL)
+                        _replace(*body, callee, locals);
+                    else
+                        _push(*body, callee, frame->base + proto->_regs, locals, ins.a);
+                    frame = &_frames[_frames.len() - 1];
+                    proto = frame->proto;
+                    try$(_tier(*frame));
+                    code = proto->_code.buf();
+                    regs = _regs.buf() + frame->base;
+                }
+            }
+                vmNext$();
+
+            vmCase$(JMP):
+                if (ins.target() < frame->pc) {
+                    heap.poll();
+                    frame->pc = ins.target();
+                    try$(_tier(*frame));
+                    code = proto->_code.buf();
+                    regs = _regs.buf() + frame->base;
+                    vmNext$();
+                }
+                frame->pc = ins.target();
+                vmNext$();
+
+            vmCase$(JMP_IF):
+                if (try$(asBoolean(regs[ins.a])))
+                    frame->pc = ins.target();
+                vmNext$();
+
+            vmCase$(JMP_IF_NOT):
+                if (not try$(asBoolean(regs[ins.a])))
+                    frame->pc = ins.target();
+                vmNext$();
+
+            // The bounds of a range are checked to be integers on every
+            // iteration, which is all a comparison of the counter costs.
+            vmCase$(FOR_RANGE):
+                if (not _integers(regs[ins.a], regs[ins.a + 1])) [[unlikely]]
+                    return Completion::exception("range bounds must be integers");
+                if (regs[ins.a].unwrap<Integer>() < regs[ins.a + 1].unwrap<Integer>()) {
+                    regs[ins.a + 2] = regs[ins.a];
+                    regs[ins.a] = regs[ins.a].unwrap<Integer>() + 1;
+                } else {
+                    frame->pc = ins.target();
+                }
+                vmNext$();
+
+            // Items are read straight out of the list, which may change while
+            // it is iterated over.
+            vmCase$(FOR_EACH): {
+                auto* list = isObject(regs[ins.a + 1]) ? regs[ins.a + 1].unwrap<Reference>().is<List>() : nullptr;
+                if (not list) [[unlikely]]
+                    return Completion::exception("expected a list to iterate over");
+                auto index = regs[ins.a].unwrap<Integer>();
+                if (index < static_cast<Integer>(list->_items.len())) {
+                    regs[ins.a + 2] = list->_items[index];
+                    regs[ins.a] = index + 1;
+                } else {
+                    frame->pc = ins.target();
+                }
+            }
+                vmNext$();
+
+            vmCase$(MATCH):
+                frame->pc = proto->_switches[ins.b].target(regs[ins.a], frame->pc);
+                vmNext$();
+
+            vmCase$(IF_EQ):
+                _quicken(code[frame->pc - 1], regs[ins.a], regs[ins.b]);
+                frame->pc = _branch(code, frame->pc, try$(opEq(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c));
+                vmNext$();
+
+            vmCase$(IF_LT):
+                _quicken(code[frame->pc - 1], regs[ins.a], regs[ins.b]);
+                frame->pc = _branch(code, frame->pc, try$(opLt(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c));
+                vmNext$();
+
+            vmCase$(IF_LTEQ):
+                _quicken(code[frame->pc - 1], regs[ins.a], regs[ins.b]);
+                frame->pc = _branch(code, frame->pc, try$(opLtEq(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c));
+                vmNext$();
+
+            vmCase$(IF_GT):
+                _quicken(code[frame->pc - 1], regs[ins.a], regs[ins.b]);
+                frame->pc = _branch(code, frame->pc, try$(opGt(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c));
+                vmNext$();
+
+            vmCase$(IF_GTEQ):
+                _quicken(code[frame->pc - 1], regs[ins.a], regs[ins.b]);
+                frame->pc = _branch(code, frame->pc, try$(opGtEq(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c));
+                vmNext$();
+
+            vmCase$(IF_SAME):
+                frame->pc = _branch(code, frame->pc, Inliner::same(regs[ins.a], proto->_consts[ins.b]) != static_cast<bool>(ins.c));
+                vmNext$();
+
+            vmCase$(IF_MATCH):
+                frame->pc = _branch(code, frame->pc, try$(opMatch(regs[ins.a], proto->_consts[ins.b])) != static_cast<bool>(ins.c));
+                vmNext$();
+
+            vmCase$(TRY):
+                _handlers.pushBack({_frames.len() - 1, ins.target(), frame->env, ins.a});
+                vmNext$();
+
+            vmCase$(END_TRY):
+                _handlers.popBack();
+                vmNext$();
+
+            vmCase$(RETURN): {
+                auto value = regs[ins.a];
+                auto depth = _frames.len() - 1;
+                while (_handlers.len() and _handlers[_handlers.len() - 1].frame >= depth)
+                    _handlers.popBack();
+
+                auto ret = frame->ret;
+                _frames.popBack();
+                if (_frames.len() == 0)
+                    return Ok(value);
+
+                frame = &_frames[_frames.len() - 1];
+                proto = frame->proto;
+                code = proto->_code.buf();
+                _regs.resize(frame->base + proto->_regs, NONE);
+                regs = _regs.buf() + frame->base;
+                regs[ret] = value;
+            }
+                vmNext$();
+
+            vmCase$(THROW):
+                return Completion::exception(regs[ins.a]);
+
+            vmCase$(ASSERT):
+                if (not try$(asBoolean(regs[ins.a])))
+                    return Completion::exception(proto->_consts[ins.b]);
+                vmNext$();
+
+            vmCase$(ADD_CONST):
+                _quicken(code[frame->pc - 1], regs[ins.b], proto->_consts[ins.c]);
+                regs[ins.a] = try$(opAdd(regs[ins.b], proto->_consts[ins.c]));
+                vmNext$();
+
+            vmCase$(SUB_CONST):
+                _quicken(code[frame->pc - 1], regs[ins.b], proto->_consts[ins.c]);
+                regs[ins.a] = try$(opSub(regs[ins.b], proto->_consts[ins.c]));
+                vmNext$();
+
+            vmCase$(ADD_INT):
+                if (_integers(regs[ins.b], regs[ins.c])) [[likely]] {
+                    regs[ins.a] = regs[ins.b].unwrap<Integer>() + regs[ins.c].unwrap<Integer>();
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::ADD);
+                regs[ins.a] = try$(opAdd(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(ADD_NUM):
+                if (_numbers(regs[ins.b], regs[ins.c])) [[likely]] {
+                    regs[ins.a] = regs[ins.b].unwrap<Number>() + regs[ins.c].unwrap<Number>();
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::ADD);
+                regs[ins.a] = try$(opAdd(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(ADD_STR):
+                if (_strings(regs[ins.b], regs[ins.c])) [[likely]] {
+                    regs[ins.a] = StringBox::concat(regs[ins.b], regs[ins.c]);
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::ADD);
+                regs[ins.a] = try$(opAdd(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(SUB_INT):
+                if (_integers(regs[ins.b], regs[ins.c])) [[likely]] {
+                    regs[ins.a] = regs[ins.b].unwrap<Integer>() - regs[ins.c].unwrap<Integer>();
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::SUB);
+                regs[ins.a] = try$(opSub(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(SUB_NUM):
+                if (_numbers(regs[ins.b], regs[ins.c])) [[likely]] {
+                    regs[ins.a] = regs[ins.b].unwrap<Number>() - regs[ins.c].unwrap<Number>();
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::SUB);
+                regs[ins.a] = try$(opSub(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(MUL_INT):
+                if (_integers(regs[ins.b], regs[ins.c])) [[likely]] {
+                    regs[ins.a] = regs[ins.b].unwrap<Integer>() * regs[ins.c].unwrap<Integer>();
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::MUL);
+                regs[ins.a] = try$(opMul(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(MUL_NUM):
+                if (_numbers(regs[ins.b], regs[ins.c])) [[likely]] {
+                    regs[ins.a] = regs[ins.b].unwrap<Number>() * regs[ins.c].unwrap<Number>();
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::MUL);
+                regs[ins.a] = try$(opMul(regs[ins.b], regs[ins.c]));
+                vmNext$();
+
+            vmCase$(IF_EQ_INT):
+                if (_integers(regs[ins.a], regs[ins.b])) [[likely]] {
+                    frame->pc = _branch(code, frame->pc, (regs[ins.a].unwrap<Integer>() == regs[ins.b].unwrap<Integer>()) != static_cast<bool>(ins.c));
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::IF_EQ);
+                frame->pc = _branch(code, frame->pc, try$(opEq(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c));
+                vmNext$();
+
+            vmCase$(IF_LT_INT):
+                if (_integers(regs[ins.a], regs[ins.b])) [[likely]] {
+                    frame->pc = _branch(code, frame->pc, (regs[ins.a].unwrap<Integer>() < regs[ins.b].unwrap<Integer>()) != static_cast<bool>(ins.c));
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::IF_LT);
+                frame->pc = _branch(code, frame->pc, try$(opLt(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c));
+                vmNext$();
+
+            vmCase$(IF_LT_NUM):
+                if (_numbers(regs[ins.a], regs[ins.b])) [[likely]] {
+                    frame->pc = _branch(code, frame->pc, (regs[ins.a].unwrap<Number>() < regs[ins.b].unwrap<Number>()) != static_cast<bool>(ins.c));
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::IF_LT);
+                frame->pc = _branch(code, frame->pc, try$(opLt(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c));
+                vmNext$();
+
+            vmCase$(IF_LTEQ_INT):
+                if (_integers(regs[ins.a], regs[ins.b])) [[likely]] {
+                    frame->pc = _branch(code, frame->pc, (regs[ins.a].unwrap<Integer>() <= regs[ins.b].unwrap<Integer>()) != static_cast<bool>(ins.c));
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::IF_LTEQ);
+                frame->pc = _branch(code, frame->pc, try$(opLtEq(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c));
+                vmNext$();
+
+            vmCase$(IF_LTEQ_NUM):
+                if (_numbers(regs[ins.a], regs[ins.b])) [[likely]] {
+                    frame->pc = _branch(code, frame->pc, (regs[ins.a].unwrap<Number>() <= regs[ins.b].unwrap<Number>()) != static_cast<bool>(ins.c));
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::IF_LTEQ);
+                frame->pc = _branch(code, frame->pc, try$(opLtEq(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c));
+                vmNext$();
+
+            vmCase$(IF_GT_INT):
+                if (_integers(regs[ins.a], regs[ins.b])) [[likely]] {
+                    frame->pc = _branch(code, frame->pc, (regs[ins.a].unwrap<Integer>() > regs[ins.b].unwrap<Integer>()) != static_cast<bool>(ins.c));
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::IF_GT);
+                frame->pc = _branch(code, frame->pc, try$(opGt(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c));
+                vmNext$();
+
+            vmCase$(IF_GT_NUM):
+                if (_numbers(regs[ins.a], regs[ins.b])) [[likely]] {
+                    frame->pc = _branch(code, frame->pc, (regs[ins.a].unwrap<Number>() > regs[ins.b].unwrap<Number>()) != static_cast<bool>(ins.c));
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::IF_GT);
+                frame->pc = _branch(code, frame->pc, try$(opGt(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c));
+                vmNext$();
+
+            vmCase$(IF_GTEQ_INT):
+                if (_integers(regs[ins.a], regs[ins.b])) [[likely]] {
+                    frame->pc = _branch(code, frame->pc, (regs[ins.a].unwrap<Integer>() >= regs[ins.b].unwrap<Integer>()) != static_cast<bool>(ins.c));
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::IF_GTEQ);
+                frame->pc = _branch(code, frame->pc, try$(opGtEq(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c));
+                vmNext$();
+
+            vmCase$(IF_GTEQ_NUM):
+                if (_numbers(regs[ins.a], regs[ins.b])) [[likely]] {
+                    frame->pc = _branch(code, frame->pc, (regs[ins.a].unwrap<Number>() >= regs[ins.b].unwrap<Number>()) != static_cast<bool>(ins.c));
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::IF_GTEQ);
+                frame->pc = _branch(code, frame->pc, try$(opGtEq(regs[ins.a], regs[ins.b])) != static_cast<bool>(ins.c));
+                vmNext$();
+
+            vmCase$(ADD_CONST_INT):
+                if (_integers(regs[ins.b], proto->_consts[ins.c])) [[likely]] {
+                    regs[ins.a] = regs[ins.b].unwrap<Integer>() + proto->_consts[ins.c].unwrap<Integer>();
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::ADD_CONST);
+                regs[ins.a] = try$(opAdd(regs[ins.b], proto->_consts[ins.c]));
+                vmNext$();
+
+            vmCase$(SUB_CONST_INT):
+                if (_integers(regs[ins.b], proto->_consts[ins.c])) [[likely]] {
+                    regs[ins.a] = regs[ins.b].unwrap<Integer>() - proto->_consts[ins.c].unwrap<Integer>();
+                    vmNext$();
+                }
+                _deopt(code[frame->pc - 1], Op::SUB_CONST);
+                regs[ins.a] = try$(opSub(regs[ins.b], proto->_consts[ins.c]));
+                vmNext$();
+
+            default:
+                return Completion::exception("invalid instruction");
+            }
+        }
+    }
+};
+
+#undef vmCase$
+#undef vmNext$
+
+Proto* CallCache::body(Func* func) {
+    if (not func->_code.is<Value>() or not isObject(func->_code.unwrap<Value>()))
+        return nullptr;
+    return func->_code.unwrap<Value>().unwrap<Reference>().is<Proto>();
+}
+
+CompletionOr<Value> Proto::eval(Reference env) {
+    Vm vm;
+    return vm.run(*this, env);
+}
+
+} // namespace Luna
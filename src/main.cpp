@@ -8,14 +8,84 @@ import Karm.Logger;
 
 using namespace Karm;
 
+static void _dumpCacheStats() {
+    for (auto& site : Luna::CacheStats::sites()) {
+        auto total = site->hits + site->misses;
+        Sys::errln(
+            "{}: {} hits, {} misses ({}%), {}",
+            site->site,
+            site->hits,
+            site->misses,
+            total ? site->hits * 100 / total : 0,
+            site->state()
+        );
+    }
+}
+
+static void _dumpGcStats() {
+    auto& heap = Luna::Heap::instance();
+    auto& stats = heap.stats();
+    Sys::errln(
+        "gc: {} minor, {} major, {} collected, {} promoted",
+        stats.minor,
+        stats.major,
+        stats.collected,
+        stats.promoted
+    );
+    Sys::errln(
+        "gc: {} young, {} tenured, {}ms total pause, {}ms max pause",
+        heap.youngLen(),
+        heap.tenuredLen(),
+        stats.totalPause,
+        stats.maxPause
+    );
+}
+
+static void _dumpInlined() {
+    for (auto& report : Luna::Inliner::instance().reports)
+        Sys::errln("{}: inlined {} instructions at depth {}", report.site, report.size, report.depth);
+}
+
+// The pairs of instructions that ran the most, candidates for fusing.
+static void _dumpOpStats() {
+    auto counts = Luna::OpStats::pairs();
+    for (usize rank = 0; rank < 20; rank++) {
+        usize best = 0;
+        for (usize i = 0; i < counts.len(); i++) {
+            if (counts[i] > counts[best])
+                best = i;
+        }
+        if (not counts[best])
+            break;
+        Sys::errln(
+            "{} {}: {}",
+            static_cast<Luna::Op>(best / Luna::OpStats::LEN),
+            static_cast<Luna::Op>(best % Luna::OpStats::LEN),
+            counts[best]
+        );
+        counts[best] = 0;
+    }
+}
+
 Async::Task<> entryPointAsync(Sys::Env& env, Async::CancellationToken) {
     auto scriptArg = Cli::operand<Str>("script"s, "Script to run"s);
+    auto astArg = Cli::flag(NONE, "ast"s, "Use the reference AST interpreter instead of the bytecode VM"s);
+    auto noOptArg = Cli::flag(NONE, "no-opt"s, "Evaluate the program as parsed, without optimizing it first"s);
+    auto noJitArg = Cli::flag(NONE, "no-jit"s, "Keep hot functions in the bytecode interpreter instead of compiling them to machine code"s);
+    auto noInlineArg = Cli::flag(NONE, "no-inline"s, "Keep calls to small functions as calls instead of inlining them into hot callers"s);
+    auto icStatsArg = Cli::flag(NONE, "ic-stats"s, "Print the hit rate of every inline cache on exit"s);
+    auto gcStatsArg = Cli::flag(NONE, "gc-stats"s, "Print the collections and pause times of the heap on exit"s);
+    auto opStatsArg = Cli::flag(NONE, "op-stats"s, "Print the pairs of instructions that ran the most on exit"s);
+    auto inlineStatsArg = Cli::flag(NONE, "inline-stats"s, "Print every call site that was inlined on exit"s);
+    auto perfMapArg = Cli::flag(NONE, "perf-map"s, "Describe compiled code in /tmp/perf-<pid>.map for perf"s);
 
     Cli::Command cmd{
         "luna"s,
         "A scripting language"s,
         {
             Cli::Section{"Input"s, {scriptArg}},
+            Cli::Section{"Engine"s, {astArg, noOptArg, noJitArg, noInlineArg}},
+            Cli::Section{"Debug"s, {icStatsArg, gcStatsArg, opStatsArg, inlineStatsArg, perfMapArg}},
         }
     };
 
@@ -23,6 +93,16 @@ Async::Task<> entryPointAsync(Sys::Env& env, Async::CancellationToken) {
     if (not cmd)
         co_return Ok();
 
+    auto engine = astArg.value() ? Luna::Engine::AST : Luna::Engine::VM;
+    Luna::Optimizer::enabled() = not noOptArg.value();
+    Luna::CacheStats::profiling() = icStatsArg.value() or inlineStatsArg.value();
+    Luna::Inliner::instance().enabled = not noInlineArg.value();
+    Luna::Inliner::instance().reporting = inlineStatsArg.value();
+    Luna::OpStats::profiling() = opStatsArg.value();
+    Luna::Jit::perfMap() = perfMapArg.value();
+    if (not noJitArg.value())
+        Luna::Jit::install();
+
     if (scriptArg.value()) {
         auto url = Ref::parseUrlOrPath(scriptArg.value(), env.cwd());
         auto code = co_try$(Sys::readAllUtf8(url));
@@ -34,15 +114,20 @@ Async::Task<> entryPointAsync(Sys::Env& env, Async::CancellationToken) {
             co_return Error::invalidInput("parser error");
         }
 
-        auto evalRes = Luna::opEval(parseRes.take(), Luna::builtins().take());
-        if (not evalRes) {
-            auto completion = evalRes.none();
-            if (completion.type == Luna::Completion::EXCEPTION) {
-                logError("runtime error {}: {}", scriptArg.value(), evalRes.none().value);
-                co_return Error::invalidInput("runtime error");
-            }
+        auto program = parseRes.take();
+        auto evalRes = Luna::evalExpr(program.body, Luna::builtins().take(), engine);
+        if (icStatsArg.value())
+            _dumpCacheStats();
+        if (gcStatsArg.value())
+            _dumpGcStats();
+        if (opStatsArg.value())
+            _dumpOpStats();
+        if (inlineStatsArg.value())
+            _dumpInlined();
 
-            evalRes = Ok(completion.value);
+        if (not evalRes) {
+            logError("runtime error {}: {}", scriptArg.value(), evalRes.none().value);
+            co_return Error::invalidInput("runtime error");
         }
 
         co_return Ok();
@@ -65,18 +150,23 @@ Async::Task<> entryPointAsync(Sys::Env& env, Async::CancellationToken) {
             continue;
         }
 
-        auto evalRes = Luna::opEval(parseRes.take(), vm);
+        auto program = parseRes.take();
+        auto evalRes = Luna::evalExpr(program.body, vm, engine);
         if (not evalRes) {
-            auto completion = evalRes.none();
-            if (completion.type == Luna::Completion::EXCEPTION) {
-                Sys::errln("runtime error: {}", completion.value);
-            } else {
-                Sys::println("{}", completion.value);
-            }
+            Sys::errln("runtime error: {}", evalRes.none().value);
         } else {
             Sys::println("{}", evalRes.take());
         }
     }
 
+    if (icStatsArg.value())
+        _dumpCacheStats();
+    if (gcStatsArg.value())
+        _dumpGcStats();
+    if (opStatsArg.value())
+        _dumpOpStats();
+    if (inlineStatsArg.value())
+        _dumpInlined();
+
     co_return Ok();
 }
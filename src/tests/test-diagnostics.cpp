@@ -183,6 +183,61 @@ test$("parser E0112 - unclosed index expression") {
     return Ok();
 }
 
+test$("parser E0113 - for loop without in") {
+    Str code = "for (i 0..10) i"s;
+    DiagCollector diag{code};
+    auto result = parse(code, diag);
+
+    expect$(not result);
+    expect$(hasErrorCode(diag, "E0113"s));
+
+    return Ok();
+}
+
+test$("parser E0103 - expected '=' in constant declaration") {
+    Str code = "const x"s;
+    DiagCollector diag{code};
+    auto result = parse(code, diag);
+
+    expect$(not result);
+    expect$(hasErrorCode(diag, "E0103"s));
+
+    return Ok();
+}
+
+test$("parser E0114 - constant outside of a block") {
+    Str code = "var f = fn() const x = 1"s;
+    DiagCollector diag{code};
+    auto result = parse(code, diag);
+
+    expect$(not result);
+    expect$(hasErrorCode(diag, "E0114"s));
+
+    return Ok();
+}
+
+test$("parser E0115 - match arm without ':'") {
+    Str code = "match (x) { 1 2 }"s;
+    DiagCollector diag{code};
+    auto result = parse(code, diag);
+
+    expect$(not result);
+    expect$(hasErrorCode(diag, "E0115"s));
+
+    return Ok();
+}
+
+test$("parser E0116 - unclosed match") {
+    Str code = "match (x) { 1: 2 3"s;
+    DiagCollector diag{code};
+    auto result = parse(code, diag);
+
+    expect$(not result);
+    expect$(hasErrorCode(diag, "E0116"s));
+
+    return Ok();
+}
+
 test$("parser E0200 - expression is not assignable") {
     Str code = "(1+1) = 5"s;
     DiagCollector diag{code};
@@ -1,6 +1,7 @@
 #include <karm/test>
 
 import Luna;
+import Karm.Core;
 import Karm.Test;
 import Karm.Sys;
 import Karm.Ref;
@@ -10,21 +11,134 @@ using namespace Karm;
 
 namespace Luna::Tests {
 
-test$("luna eval") {
+// Runs check on every script of the corpus, up to the first one it fails
+static Res<> _forEachScript(auto check) {
     auto testsDir = try$(Sys::Dir::open("bundle://luna-lang.tests/"_url));
     for (auto& i : testsDir.entries()) {
         auto subDir = try$(Sys::Dir::open(testsDir.url() / i.name));
         for (auto& j : subDir.entries()) {
             auto url = subDir.url() / j.name;
             auto code = try$(Sys::readAllUtf8(url));
-            auto result = Luna::evalStr(code);
+            try$(check(url, code));
+        }
+    }
+    return Ok();
+}
+
+test$("luna eval") {
+    return _forEachScript([&](Ref::Url const& url, Str code) -> Res<> {
+        // Every script must pass under both the reference interpreter and the VM
+        for (auto engine : {Engine::AST, Engine::VM}) {
+            auto result = Luna::evalStr(code, engine);
             if (not result) {
-                logError("{} failed: {}", url, result.none().value);
+                logError("{} failed ({}): {}", url, engine, result.none().value);
                 return Error::other("exception occured");
             }
 
             expectEq$(result.unwrap(), "pass"_sym);
         }
+        return Ok();
+    });
+}
+
+// Differential run: the optimizer must not change what a script evaluates to
+test$("luna optimizer") {
+    Defer restore{[] {
+        Optimizer::enabled() = true;
+    }};
+
+    return _forEachScript([&](Ref::Url const& url, Str code) -> Res<> {
+        for (auto engine : {Engine::AST, Engine::VM}) {
+            Optimizer::enabled() = false;
+            auto expected = Luna::evalStr(code, engine);
+            Optimizer::enabled() = true;
+            auto actual = Luna::evalStr(code, engine);
+
+            if (static_cast<bool>(expected) != static_cast<bool>(actual)) {
+                logError("{} ({}): optimized and unoptimized runs disagree", url, engine);
+                return Error::other("optimizer changed the outcome");
+            }
+
+            if (expected)
+                expectEq$(expected.unwrap(), actual.unwrap());
+            else
+                expectEq$(expected.none().value, actual.none().value);
+        }
+        return Ok();
+    });
+}
+
+// Constants can't be assigned, nor share their scope with another declaration
+test$("luna const") {
+    for (auto code : {
+             "const x = 1; x = 2"s,
+             "const x = 1; var f = fn() { x = 2 }; f()"s,
+             "{ const x = 1; var x = 2 }"s,
+             "{ var x = 1; const x = 2 }"s,
+             "var x = 1; const x = 2"s,
+         }) {
+        for (auto engine : {Engine::AST, Engine::VM})
+            expect$(not Luna::evalStr(code, engine));
+    }
+
+    // Inputs of the REPL run one after the other in the same environment
+    for (auto engine : {Engine::AST, Engine::VM}) {
+        auto env = builtins().take();
+        Defer release{[&] {
+            Heap::instance().release(*env.is<Environment>(), NONE);
+        }};
+        expect$(bool(Luna::evalStr("const x = 1; var y = 1"s, env, engine)));
+        expect$(not Luna::evalStr("x = 2"s, env, engine));
+        expect$(not Luna::evalStr("var x = 2"s, env, engine));
+        expect$(not Luna::evalStr("const y = 2"s, env, engine));
+        expect$(bool(Luna::evalStr("y = 2; var y = 3; x + y"s, env, engine)));
+    }
+
+    return Ok();
+}
+
+// Puts tiering back the way the other tests expect it, however a test ends
+static void _restoreTiering() {
+    Tiering::instance().compile = nullptr;
+    Tiering::instance().threshold = 1000;
+}
+
+// Compile every function on first use so the corpus runs through native code
+test$("luna jit") {
+    Defer restore{_restoreTiering};
+    Jit::install();
+    Tiering::instance().threshold = 0;
+
+    return _forEachScript([&](Ref::Url const& url, Str code) -> Res<> {
+        auto result = Luna::evalStr(code, Engine::VM);
+        if (not result) {
+            logError("{} failed (jit): {}", url, result.none().value);
+            return Error::other("exception occured");
+        }
+
+        expectEq$(result.unwrap(), "pass"_sym);
+        return Ok();
+    });
+}
+
+// Inline calls as soon as their sites have been seen, with and without the JIT
+test$("luna inline") {
+    Defer restore{_restoreTiering};
+    Tiering::instance().threshold = 2;
+
+    for (auto jit : {false, true}) {
+        if (jit)
+            Jit::install();
+        try$(_forEachScript([&](Ref::Url const& url, Str code) -> Res<> {
+            auto result = Luna::evalStr(code, Engine::VM);
+            if (not result) {
+                logError("{} failed (inline, jit: {}): {}", url, jit, result.none().value);
+                return Error::other("exception occured");
+            }
+
+            expectEq$(result.unwrap(), "pass"_sym);
+            return Ok();
+        }));
     }
 
     return Ok();